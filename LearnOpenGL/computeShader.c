@@ -2,7 +2,13 @@
 
 #version 430 core
 
-layout(local_size_x = 10, local_size_y = 10, local_size_z = 1) in;
+// the workgroup shape comes from the preamble (workgroup_size.h); partial workgroups at the
+// right and top edges return early in main
+#ifndef WORKGROUP_WIDTH
+#define WORKGROUP_WIDTH 8
+#define WORKGROUP_HEIGHT 8
+#endif
+layout(local_size_x = WORKGROUP_WIDTH, local_size_y = WORKGROUP_HEIGHT, local_size_z = 1) in;
 
 struct Material
 {
@@ -34,67 +40,389 @@ struct BVH
     vec4 data; // {triangleIndex1, triangleIndex2, hit, miss}
 };
 
+// sized by the buffers bound to them. triangles and BVH nodes that do not fit in one shader
+// storage block continue in a second one, see getTriangle and getNode
 layout (std140, binding = 4) buffer SphereBlock {
-    Sphere spheres [10000];
+    Sphere spheres [];
 };
 
 layout(std140, binding = 5) buffer TriangleBlock
 {
-    Triangle triangles [100000];
+    Triangle triangles [];
+};
+
+layout(std140, binding = 17) buffer TriangleOverflowBlock
+{
+    Triangle trianglesOverflow [];
 };
 
 layout (std140, binding = 6) buffer MaterialBlock {
-    Material materials [100];
+    Material materials [];
 };
 
-layout(std140, binding = 7) buffer CameraInfo
+layout(std140, binding = 8) buffer BVHBlock
 {
-    vec4 camera_position;
-    vec4 camera_direction;
-    vec4 camera_data; //fov
+    BVH heirarchy [];
 };
 
-layout(std140, binding = 8) buffer BVHBlock
+layout(std140, binding = 18) buffer BVHOverflowBlock
+{
+    BVH heirarchyOverflow [];
+};
+
+layout(std430, binding = 9) buffer RayCounter
+{
+    uint rayCount;     // read back and reset by the host
+    uint blockedCount; // segments found blocked by the ray query benchmark
+};
+
+// the accumulation of every pixel. sum is kept in double precision so the mean does not
+// drift however many samples are added; mean is its float copy for the resolve pass, the
+// denoiser and the adaptive sampler
+struct PixelStats
+{
+    dvec4 sum;  // {sum of samples.rgb, sample count}
+    vec4 mean;  // {mean.rgb, sample count}
+    vec4 m2;    // {sum of squared deviations.rgb, converged}
+};
+layout(std430, binding = 10) buffer PixelStatsBlock
+{
+    PixelStats pixelStats[];
+};
+
+// adaptive sampling tiles of ADAPTIVE_TILE_SIZE^2 pixels:
+// {summed relative error * 1024, unconverged pixels, samples per pixel to take, samples taken}
+// the host reads the first, second and fourth back, resets them and writes the third
+layout(std430, binding = 11) buffer TileBlock
+{
+    uvec4 tiles[];
+};
+
+// AOVs of the first hit, AOV_ENTRIES per pixel:
+// {normal, distance}, {albedo, material id} and {position, object id}
+// normal, distance, albedo and position are running means over the pixel's samples and zero
+// where every sample missed the scene. the ids come from the first sample, -1 on a miss.
+// the third entry is only written when aovExtras is set
+layout(std430, binding = 12) buffer AovBlock
+{
+    vec4 pixelAovs[];
+};
+
+// emissive triangles and spheres for next-event estimation, two entries per light:
+// {type, primitive index, alias threshold, alias index} of an alias table over their power and
+// {branches from the light tree root to the light, unused...}. built by header_files/light_sampling.h
+layout(std430, binding = 13) readonly buffer LightBlock
+{
+    vec4 lights[];
+};
+
+// light tree over the same lights, root first. see buildLightTree in header_files/bvh.h
+struct LightNode
+{
+    vec4 minPoint; // w = power
+    vec4 maxPoint; // w = cos of the normal cone half angle
+    vec4 axis;     // normal cone axis, w = cos of the emission spread around it
+    vec4 data;     // {light index or first child, second child (-1 for leaves), two sided, unused}
+};
+
+layout(std430, binding = 14) readonly buffer LightTreeBlock
+{
+    LightNode lightTree[];
+};
+
+// second set of {hit, miss} links over the BVH nodes for isOccluded, trying the child most
+// likely to block a ray first. see build_occlusion_links in header_files/bvh.h
+layout(std430, binding = 15) readonly buffer OcclusionLinkBlock
 {
-    BVH heirarchy [100000];
+    vec2 occlusionLinks[];
 };
 
-layout(rgba32f, binding = 0) uniform image2D imgOutput;
+// blue-noise ranks of a BLUE_NOISE_SIZE^2 tile for the rank1 sampler, see
+// header_files/blue_noise.h
+layout(std430, binding = 16) readonly buffer BlueNoiseBlock
+{
+    uint blueNoise[];
+};
 
-layout(location = 0) uniform float t;                 /* Time */
-layout(location = 1) uniform int frame;
-layout(location = 2) uniform int numSpheres;
-layout(location = 3) uniform int numTriangles;
-layout(location = 4) uniform int numMaterials;
-layout(location = 5) uniform int numNodes;
-layout(location = 6) uniform int accumulate;
-layout(location = 7) uniform int displayMode;
+// equirectangular environment map and the CDFs for sampling it, laid out as described in
+// header_files/environment_map.h. only read when environmentMapped is set
+layout(binding = 1) uniform sampler2D environmentMap;
+layout(binding = 2) uniform sampler2D environmentCdf;
 
+// Everything that changes per frame or per dispatch, written by the host into a persistently
+// mapped ring of these blocks (header_files/frame_constants.h, keep the layouts in sync)
+layout(std140, binding = 0) uniform FrameConstants
+{
+    vec4 camera_position;
+    vec4 camera_direction;
+    ivec2 imageDims;
+    float t;                  // time
+    int frame;
+    int numSpheres;
+    int numTriangles;
+    int numMaterials;
+    int numNodes;
+    int trianglesPerBlock;    // triangles in TriangleBlock, the rest are in TriangleOverflowBlock
+    int nodesPerBlock;        // nodes in BVHBlock, the rest are in BVHOverflowBlock
+    int accumulate;
+    int samplesPerDispatch;   // per pixel, unless adaptive sampling hands them out per tile
+    int maxBounceCount;
+    int minBounceCount;       // Russian roulette starts after this many bounces
+    int numLights;            // 0 turns next-event estimation off
+    float lightPower;         // summed luminance * area of the lights
+    float environmentIntegral; // of the map's sampling function, normalizes its pdf
+    float convergenceThreshold; // relative standard error of the mean luminance
+    int rayQueryBenchmark;    // 1 closest hit, 2 occlusion: time the query instead of tracing paths
+};
 
-int maxBounceCount = 5;
+// The settings that only change on a key press or with the scene are compiled in by the
+// host's #define preamble (see pathTraceDefines), so the branches on them fold away. The
+// defaults only apply to a build without it.
+#ifndef ADAPTIVE
+#define ADAPTIVE 0
+#endif
+#ifndef AOV_EXTRAS
+#define AOV_EXTRAS 0
+#endif
+#ifndef LIGHT_TREE_SAMPLING
+#define LIGHT_TREE_SAMPLING 1
+#endif
+#ifndef ORDERED_OCCLUSION
+#define ORDERED_OCCLUSION 1
+#endif
+#ifndef ENVIRONMENT_MAPPED
+#define ENVIRONMENT_MAPPED 0
+#endif
+#ifndef ENVIRONMENT_SAMPLING
+#define ENVIRONMENT_SAMPLING 0
+#endif
+#ifndef SAMPLER_TYPE
+#define SAMPLER_TYPE 1
+#endif
+const int adaptive = ADAPTIVE;
+const int aovExtras = AOV_EXTRAS;                     // also keep the hit position and ids in the AOVs
+const int lightTreeSampling = LIGHT_TREE_SAMPLING;    // pick lights with the light tree instead of by power
+const int orderedOcclusion = ORDERED_OCCLUSION;       // isOccluded follows occlusionLinks instead of the BVH's own links
+const int environmentMapped = ENVIRONMENT_MAPPED;     // light escaping rays from environmentMap instead of the sky gradient
+const int environmentSampling = ENVIRONMENT_SAMPLING; // next-event estimation also samples environmentMap
+const int samplerType = SAMPLER_TYPE;                 // SAMPLER_* for the path samples
+
+uint raysTraced = 0u; // per invocation, added to rayCount once at the end
+
+#ifdef RAY_STATS
+// traversal counters, only compiled in when the host defines RAY_STATS. Totals of
+// {BVH nodes visited, triangle tests, sphere tests, bounces} since the host last read them,
+// then per pixel {nodes, triangle and sphere tests, bounces, rays} summed over the samples
+// accumulated so far, for the heatmap of resolveShader.c
+layout(std430, binding = 19) buffer RayStatsBlock
+{
+    uvec4 rayStatTotals;
+    uvec4 pixelRayStats[];
+};
+uvec4 rayStats = uvec4(0u); // per invocation: nodes, triangle tests, sphere tests, bounces
+#define COUNT_RAY_STAT(counter, n) rayStats.counter += uint(n)
+#else
+#define COUNT_RAY_STAT(counter, n)
+#endif
 
 const float PI = 3.141592;
-const bool render_triangles = true;
-const bool render_spheres = true;
-const bool antiAlias = true;
+#ifndef RENDER_TRIANGLES
+#define RENDER_TRIANGLES true
+#endif
+#ifndef RENDER_SPHERES
+#define RENDER_SPHERES true
+#endif
+#ifndef ANTI_ALIAS
+#define ANTI_ALIAS true
+#endif
+const bool render_triangles = RENDER_TRIANGLES;
+const bool render_spheres = RENDER_SPHERES;
+const bool antiAlias = ANTI_ALIAS;
+
+const int RAY_QUERY_BENCHMARK_RAYS = 16; // per invocation, keep in sync with cpu_path_trace.h
+const int ADAPTIVE_TILE_SIZE = 16;   // keep in sync with adaptive_sampling.h
+const int ADAPTIVE_MIN_SAMPLES = 16; // before a pixel may be considered converged
+
+const int AOV_ENTRIES = 3; // keep in sync with aov.h
+
+const int LIGHT_TRIANGLE = 0; // keep in sync with light_sampling.h
+const int LIGHT_SPHERE = 1;
+const float SHADOW_EPSILON = 0.001; // shadow rays stop this fraction short of the light
+const float ENVIRONMENT_SELECT_PROBABILITY = 0.5; // share of light samples given to the environment when there are also emitters
+const float ENVIRONMENT_DISTANCE = 1e30;          // shadow ray length towards the environment
 
 // Environment Settings
-bool EnvironmentEnabled = true;
+#ifndef ENVIRONMENT_ENABLED
+#define ENVIRONMENT_ENABLED true
+#endif
+const bool EnvironmentEnabled = ENVIRONMENT_ENABLED;
+
+Triangle getTriangle(int index)
+{
+    return index < trianglesPerBlock ? triangles[index] : trianglesOverflow[index - trianglesPerBlock];
+}
+
+vec4 triangleMaterialData(int index)
+{
+    return index < trianglesPerBlock ? triangles[index].materialData : trianglesOverflow[index - trianglesPerBlock].materialData;
+}
+
+BVH getNode(int index)
+{
+    return index < nodesPerBlock ? heirarchy[index] : heirarchyOverflow[index - nodesPerBlock];
+}
+
+
+
+
+// Counter-based random numbers, see header_files/random_stream.h for the C++ twin and the
+// samplers. Every value is a function of (pixel, sample index, bounce, dimension), so the
+// stream is the same whatever the dispatch size, tile order or backend.
+const uint SAMPLER_INDEPENDENT = 0u;
+const uint SAMPLER_SOBOL = 1u;
+const uint SAMPLER_RANK1 = 2u;
+
+// fixed dimension of every decision in a bounce
+const uint DIMENSION_BSDF = 0u;         // 2: diffuse direction
+const uint DIMENSION_LOBE = 2u;         // diffuse or specular
+const uint DIMENSION_LIGHT_POINT = 3u;  // 2: point on the light or environment direction
+const uint DIMENSION_LIGHT_SELECT = 5u; // environment or emitters
+const uint DIMENSION_LIGHT_PICK = 6u;   // 2: which emitter
+const uint DIMENSION_ROULETTE = 8u;
+const uint DIMENSIONS_PER_BOUNCE = 9u;
+
+const int BLUE_NOISE_SIZE = 64; // keep in sync with blue_noise.h
 
+struct RandomStream
+{
+    uint pixel;       // y * width + x
+    uint sampleIndex; // 0 for the first sample accumulated into the pixel
+    uint bounce;      // 0 for camera ray generation, i + 1 for bounce i of the path
+    uint dimension;   // advanced by every draw, reset on each bounce
+    uvec2 coords;     // pixel coordinates, for the blue-noise tile
+    uint sampler;
+};
+
+const uint SOBOL_DIRECTIONS[64] = uint[64](
+    0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+    0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+    0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+    0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+    0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+    0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+    0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+    0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u);
+
+const uint RANK1_DIMENSIONS = 32u;
+const uint RANK1_GENERATOR[32] = uint[32](
+    1u, 729u, 1589u, 1929u, 1723u, 695u, 1785u, 487u, 1223u, 679u, 1033u, 1769u, 1367u, 1607u, 871u, 87u,
+    233u, 1737u, 855u, 1209u, 1577u, 809u, 633u, 1863u, 617u, 41u, 601u, 313u, 663u, 1705u, 3463u, 553u);
+
+const uint SOBOL_SEED_KEY = 0x50b01u;
+const uint RANK1_SHIFT_KEY = 0x2a4c1u;
+
+// pcg4d from Jarzynski and Olano, "Hash Functions for GPU Rendering" (JCGT 2020)
+uvec4 pcg4d(uvec4 v)
+{
+    v = v * 1664525u + 1013904223u;
 
+    v.x += v.y * v.w;
+    v.y += v.z * v.x;
+    v.z += v.x * v.y;
+    v.w += v.y * v.z;
 
+    v ^= v >> 16u;
 
-uint NextRandom(inout uint state)
+    v.x += v.y * v.w;
+    v.y += v.z * v.x;
+    v.z += v.x * v.y;
+    v.w += v.y * v.z;
+
+    return v;
+}
+
+RandomStream make_random_stream(uint pixel, uint sampleIndex, uvec2 coords, uint sampler)
 {
-    state = state * 747796405 + 2891336453;
-    uint result = ((state >> ((state >> 28) + 4)) ^ state) * 277803737;
-    result = (result >> 22) ^ result;
-    return result;
+    return RandomStream(pixel, sampleIndex, 0u, 0u, coords, sampler);
 }
 
-float random(inout uint state)
+void random_stream_set_bounce(inout RandomStream s, uint bounce)
 {
-    return NextRandom(state) / 4294967295.0; // 2^32 - 1
+    s.bounce = bounce;
+    s.dimension = 0u;
+}
+
+void random_stream_set_dimension(inout RandomStream s, uint dimension)
+{
+    s.dimension = dimension;
+}
+
+uint laine_karras_permutation(uint x, uint seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+uint nested_uniform_scramble(uint x, uint seed)
+{
+    return bitfieldReverse(laine_karras_permutation(bitfieldReverse(x), seed));
+}
+
+uint sobol(uint index, uint dimension)
+{
+    if (dimension == 0u) {
+        return bitfieldReverse(index);
+    }
+    // only the set bits, the shuffled index is a full 32-bit number
+    uint x = 0u;
+    for (; index != 0u; index &= index - 1u) {
+        x ^= SOBOL_DIRECTIONS[32u * (dimension - 1u) + uint(findLSB(index))];
+    }
+    return x;
+}
+
+uint sobol_sample(RandomStream s)
+{
+    uvec4 seeds = pcg4d(uvec4(s.pixel, s.bounce, s.dimension / 3u, SOBOL_SEED_KEY));
+    uint axis = s.dimension % 3u;
+    uint index = nested_uniform_scramble(s.sampleIndex, seeds.x);
+    return nested_uniform_scramble(sobol(index, axis), axis == 0u ? seeds.y : (axis == 1u ? seeds.z : seeds.w));
+}
+
+uint rank1_sample(RandomStream s, uint latticeDimension)
+{
+    uvec4 offset = pcg4d(uvec4(latticeDimension, RANK1_SHIFT_KEY, 0u, 0u));
+    uvec2 tile = (s.coords + offset.xy) % uint(BLUE_NOISE_SIZE);
+    uint jitter = pcg4d(uvec4(s.pixel, RANK1_SHIFT_KEY, s.bounce, s.dimension)).x;
+    uint shift = (blueNoise[tile.y * uint(BLUE_NOISE_SIZE) + tile.x] << 20u) | (jitter >> 12u);
+    return bitfieldReverse(s.sampleIndex) * RANK1_GENERATOR[latticeDimension] + shift;
+}
+
+uint NextRandom(inout RandomStream s)
+{
+    uint value;
+    uint latticeDimension = s.bounce * DIMENSIONS_PER_BOUNCE + s.dimension;
+    if (s.sampler == SAMPLER_RANK1 && s.dimension < DIMENSIONS_PER_BOUNCE && latticeDimension < RANK1_DIMENSIONS) {
+        value = rank1_sample(s, latticeDimension);
+    }
+    else if (s.sampler != SAMPLER_INDEPENDENT) {
+        value = sobol_sample(s);
+    }
+    else {
+        value = pcg4d(uvec4(s.pixel, s.sampleIndex, s.bounce, s.dimension)).x;
+    }
+    s.dimension++;
+    return value;
+}
+
+// uniform in [0, 1). 24 bits so the float conversion is exact on every backend
+float random(inout RandomStream state)
+{
+    return float(NextRandom(state) >> 8u) * (1.0 / 16777216.0);
 }
 
 float GPURnd(inout vec4 state)
@@ -112,20 +440,40 @@ float GPURnd(inout vec4 state)
     return fract(dot(state / m, vec4(1.0, -1.0, 1.0, -1.0)));
 }
 
-float RandomValueNormalDistribution(inout uint state)
+// u and v complete w (normalized) to an orthonormal basis (Duff et al. 2017)
+void orthonormalBasis(vec3 w, out vec3 u, out vec3 v)
 {
-    float theta = 2 * 3.1415926 * random(state);
-    float rho = sqrt(-2 * log(random(state)));
-    return rho * cos(theta);
+    float signZ = w.z >= 0.0 ? 1.0 : -1.0;
+    float a = -1.0 / (signZ + w.z);
+    float b = w.x * w.y * a;
+    u = vec3(1.0 + signZ * w.x * w.x * a, signZ * b, -signZ * w.x);
+    v = vec3(b, signZ + w.y * w.y * a, -w.y);
 }
 
-vec3 random_unit_vector(inout uint state)
+// cosine-weighted direction around n from two uniform numbers, a point on the unit disk
+// projected up onto the hemisphere
+vec3 cosineHemisphere(vec3 n, float u1, float u2)
 {
-    vec3 ret = vec3(
-        RandomValueNormalDistribution(state),
-        RandomValueNormalDistribution(state), 
-        RandomValueNormalDistribution(state));
-    return normalize(ret);
+    vec3 u, v;
+    orthonormalBasis(n, u, v);
+    float r = sqrt(u1);
+    float phi = 2.0 * PI * u2;
+    return normalize(u * (r * cos(phi)) + v * (r * sin(phi)) + n * sqrt(max(1.0 - u1, 0.0)));
+}
+
+float luminance(vec3 c)
+{
+    return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// texel of the environment map that direction dir (normalized) falls in
+ivec2 environmentTexel(vec3 dir)
+{
+    ivec2 size = textureSize(environmentMap, 0);
+    float phi = dir.x == 0.0 && dir.y == 0.0 ? 0.0 : atan(dir.y, dir.x);
+    float u = 0.5 - phi / (2.0 * PI);
+    float v = 1.0 - acos(clamp(dir.z, -1.0, 1.0)) / PI;
+    return clamp(ivec2(vec2(u, v) * vec2(size)), ivec2(0), size - 1);
 }
 
 vec3 getEnvironmentLight(vec3 ray_d)
@@ -135,6 +483,9 @@ vec3 getEnvironmentLight(vec3 ray_d)
     }
 
     vec3 dir = normalize(ray_d);
+    if (environmentMapped == 1) {
+        return texelFetch(environmentMap, environmentTexel(dir), 0).rgb;
+    }
     float t = 0.5 * (dir.z + 1.0);
     return (1.0 - t) * vec3(1.0, 1.0, 1.0) + t * vec3(0.5, 0.7, 1.0);
 }
@@ -231,7 +582,7 @@ float RayIntersectsTriangle(vec3 ray_o,
     out vec3 normal)
 {
     const float EPSILON = 0.0000001;
-    Triangle test = triangles[triangle_ind];
+    Triangle test = getTriangle(triangle_ind);
     vec3 vertex0 = test.v0.xyz;
     vec3 vertex1 = test.v1.xyz;
     vec3 vertex2 = test.v2.xyz;
@@ -273,7 +624,7 @@ float RayIntersectsTriangle(vec3 ray_o,
 
 float hit_triangle(vec3 ray_o, vec3 ray_d, int triangle_ind, out vec3 normal)
 {
-    Triangle test = triangles[triangle_ind];
+    Triangle test = getTriangle(triangle_ind);
 
     vec3 v0 = test.v0.xyz;
     vec3 v1 = test.v1.xyz;
@@ -364,11 +715,14 @@ bool bvh_intersect(BVH b, vec3 ray_o, vec3 ray_d, float cur_t)
     return true;
 }
 
-void calculateRayCollision(vec3 ray_o, vec3 ray_d, inout vec3 normal, inout vec3 hitPoint, inout bool hit, out int materialIndex)
+// lightIndex is the hit primitive's entry in LightBlock, -1 if it does not emit
+void calculateRayCollision(vec3 ray_o, vec3 ray_d, inout vec3 normal, inout vec3 hitPoint, inout bool hit, out int materialIndex, out int objectIndex, out int lightIndex)
 {
     float t = 1. / 0.;
+    lightIndex = -1;
 
     if (render_spheres) {
+        COUNT_RAY_STAT(z, numSpheres);
         for (int sphere_index = 0; sphere_index < numSpheres; sphere_index++) {
             float hit_t = hit_sphere(ray_o, ray_d, sphere_index);
             if (hit_t > 0.0001 && hit_t < t)
@@ -381,6 +735,8 @@ void calculateRayCollision(vec3 ray_o, vec3 ray_d, inout vec3 normal, inout vec3
                 normal = potential_normal;
                 hitPoint = ray_o + hit_t * ray_d;
                 materialIndex = int(spheres[sphere_index].materialData.x);
+                objectIndex = int(spheres[sphere_index].materialData.y);
+                lightIndex = int(spheres[sphere_index].materialData.z);
             }
         }
     }
@@ -392,7 +748,8 @@ void calculateRayCollision(vec3 ray_o, vec3 ray_d, inout vec3 normal, inout vec3
     //for(int bvh_ind = numNodes - 1; bvh_ind > -1;)
     for (int bvh_ind = 0; bvh_ind > -1;)
     {
-        BVH b = heirarchy[bvh_ind];
+        BVH b = getNode(bvh_ind);
+        COUNT_RAY_STAT(x, 1);
 
         bool hit_box = bvh_intersect(b, ray_o, ray_d, t);
 
@@ -405,6 +762,7 @@ void calculateRayCollision(vec3 ray_o, vec3 ray_d, inout vec3 normal, inout vec3
 
         if(hit_box && (b.data.x > -1))
         {
+            COUNT_RAY_STAT(y, 2);
             float hit_t = hit_triangle(ray_o, ray_d, int(b.data[0]), running_normal);
             float hit_t2 = hit_triangle(ray_o, ray_d, int(b.data[1]), running_normal2);
 
@@ -415,7 +773,10 @@ void calculateRayCollision(vec3 ray_o, vec3 ray_d, inout vec3 normal, inout vec3
                 t = hit_t;
                 normal = running_normal;
                 hitPoint = ray_o + (hit_t * ray_d);
-                materialIndex = int(triangles[int(b.data[0])].materialData.x);
+                vec4 materialData = triangleMaterialData(int(b.data[0]));
+                materialIndex = int(materialData.x);
+                objectIndex = int(materialData.y);
+                lightIndex = int(materialData.z);
             }
             else if (hit_t2 > 0.0001 && hit_t2 < t)
             {
@@ -424,15 +785,384 @@ void calculateRayCollision(vec3 ray_o, vec3 ray_d, inout vec3 normal, inout vec3
                 t = hit_t2;
                 normal = running_normal2;
                 hitPoint = ray_o + (hit_t2 * ray_d);
-                materialIndex = int(triangles[int(b.data[1])].materialData.x);
+                vec4 materialData = triangleMaterialData(int(b.data[1]));
+                materialIndex = int(materialData.x);
+                objectIndex = int(materialData.y);
+                lightIndex = int(materialData.z);
             }
         }
         bvh_ind = next_index;
     }
 }
 
-vec3 Trace(vec3 ray_o, vec3 ray_d, inout uint state)
+// true when anything lies along ray_d (normalized) closer than maxT. Unlike
+// calculateRayCollision it stops at the first hit found
+bool isOccluded(vec3 ray_o, vec3 ray_d, float maxT)
+{
+    if (render_spheres) {
+        for (int sphere_index = 0; sphere_index < numSpheres; sphere_index++) {
+            COUNT_RAY_STAT(z, 1);
+            float hit_t = hit_sphere(ray_o, ray_d, sphere_index);
+            if (hit_t > 0.0001 && hit_t < maxT) {
+                return true;
+            }
+        }
+    }
+
+    if (!render_triangles) { return false; }
+
+    vec3 normal;
+    for (int bvh_ind = 0; bvh_ind > -1;)
+    {
+        BVH b = getNode(bvh_ind);
+        COUNT_RAY_STAT(x, 1);
+
+        bool hit_box = bvh_intersect(b, ray_o, ray_d, maxT);
+        if (hit_box && (b.data.x > -1))
+        {
+            COUNT_RAY_STAT(y, 1);
+            float hit_t = hit_triangle(ray_o, ray_d, int(b.data[0]), normal);
+            if (hit_t > 0.0001 && hit_t < maxT) {
+                return true;
+            }
+            if (b.data[1] != b.data[0]) {
+                COUNT_RAY_STAT(y, 1);
+                hit_t = hit_triangle(ray_o, ray_d, int(b.data[1]), normal);
+                if (hit_t > 0.0001 && hit_t < maxT) {
+                    return true;
+                }
+            }
+        }
+        vec2 links = orderedOcclusion == 1 ? occlusionLinks[bvh_ind] : b.data.zw;
+        bvh_ind = hit_box ? int(links.x) : int(links.y);
+    }
+    return false;
+}
+
+vec3 materialEmission(Material m)
+{
+    return m.emissionColor.rgb * m.data.x;
+}
+
+// probability that the alias table picks light `index`, its share of the power
+float lightPowerPmf(int index)
+{
+    vec4 light = lights[2 * index];
+    int primitive = int(light.y);
+    if (int(light.x) == LIGHT_TRIANGLE) {
+        Triangle tri = getTriangle(primitive);
+        float area = 0.5 * length(cross(tri.v1.xyz - tri.v0.xyz, tri.v2.xyz - tri.v0.xyz));
+        return luminance(materialEmission(materials[int(tri.materialData.x)])) * area / lightPower;
+    }
+    float r = spheres[primitive].data.w;
+    return luminance(materialEmission(materials[int(spheres[primitive].materialData.x)])) * 4.0 * PI * r * r / lightPower;
+}
+
+float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 1.0 : cosA * cosB + sinA * sinB;
+}
+
+float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 0.0 : sinA * cosB - cosA * sinB;
+}
+
+// conservative estimate of what the lights below `node` can send to a surface at p with
+// normal n (pbrt-v4's LightBounds::Importance). zero only if none of them can reach p
+float lightNodeImportance(LightNode node, vec3 p, vec3 n)
+{
+    vec3 pMin = node.minPoint.xyz;
+    vec3 pMax = node.maxPoint.xyz;
+    float power = node.minPoint.w;
+    float cosThetaO = node.maxPoint.w;
+    float cosThetaE = node.axis.w;
+
+    vec3 center = 0.5 * (pMin + pMax);
+    float radiusSquared = 0.25 * dot(pMax - pMin, pMax - pMin);
+    float distanceSquared = dot(p - center, p - center);
+    // pbrt's clamp, keeps nearby nodes from blowing up while still favouring the closer one
+    float falloff = max(distanceSquared, 0.5 * length(pMax - pMin));
+    if (distanceSquared <= radiusSquared) {
+        return power / falloff; // inside the bounding sphere every direction is possible
+    }
+
+    // angle from the cone axis to p, less the cone's spread and the angle the bounds subtend
+    vec3 wi = (p - center) * inversesqrt(distanceSquared);
+    float cosThetaW = dot(node.axis.xyz, wi);
+    if (node.data.z > 0.0) {
+        cosThetaW = abs(cosThetaW);
+    }
+    float sinThetaW = sqrt(max(1.0 - cosThetaW * cosThetaW, 0.0));
+    float sinThetaO = sqrt(max(1.0 - cosThetaO * cosThetaO, 0.0));
+    float cosThetaB = sqrt(max(1.0 - radiusSquared / distanceSquared, 0.0));
+    float sinThetaB = sqrt(max(1.0 - cosThetaB * cosThetaB, 0.0));
+
+    float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= cosThetaE) {
+        return 0.0;
+    }
+
+    // and the surface's own cosine, as large as the bounds allow
+    float cosThetaI = abs(dot(wi, n));
+    float sinThetaI = sqrt(max(1.0 - cosThetaI * cosThetaI, 0.0));
+    float cosThetaIP = cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+
+    return power * cosThetaP * cosThetaIP / falloff;
+}
+
+// probability that the light tree, descended from p with normal n, ends at light `index`.
+// follows the branches stored with the light instead of searching
+float lightTreePmf(int index, vec3 p, vec3 n)
+{
+    uint trail = uint(lights[2 * index + 1].x);
+    float pmf = 1.0;
+    int node = 0;
+    while (lightTree[node].data.y >= 0.0) {
+        LightNode parent = lightTree[node];
+        float importance0 = lightNodeImportance(lightTree[int(parent.data.x)], p, n);
+        float importance1 = lightNodeImportance(lightTree[int(parent.data.y)], p, n);
+        if (importance0 + importance1 <= 0.0) {
+            return 0.0;
+        }
+        bool second = (trail & 1u) != 0u;
+        pmf *= (second ? importance1 : importance0) / (importance0 + importance1);
+        node = int(second ? parent.data.y : parent.data.x);
+        trail >>= 1u;
+    }
+    return pmf;
+}
+
+// probability that next-event estimation at p with normal n picks light `index`
+float lightSelectionPmf(int index, vec3 p, vec3 n)
+{
+    return lightTreeSampling == 1 ? lightTreePmf(index, p, n) : lightPowerPmf(index);
+}
+
+// picks a light for a surface at p with normal n, or returns -1 if none can reach it
+int pickLight(vec3 p, vec3 n, inout RandomStream state, out float pmf)
+{
+    random_stream_set_dimension(state, DIMENSION_LIGHT_PICK);
+    if (lightTreeSampling == 0) {
+        int index = min(int(random(state) * float(numLights)), numLights - 1);
+        vec4 light = lights[2 * index];
+        if (random(state) >= light.z) {
+            index = int(light.w);
+        }
+        pmf = lightPowerPmf(index);
+        return index;
+    }
+
+    // descend the tree, choosing each child in proportion to its importance and reusing
+    // what is left of the random number for the next level
+    float u = random(state);
+    pmf = 1.0;
+    int node = 0;
+    // the leaf is read inside the loop. With llvmpipe, reading it after a loop that other
+    // invocations leave through the `return -1` below changed the image, differently for each
+    // workgroup shape
+    for (;;) {
+        LightNode parent = lightTree[node];
+        if (parent.data.y < 0.0) {
+            return int(parent.data.x);
+        }
+        float importance0 = lightNodeImportance(lightTree[int(parent.data.x)], p, n);
+        float importance1 = lightNodeImportance(lightTree[int(parent.data.y)], p, n);
+        if (importance0 + importance1 <= 0.0) {
+            return -1;
+        }
+        float p0 = importance0 / (importance0 + importance1);
+        if (u < p0) {
+            u = min(u / p0, 0.99999994);
+            pmf *= p0;
+            node = int(parent.data.x);
+        }
+        else {
+            u = min((u - p0) / (1.0 - p0), 0.99999994);
+            pmf *= 1.0 - p0;
+            node = int(parent.data.y);
+        }
+    }
+}
+
+// solid angle pdf, seen from `from`, of a uniformly chosen point p with normal n on triangle t
+float triangleLightPdf(int t, vec3 from, vec3 p, vec3 n)
 {
+    Triangle tri = getTriangle(t);
+    float area = 0.5 * length(cross(tri.v1.xyz - tri.v0.xyz, tri.v2.xyz - tri.v0.xyz));
+    vec3 toLight = p - from;
+    float distanceSquared = dot(toLight, toLight);
+    float cosLight = abs(dot(n, toLight)) * inversesqrt(distanceSquared);
+    return distanceSquared / (max(cosLight, 1e-6) * area);
+}
+
+// solid angle pdf of a direction chosen uniformly in the cone sphere s covers seen from
+// `from`. zero from inside the sphere, where it is never sampled
+float sphereLightPdf(int s, vec3 from)
+{
+    vec3 toCenter = spheres[s].data.xyz - from;
+    float r = spheres[s].data.w;
+    float distanceSquared = dot(toCenter, toCenter);
+    if (distanceSquared <= r * r) {
+        return 0.0;
+    }
+    float cosMax = sqrt(max(1.0 - r * r / distanceSquared, 0.0));
+    return 1.0 / (2.0 * PI * (1.0 - cosMax));
+}
+
+// share of next-event estimation samples that go to the environment map
+float environmentSelectPmf()
+{
+    if (environmentSampling == 0) {
+        return 0.0;
+    }
+    return numLights > 0 ? ENVIRONMENT_SELECT_PROBABILITY : 1.0;
+}
+
+// first of the count texels along row `row` of environmentCdf whose CDF value exceeds u
+int environmentCdfSearch(int row, int count, float u)
+{
+    int first = 0;
+    int last = count - 1;
+    while (first < last) {
+        int middle = (first + last) / 2;
+        if (texelFetch(environmentCdf, ivec2(middle, row), 0).x > u) {
+            last = middle;
+        }
+        else {
+            first = middle + 1;
+        }
+    }
+    return first;
+}
+
+// picks a direction in proportion to the environment's luminance: a row from the marginal
+// CDF, then a texel from the row's conditional CDF. returns the solid angle pdf and radiance
+vec3 sampleEnvironment(float u1, float u2, out float pdf, out vec3 radiance)
+{
+    ivec2 size = textureSize(environmentMap, 0);
+
+    int row = environmentCdfSearch(size.y, size.y, u1);
+    float rowStart = row > 0 ? texelFetch(environmentCdf, ivec2(row - 1, size.y), 0).x : 0.0;
+    float rowEnd = texelFetch(environmentCdf, ivec2(row, size.y), 0).x;
+    float dv = (u1 - rowStart) / max(rowEnd - rowStart, 1e-12);
+
+    int column = environmentCdfSearch(row, size.x, u2);
+    float columnStart = column > 0 ? texelFetch(environmentCdf, ivec2(column - 1, row), 0).x : 0.0;
+    vec2 columnEnd = texelFetch(environmentCdf, ivec2(column, row), 0).xy;
+    float du = (u2 - columnStart) / max(columnEnd.x - columnStart, 1e-12);
+
+    vec2 uv = (vec2(column, row) + clamp(vec2(du, dv), 0.0, 1.0)) / vec2(size);
+    float theta = PI * (1.0 - uv.y);
+    float phi = (0.5 - uv.x) * 2.0 * PI;
+    float sinTheta = sin(theta);
+
+    // pdf over [0,1]^2 is the texel's function value over the integral, dw = 2 pi^2 sin(theta) du dv
+    pdf = sinTheta > 0.0 ? columnEnd.y / (environmentIntegral * 2.0 * PI * PI * sinTheta) : 0.0;
+    radiance = texelFetch(environmentMap, ivec2(column, row), 0).rgb;
+    return vec3(sinTheta * cos(phi), sinTheta * sin(phi), cos(theta));
+}
+
+// solid angle pdf of sampleEnvironment returning dir (normalized)
+float environmentPdf(vec3 dir)
+{
+    float sinTheta = sqrt(max(1.0 - dir.z * dir.z, 0.0));
+    if (sinTheta <= 0.0) {
+        return 0.0;
+    }
+    return texelFetch(environmentCdf, environmentTexel(dir), 0).y / (environmentIntegral * 2.0 * PI * PI * sinTheta);
+}
+
+// solid angle pdf of next-event estimation from a surface at `from` with normal n reaching
+// point p (normal lightNormal) on light `index`, for weighting a bounce that hit it
+float lightPdf(int index, vec3 from, vec3 n, vec3 p, vec3 lightNormal)
+{
+    vec4 light = lights[2 * index];
+    float pointPdf = int(light.x) == LIGHT_TRIANGLE ? triangleLightPdf(int(light.y), from, p, lightNormal) : sphereLightPdf(int(light.y), from);
+    return (1.0 - environmentSelectPmf()) * lightSelectionPmf(index, from, n) * pointPdf;
+}
+
+// Next-event estimation: picks a light for the surface at `from` with normal n and a point on
+// it. Returns the normalized direction and distance to the point, the solid angle pdf of the
+// choice and the emitted radiance, or false when nothing can be sampled from `from`
+bool sampleLight(vec3 from, vec3 n, inout RandomStream state, out vec3 lightDir, out float lightDistance, out float pdf, out vec3 emission)
+{
+    random_stream_set_dimension(state, DIMENSION_LIGHT_SELECT);
+    float environmentPmf = environmentSelectPmf();
+    if (environmentPmf > 0.0 && random(state) < environmentPmf) {
+        random_stream_set_dimension(state, DIMENSION_LIGHT_POINT);
+        float u1 = random(state);
+        float u2 = random(state);
+        lightDir = sampleEnvironment(u1, u2, pdf, emission);
+        lightDistance = ENVIRONMENT_DISTANCE;
+        pdf *= environmentPmf;
+        return pdf > 0.0;
+    }
+
+    float pmf;
+    int index = pickLight(from, n, state, pmf);
+    random_stream_set_dimension(state, DIMENSION_LIGHT_POINT);
+    float u1 = random(state);
+    float u2 = random(state);
+    if (index < 0) {
+        return false;
+    }
+    vec4 light = lights[2 * index];
+    int primitive = int(light.y);
+
+    if (int(light.x) == LIGHT_TRIANGLE)
+    {
+        Triangle tri = getTriangle(primitive);
+        emission = materialEmission(materials[int(tri.materialData.x)]);
+
+        // uniform on the triangle
+        float su = sqrt(u1);
+        vec3 p = (1.0 - su) * tri.v0.xyz + (u2 * su) * tri.v1.xyz + (su * (1.0 - u2)) * tri.v2.xyz;
+        vec3 lightNormal = normalize(cross(tri.v1.xyz - tri.v0.xyz, tri.v2.xyz - tri.v0.xyz));
+
+        lightDistance = length(p - from);
+        lightDir = (p - from) / lightDistance;
+        pdf = pmf * triangleLightPdf(primitive, from, p, lightNormal);
+    }
+    else
+    {
+        Sphere sphere = spheres[primitive];
+        emission = materialEmission(materials[int(sphere.materialData.x)]);
+
+        vec3 toCenter = sphere.data.xyz - from;
+        float r = sphere.data.w;
+        float distanceSquared = dot(toCenter, toCenter);
+        if (distanceSquared <= r * r) {
+            return false;
+        }
+
+        // uniform in the cone of directions the sphere covers
+        float cosMax = sqrt(max(1.0 - r * r / distanceSquared, 0.0));
+        float cosTheta = 1.0 - u1 * (1.0 - cosMax);
+        float sinTheta = sqrt(max(1.0 - cosTheta * cosTheta, 0.0));
+        float phi = 2.0 * PI * u2;
+
+        vec3 w = toCenter * inversesqrt(distanceSquared);
+        vec3 u, v;
+        orthonormalBasis(w, u, v);
+
+        lightDir = normalize(u * (cos(phi) * sinTheta) + v * (sin(phi) * sinTheta) + w * cosTheta);
+        lightDistance = sqrt(distanceSquared) * cosTheta - sqrt(max(r * r - distanceSquared * sinTheta * sinTheta, 0.0));
+        pdf = pmf * sphereLightPdf(primitive, from);
+    }
+    pdf *= 1.0 - environmentPmf;
+    return pdf > 0.0;
+}
+
+// normalDepth, albedo and position receive the first hit's AOVs, see AovBlock
+vec3 Trace(vec3 ray_o, vec3 ray_d, inout RandomStream state, out vec4 normalDepth, out vec4 albedo, out vec4 position)
+{
+    normalDepth = vec4(0.0);
+    albedo = vec4(0.0, 0.0, 0.0, -1.0);
+    position = vec4(0.0, 0.0, 0.0, -1.0);
+
     vec3 incomingLight = vec3(0.0);
     vec3 rayColor = vec3(1.0);
 
@@ -442,45 +1172,55 @@ vec3 Trace(vec3 ray_o, vec3 ray_d, inout uint state)
     vec3 hitPoint = vec3(0.0);
     bool hit = false;
     int materialInd;
+    int objectInd;
+    int lightInd;
+
+    // solid angle pdf of the diffuse bounce that led here and the normal it left from, for
+    // weighting the light it hits against next-event estimation. 0 for camera rays and
+    // specular bounces, which next-event estimation does not cover
+    float bsdfPdf = 0.0;
+    vec3 bsdfNormal = vec3(0.0);
 
     //--------------
     for (int i = 0; i <= maxBounceCount; i++)
     {
+        random_stream_set_bounce(state, uint(i + 1));
+
         hit = false;
-        calculateRayCollision(ray_o, ray_d, normal, hitPoint, hit, materialInd);
+        calculateRayCollision(ray_o, ray_d, normal, hitPoint, hit, materialInd, objectInd, lightInd);
+        raysTraced++;
+        COUNT_RAY_STAT(w, 1);
 
-        if (hit && length(rayColor) > 0.01) //dark colors will not gain from more bounces
+        if (hit)
         {
-            if(displayMode == 2)
-            {
-                vec3 normalColor = (normal + 1.0) * 0.5;
-                return normalColor;
-            }
-            if(displayMode == 4)
-            {
-                float s = length(hitPoint - ray_o);
-                float distance = (1.0 - sqrt(s + 1) / (s + 1.0));
-                vec3 distanceColor = vec3(distance * distance);
-                return distanceColor;
+            if (i == 0) {
+                normalDepth = vec4(normal, length(hitPoint - ray_o));
+                albedo = vec4(materials[materialInd].color.rgb, float(materialInd));
+                position = vec4(hitPoint, float(objectInd));
             }
 
-            ray_o = hitPoint;
-            vec3 diffuseDir = normalize(normal + random_unit_vector(state));
-
-
-            vec3 specularDir = normalize(reflect(ray_d, normal));
-
             Material hit_mat = materials[materialInd];
             float specularProbability = hit_mat.data.z;
             float smoothness = hit_mat.data.y;
-            float emissionStrength = hit_mat.data.x;
 
-            if (displayMode == 3) {
-                vec3 objectColor = hit_mat.color.rgb;
-                return objectColor;
+            // multiple importance sampling (balance heuristic) against next-event estimation
+            vec3 emittedLight = materialEmission(hit_mat);
+            float misWeight = 1.0;
+            if (numLights > 0 && bsdfPdf > 0.0 && lightInd >= 0) {
+                float hitLightPdf = lightPdf(lightInd, ray_o, bsdfNormal, hitPoint, normal);
+                misWeight = bsdfPdf / (bsdfPdf + hitLightPdf);
             }
+            incomingLight += emittedLight * rayColor * misWeight;
+
+            ray_o = hitPoint;
+            random_stream_set_dimension(state, DIMENSION_BSDF);
+            float diffuseU1 = random(state);
+            float diffuseU2 = random(state);
+            vec3 diffuseDir = cosineHemisphere(normal, diffuseU1, diffuseU2);
+            vec3 specularDir = normalize(reflect(ray_d, normal));
 
             float isSpecularBounce = 0.0;
+            random_stream_set_dimension(state, DIMENSION_LOBE);
             if (specularProbability > random(state))
             {
                 isSpecularBounce = 1.0;
@@ -488,11 +1228,52 @@ vec3 Trace(vec3 ray_o, vec3 ray_d, inout uint state)
 
             ray_d = mix(diffuseDir, specularDir, (smoothness * isSpecularBounce));
 
-            vec3 emittedLight = hit_mat.emissionColor.rgb * emissionStrength;
-            incomingLight += emittedLight * rayColor;
+            // next-event estimation for the diffuse lobe, (1 - specularProbability) * color / PI.
+            // skipped on the last bounce, where a bounce could not find the light either
+            float diffuseProbability = 1.0 - specularProbability;
+            if ((numLights > 0 || environmentSampling == 1) && diffuseProbability > 0.0 && i < maxBounceCount)
+            {
+                vec3 lightDir, lightEmission;
+                float lightDistance, lightPdf;
+                if (sampleLight(hitPoint, normal, state, lightDir, lightDistance, lightPdf, lightEmission))
+                {
+                    float cosSurface = dot(normal, lightDir);
+                    if (cosSurface > 0.0)
+                    {
+                        raysTraced++;
+                        if (!isOccluded(hitPoint, lightDir, lightDistance * (1.0 - SHADOW_EPSILON)))
+                        {
+                            float lightBsdfPdf = diffuseProbability * cosSurface / PI;
+                            // f * cos / lightPdf * lightPdf / (lightPdf + lightBsdfPdf), f * cos = color * lightBsdfPdf
+                            incomingLight += rayColor * hit_mat.color.rgb * lightEmission * (lightBsdfPdf / (lightPdf + lightBsdfPdf));
+                        }
+                    }
+                }
+            }
+            bsdfPdf = isSpecularBounce > 0.0 ? 0.0 : diffuseProbability * max(dot(normal, ray_d), 0.0) / PI;
+            bsdfNormal = normal;
+
             rayColor = rayColor * mix(hit_mat.color.rgb, hit_mat.specularColor.rgb, isSpecularBounce);
+
+            // Russian roulette on the throughput, survivors are reweighted so the estimate stays
+            // unbiased. A black throughput can never contribute again and stops at any depth
+            float survival = min(max(rayColor.r, max(rayColor.g, rayColor.b)), 0.95);
+            random_stream_set_dimension(state, DIMENSION_ROULETTE);
+            if (survival <= 0.0 || (i >= minBounceCount && random(state) >= survival)) {
+                break;
+            }
+            if (i >= minBounceCount) {
+                rayColor /= survival;
+            }
         }else{
-            incomingLight += getEnvironmentLight(ray_d) * rayColor;
+            // weighted against next-event estimation like a light that was hit
+            float misWeight = 1.0;
+            float environmentPmf = environmentSelectPmf();
+            if (environmentPmf > 0.0 && bsdfPdf > 0.0) {
+                float environmentLightPdf = environmentPmf * environmentPdf(normalize(ray_d));
+                misWeight = bsdfPdf / (bsdfPdf + environmentLightPdf);
+            }
+            incomingLight += getEnvironmentLight(ray_d) * rayColor * misWeight;
             break;
         }
     }
@@ -502,31 +1283,110 @@ vec3 Trace(vec3 ray_o, vec3 ray_d, inout uint state)
 
 
 
-void main()
+// Fires RAY_QUERY_BENCHMARK_RAYS segments between random points in the scene's bounds through
+// the query rayQueryBenchmark selects and returns how many were blocked. Closest hit has to
+// find the nearest surface before it can compare it with the segment, occlusion stops at the
+// first surface found on it
+int benchmarkRayQueries(uint pixelIndex)
 {
-    int raysPerPixel = 1;
+    RandomStream state = make_random_stream(pixelIndex, uint(frame), uvec2(0u), SAMPLER_INDEPENDENT);
+    vec3 boundsMin = getNode(0).minPoint.xyz;
+    vec3 extent = getNode(0).maxPoint.xyz - boundsMin;
+
+    int blocked = 0;
+    for (int i = 0; i < RAY_QUERY_BENCHMARK_RAYS; i++) {
+        vec3 a, b;
+        a.x = random(state);
+        a.y = random(state);
+        a.z = random(state);
+        b.x = random(state);
+        b.y = random(state);
+        b.z = random(state);
+        a = boundsMin + extent * a;
+        b = boundsMin + extent * b;
+        float segmentLength = length(b - a);
+        vec3 ray_d = (b - a) / max(segmentLength, 1e-6);
+
+        bool isBlocked;
+        if (rayQueryBenchmark == 1) {
+            vec3 normal, hitPoint;
+            bool hit = false;
+            int materialInd, objectInd, lightInd;
+            calculateRayCollision(a, ray_d, normal, hitPoint, hit, materialInd, objectInd, lightInd);
+            isBlocked = hit && length(hitPoint - a) < segmentLength;
+        }
+        else {
+            isBlocked = isOccluded(a, ray_d, segmentLength);
+        }
+        raysTraced++;
+        blocked += isBlocked ? 1 : 0;
+    }
+    return blocked;
+}
 
-    vec3 pixel = vec3(0.0, 0.0, 0.0);
+void main()
+{
     ivec2 pixel_coords = ivec2(gl_GlobalInvocationID.xy);
 
-    ivec2 dims = imageSize(imgOutput);
+    ivec2 dims = imageDims;
+    // llvmpipe can run lanes past the workgroup's width, on the next workgroup's pixels, with
+    // their writes masked off. Their BVH loops never advance and keep the vector's loops going
+    // until its iteration limit ends all of them, paths included (every path ended after one
+    // bounce in 4x8 workgroups). Lanes that have returned no longer count
+    if (any(greaterThanEqual(gl_LocalInvocationID.xy, gl_WorkGroupSize.xy))) {
+        return;
+    }
+    if (pixel_coords.x >= dims.x || pixel_coords.y >= dims.y) {
+        return; // partial workgroup at the right or top edge
+    }
+
+    uint pixelIndex = uint(pixel_coords.y * dims.x + pixel_coords.x);
 
-    uint pixelIndex = pixel_coords.y * 831266 + pixel_coords.x * 923766;
-    uint randomState = pixelIndex + frame * 719393;
+    if (rayQueryBenchmark > 0) {
+        atomicAdd(blockedCount, uint(benchmarkRayQueries(pixelIndex)));
+        atomicAdd(rayCount, raysTraced);
+        return;
+    }
+    int aovIndex = AOV_ENTRIES * int(pixelIndex);
 
-    float zoom = 10.0;
+    ivec2 tile_coords = pixel_coords / ADAPTIVE_TILE_SIZE;
+    int tileIndex = tile_coords.y * ((dims.x + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE) + tile_coords.x;
+
+    dvec4 sum = dvec4(0.0);
+    vec4 mean = vec4(0.0);
+    vec4 m2 = vec4(0.0);
+    vec4 normalDepth = vec4(0.0);
+    vec4 albedo = vec4(0.0);
+    vec4 position = vec4(0.0);
+    if (accumulate == 1) {
+        sum = pixelStats[pixelIndex].sum;
+        mean = pixelStats[pixelIndex].mean;
+        m2 = pixelStats[pixelIndex].m2;
+        normalDepth = pixelAovs[aovIndex];
+        albedo = pixelAovs[aovIndex + 1];
+        if (aovExtras == 1) {
+            position = pixelAovs[aovIndex + 2];
+        }
+    }
+
+    int raysPerPixel = samplesPerDispatch;
+    if (adaptive == 1) {
+        if (m2.w > 0.5) {
+            return; // converged, nothing to trace
+        }
+        raysPerPixel = int(tiles[tileIndex].z);
+    }
 
     vec3 forward = normalize(camera_direction.xyz);
     vec3 up = vec3(0.0, 0.0, 1.0);
     vec3 camRight = normalize(cross(forward, up));
     vec3 camUp = normalize(cross(camRight, forward)) * float(dims.y) / float(dims.x);
 
-    //vec3 up = vec3(0.0, 0.0, float(dims.y) / (dims.x * zoom));
-    //vec3 right = vec3(float(dims.x) / (dims.x * zoom) , 0.0, 0.0);
-
     vec3 cam_o = camera_position.xyz;//vec3(0.0, -6.0, 1.0);
 
     for (int rays = 0; rays < raysPerPixel; rays++) {
+        RandomStream randomState = make_random_stream(pixelIndex, uint(mean.w), uvec2(pixel_coords), uint(samplerType));
+
         float antiAX = 0, antiAY = 0;
         if (antiAlias)
         {
@@ -539,17 +1399,59 @@ void main()
         vec3 ray_d = forward + camRight * x + camUp * z;
         ray_d = normalize(ray_d);
 
-        pixel += Trace(cam_o, ray_d, randomState);
+        vec4 sampleNormalDepth, sampleAlbedo, samplePosition;
+        vec3 pixel = Trace(cam_o, ray_d, randomState, sampleNormalDepth, sampleAlbedo, samplePosition);
+
+        // the mean from the exact sum, the variance with Welford's update
+        sum += dvec4(pixel, 1.0);
+        vec3 delta = pixel - mean.rgb;
+        mean = vec4(vec3(sum.rgb / sum.w), float(sum.w));
+        m2.rgb += delta * (pixel - mean.rgb);
+
+        normalDepth += (sampleNormalDepth - normalDepth) / mean.w;
+        albedo.rgb += (sampleAlbedo.rgb - albedo.rgb) / mean.w;
+        position.xyz += (samplePosition.xyz - position.xyz) / mean.w;
+        if (mean.w == 1.0) {
+            albedo.w = sampleAlbedo.w;
+            position.w = samplePosition.w;
+        }
     }
-    pixel /= float(raysPerPixel);
 
-    vec4 final_color = vec4(pixel, 1.0); 
+    // relative standard error of the mean luminance
+    float relativeError = 1.0;
+    if (mean.w > 1.0) {
+        float variance = luminance(m2.rgb) / (mean.w - 1.0);
+        relativeError = sqrt(max(variance, 0.0) / mean.w) / max(luminance(mean.rgb), 1e-3);
+    }
+    if (mean.w >= float(ADAPTIVE_MIN_SAMPLES) && relativeError < convergenceThreshold) {
+        m2.w = 1.0;
+    }
 
-    if (accumulate == 1) {
-        vec4 previous_color = imageLoad(imgOutput, pixel_coords).rgba;
-        final_color = (previous_color * ((float(frame) - 1.0) / float(frame))) + (vec4(pixel, 1.0) / float(frame));
+    if (adaptive == 1) {
+        if (m2.w < 0.5) {
+            atomicAdd(tiles[tileIndex].x, uint(min(relativeError, 64.0) * 1024.0));
+            atomicAdd(tiles[tileIndex].y, 1u);
+        }
+        atomicAdd(tiles[tileIndex].w, uint(raysPerPixel));
     }
 
-    imageStore(imgOutput, pixel_coords, final_color);
-}
+    pixelStats[pixelIndex].sum = sum;
+    pixelStats[pixelIndex].mean = mean;
+    pixelStats[pixelIndex].m2 = m2;
+    pixelAovs[aovIndex] = normalDepth;
+    pixelAovs[aovIndex + 1] = albedo;
+    if (aovExtras == 1) {
+        pixelAovs[aovIndex + 2] = position;
+    }
+
+#ifdef RAY_STATS
+    uvec4 pixelStatsSum = uvec4(rayStats.x, rayStats.y + rayStats.z, rayStats.w, raysTraced);
+    pixelRayStats[pixelIndex] = accumulate == 1 ? pixelRayStats[pixelIndex] + pixelStatsSum : pixelStatsSum;
+    atomicAdd(rayStatTotals.x, rayStats.x);
+    atomicAdd(rayStatTotals.y, rayStats.y);
+    atomicAdd(rayStatTotals.z, rayStats.z);
+    atomicAdd(rayStatTotals.w, rayStats.w);
+#endif
 
+    atomicAdd(rayCount, raysTraced);
+}
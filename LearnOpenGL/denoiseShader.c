@@ -0,0 +1,156 @@
+#version 430 core
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+// Edge-avoiding A-Trous wavelet filter (Dammertz et al. 2010) with the variance guided
+// luminance weight of SVGF (Schied et al. 2017), spatial part only. One dispatch per
+// iteration, the host doubles stepWidth each time and ping-pongs colorIn / colorOut.
+// header_files/denoiser.h is the CPU twin, keep the weights in sync.
+
+// written by computeShader.c, see the layouts there
+struct PixelStats
+{
+    dvec4 sum;
+    vec4 mean;
+    vec4 m2;
+};
+layout(std430, binding = 10) readonly buffer PixelStatsBlock
+{
+    PixelStats pixelStats[];
+};
+
+layout(std430, binding = 12) readonly buffer AovBlock
+{
+    vec4 pixelAovs[];
+};
+
+// history carried over from before the last camera move, see reprojectShader.c
+layout(std430, binding = 21) readonly buffer ReprojectedBlock
+{
+    vec4 reprojected[];
+};
+
+// rgb = color, a = variance of the mean luminance
+layout(rgba32f, binding = 1) uniform readonly image2D colorIn;
+layout(rgba32f, binding = 2) uniform writeonly image2D colorOut;
+
+layout(location = 0) uniform int stepWidth;
+layout(location = 1) uniform int firstIteration; // read color and variance from pixelStats instead of colorIn
+layout(location = 2) uniform ivec2 imageDims;    // the rendered corner of the images, the rest is left over from larger frames
+
+const float SIGMA_LUMINANCE = 4.0;
+const float SIGMA_NORMAL = 128.0;  // exponent on dot(n_p, n_q)
+const float SIGMA_DEPTH = 0.02;    // relative change in distance per pixel of offset
+const float SIGMA_ALBEDO = 0.1;
+
+const int AOV_ENTRIES = 3;
+
+const float kernel[3] = float[3](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+
+ivec2 dims;
+
+float luminance(vec3 c)
+{
+    return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+vec4 loadColor(ivec2 p)
+{
+    if (firstIteration == 1) {
+        int pixelIndex = p.y * dims.x + p.x;
+        vec4 mean = pixelStats[pixelIndex].mean;
+        vec4 m2 = pixelStats[pixelIndex].m2;
+        // blended with the reprojected history like resolveShader.c's blendedColor, which
+        // counts as that many more samples. unknown below two samples, let the feature
+        // weights alone decide
+        vec4 previous = reprojected[pixelIndex];
+        float weight = mean.w + previous.w;
+        vec3 color = previous.w > 0.0 ? (mean.rgb * mean.w + previous.rgb * previous.w) / weight : mean.rgb;
+        float variance = mean.w > 1.0 ? luminance(m2.rgb) / ((mean.w - 1.0) * weight) : 1e4;
+        return vec4(color, max(variance, 0.0));
+    }
+    return imageLoad(colorIn, p);
+}
+
+// 3x3 gaussian of the variance around p, a steadier estimate for the luminance weight
+float filteredVariance(ivec2 p)
+{
+    float sum = 0.0;
+    float weightSum = 0.0;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            ivec2 q = p + ivec2(x, y);
+            if (q.x < 0 || q.y < 0 || q.x >= dims.x || q.y >= dims.y) {
+                continue;
+            }
+            float w = kernel[abs(x) + 1] * kernel[abs(y) + 1];
+            sum += loadColor(q).a * w;
+            weightSum += w;
+        }
+    }
+    return sum / weightSum;
+}
+
+// normal, distance and albedo edge stopping. offset is the distance to q in pixels
+float featureWeight(vec4 normalDepthP, vec4 albedoP, vec4 normalDepthQ, vec4 albedoQ, float offset)
+{
+    bool hitP = normalDepthP.w > 0.0;
+    bool hitQ = normalDepthQ.w > 0.0;
+    if (hitP != hitQ) {
+        return 0.0;
+    }
+    if (!hitP) {
+        return 1.0; // both see the environment
+    }
+
+    vec3 nP = normalize(normalDepthP.xyz);
+    vec3 nQ = normalize(normalDepthQ.xyz);
+    float wNormal = pow(max(dot(nP, nQ), 0.0), SIGMA_NORMAL);
+    float wDepth = exp(-abs(normalDepthP.w - normalDepthQ.w) / (SIGMA_DEPTH * normalDepthP.w * offset + 1e-4));
+    float wAlbedo = exp(-length(albedoP.rgb - albedoQ.rgb) / SIGMA_ALBEDO);
+    return wNormal * wDepth * wAlbedo;
+}
+
+void main()
+{
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    dims = imageDims;
+    if (p.x >= dims.x || p.y >= dims.y) {
+        return;
+    }
+
+    int aovIndex = AOV_ENTRIES * (p.y * dims.x + p.x);
+    vec4 normalDepthP = pixelAovs[aovIndex];
+    vec4 albedoP = pixelAovs[aovIndex + 1];
+
+    vec4 colorP = loadColor(p);
+    float luminanceP = luminance(colorP.rgb);
+    float sigmaL = SIGMA_LUMINANCE * sqrt(filteredVariance(p)) + 1e-6;
+
+    vec3 colorSum = vec3(0.0);
+    float varianceSum = 0.0;
+    float weightSum = 0.0;
+    for (int y = -2; y <= 2; y++) {
+        for (int x = -2; x <= 2; x++) {
+            ivec2 q = p + ivec2(x, y) * stepWidth;
+            if (q.x < 0 || q.y < 0 || q.x >= dims.x || q.y >= dims.y) {
+                continue;
+            }
+
+            vec4 colorQ = loadColor(q);
+            float w = kernel[abs(x)] * kernel[abs(y)];
+            if (x != 0 || y != 0) {
+                int indexQ = AOV_ENTRIES * (q.y * dims.x + q.x);
+                float offset = float(stepWidth) * length(vec2(x, y));
+                w *= featureWeight(normalDepthP, albedoP, pixelAovs[indexQ], pixelAovs[indexQ + 1], offset);
+                w *= exp(-abs(luminanceP - luminance(colorQ.rgb)) / sigmaL);
+            }
+
+            colorSum += colorQ.rgb * w;
+            varianceSum += colorQ.a * w * w;
+            weightSum += w;
+        }
+    }
+
+    imageStore(colorOut, p, vec4(colorSum / weightSum, varianceSum / (weightSum * weightSum)));
+}
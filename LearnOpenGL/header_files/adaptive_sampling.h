@@ -0,0 +1,70 @@
+#ifndef ADAPTIVE_SAMPLING_H
+#define ADAPTIVE_SAMPLING_H
+
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+const int ADAPTIVE_TILE_SIZE = 16;   // keep in sync with computeShader.c
+const int ADAPTIVE_MAX_SAMPLES = 8;  // per pixel per dispatch
+
+// mirrors the TileBlock entries in computeShader.c
+struct AdaptiveTile
+{
+    uint32_t error;           // summed relative error of unconverged pixels, * 1024
+    uint32_t activePixels;    // unconverged pixels, summed over the frames since the last allocation
+    uint32_t samplesPerPixel; // written by the host, read by the kernel
+    uint32_t samplesTaken;
+};
+
+struct AdaptiveStatus
+{
+    uint64_t samplesTaken;   // since the last allocation
+    uint64_t activePixels;   // unconverged pixels in the last frame
+};
+
+int adaptive_tile_count(int width, int height)
+{
+    return ((width + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE) * ((height + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE);
+}
+
+// Spreads a budget of samples over the tiles in proportion to their summed error, so a
+// tile gets more samples per pixel the noisier its unconverged pixels are and converged
+// regions cost nothing. `frames` is the number of dispatches the counters cover. Resets the
+// counters for the next round.
+AdaptiveStatus allocate_tile_samples(vector<AdaptiveTile>& tiles, double samplesPerFrame, int frames)
+{
+    AdaptiveStatus status = { 0, 0 };
+
+    double totalError = 0.0;
+    for (const AdaptiveTile& t : tiles) {
+        totalError += t.error;
+        status.samplesTaken += t.samplesTaken;
+        status.activePixels += t.activePixels;
+    }
+    status.activePixels /= max(1, frames);
+
+    for (AdaptiveTile& t : tiles) {
+        double active = double(t.activePixels) / max(1, frames);
+        if (active <= 0.0) {
+            t.samplesPerPixel = 0;
+        }
+        else {
+            double share = totalError > 0.0 ? samplesPerFrame * t.error / totalError : 0.0;
+            int spp = (int)lround(share / active);
+            t.samplesPerPixel = min(ADAPTIVE_MAX_SAMPLES, max(1, spp));
+        }
+        t.error = 0;
+        t.activePixels = 0;
+        t.samplesTaken = 0;
+    }
+
+    return status;
+}
+
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef AOV_H
+#define AOV_H
+
+
+#include <glm/glm.hpp>
+
+#include <image_io.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Arbitrary output variables of the first hit, written by every pass next to the color.
+// Buffers hold AOV_ENTRIES vec4 per pixel in the AovBlock layout of computeShader.c:
+// {normal, distance}, {albedo, material id} and {position, object id}.
+
+const int AOV_ENTRIES = 3; // keep in sync with computeShader.c and denoiseShader.c
+
+// one sample's AOVs, see Trace
+struct PixelAovs
+{
+    glm::vec4 normalDepth; // zero on a miss
+    glm::vec4 albedo;      // w = material id, -1 on a miss
+    glm::vec4 position;    // w = object id, -1 on a miss
+};
+
+// the layer displayMode selects: 1 color, 2 normals, 3 albedo, 4 distance. displayColor in the shader
+glm::vec4 aov_display_color(int displayMode, const glm::vec4& mean, const glm::vec4& normalDepth, const glm::vec4& albedo)
+{
+    if (displayMode == 2) {
+        return glm::vec4((glm::vec3(normalDepth) + 1.0f) * 0.5f, 1.0f);
+    }
+    if (displayMode == 3) {
+        return glm::vec4(glm::vec3(albedo), 1.0f);
+    }
+    if (displayMode == 4) {
+        float s = normalDepth.w;
+        float distance = (1.0f - sqrt(s + 1.0f) / (s + 1.0f));
+        return glm::vec4(glm::vec3(distance * distance), 1.0f);
+    }
+    return glm::vec4(glm::vec3(mean), 1.0f);
+}
+
+// writes path_normal.pfm, path_albedo.pfm and path_depth.pfm (distance along the camera ray),
+// and with extras path_position.pfm, path_material.pfm and path_object.pfm (ids, -1 = miss)
+bool write_aovs(const string& path, const vector<glm::vec4>& aovs, int width, int height, bool extras)
+{
+    int numLayers = extras ? 6 : 3;
+    const char* names[6] = { "normal", "albedo", "depth", "position", "material", "object" };
+
+    vector<glm::vec4> layer(width * height);
+    for (int l = 0; l < numLayers; l++) {
+        for (int i = 0; i < width * height; i++) {
+            const glm::vec4& normalDepth = aovs[AOV_ENTRIES * i];
+            const glm::vec4& albedo = aovs[AOV_ENTRIES * i + 1];
+            const glm::vec4& position = aovs[AOV_ENTRIES * i + 2];
+            switch (l) {
+            case 0: layer[i] = glm::vec4(glm::vec3(normalDepth), 1.0f); break;
+            case 1: layer[i] = glm::vec4(glm::vec3(albedo), 1.0f); break;
+            case 2: layer[i] = glm::vec4(normalDepth.w); break;
+            case 3: layer[i] = glm::vec4(glm::vec3(position), 1.0f); break;
+            case 4: layer[i] = glm::vec4(albedo.w); break;
+            case 5: layer[i] = glm::vec4(position.w); break;
+            }
+        }
+        if (!write_pfm(path + "_" + names[l] + ".pfm", layer, width, height)) {
+            return false;
+        }
+    }
+
+    cout << "Wrote " << numLayers << " AOVs to " << path << "_*.pfm" << endl;
+    return true;
+}
+
+
+#endif
@@ -0,0 +1,662 @@
+#ifndef BATCH_RENDER_H
+#define BATCH_RENDER_H
+
+
+#include <ogl_path_trace.h>
+#include <image_io.h>
+#include <aov.h>
+
+#include <chrono>
+
+// Headless rendering for scripted runs: render one view to a sample or time budget,
+// write <output>.pfm (linear) and <output>.png (ACES tonemapped) and report Mrays/s.
+
+bool batchBudgetReached(const RenderSettings &settings, int samples, double seconds)
+{
+	if (settings.samplesPerPixel > 0 && samples >= settings.samplesPerPixel) return true;
+	if (settings.timeBudget > 0.0 && seconds >= settings.timeBudget) return true;
+	return false;
+}
+
+void printBatchProgress(int samples, double seconds, uint64_t rays)
+{
+	std::cout << "\r" << setw(20) << left << "Samples: " << setw(10) << samples << "  " << fixed << setprecision(1) << seconds << " s  "
+		<< setprecision(2) << (seconds > 0.0 ? rays / seconds / 1e6 : 0.0) << " Mrays/s   " << std::flush;
+}
+
+// writes path.pfm and path.png
+bool writeBatchOutput(const string &path, const vector<glm::vec4> &pixels)
+{
+	string pfm = path + ".pfm";
+	string png = path + ".png";
+	if (!write_pfm(pfm, pixels, TEXTURE_WIDTH, TEXTURE_HEIGHT)) return false;
+	if (!write_tonemapped_png(png, pixels, TEXTURE_WIDTH, TEXTURE_HEIGHT)) return false;
+	cout << "Wrote " << pfm << " and " << png << endl;
+	return true;
+}
+
+void printBatchSummary(const RenderSettings &settings, int samples, double seconds, uint64_t rays, uint64_t pathSamples)
+{
+	cout << endl;
+	cout << setw(20) << left << "Scene: " << settings.objPath << endl;
+	cout << setw(20) << left << "Backend: " << (settings.cpu ? "cpu" : "gpu") << endl;
+	cout << setw(20) << left << "Resolution: " << TEXTURE_WIDTH << "x" << TEXTURE_HEIGHT << endl;
+	cout << setw(20) << left << "Samples per pixel: " << samples << endl;
+	cout << setw(20) << left << "Render time: " << fixed << setprecision(3) << seconds << " s" << endl;
+	cout << setw(20) << left << "Rays: " << rays << endl;
+	cout << setw(20) << left << "Mrays/s: " << setprecision(3) << rays / seconds / 1e6 << endl;
+	cout << setw(20) << left << "Path length: " << setprecision(3) << double(rays) / max(pathSamples, uint64_t(1)) << " rays" << endl;
+	if (settings.denoise) {
+		cout << setw(20) << left << "Denoise time: " << setprecision(3) << denoiseMs << " ms" << endl;
+	}
+}
+
+int runBatchCpu(const RenderSettings &settings)
+{
+	TileScheduler scheduler(TEXTURE_WIDTH, TEXTURE_HEIGHT, 32, settings.threads);
+	CpuFrame cpuFrame;
+	cpuFrame.reset(TEXTURE_WIDTH, TEXTURE_HEIGHT);
+
+	uint64_t rays = 0;
+	double seconds = 0.0;
+	auto start = chrono::steady_clock::now();
+	while (!batchBudgetReached(settings, scheduler.samplesDone, seconds)) {
+		int remaining = settings.samplesPerPixel > 0 ? settings.samplesPerPixel - scheduler.samplesDone : 0;
+		rays += renderCpuPass(scheduler, cpuFrame, remaining);
+		seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		printBatchProgress(scheduler.samplesDone, seconds, rays);
+	}
+
+	vector<glm::vec4> denoised;
+	if (settings.denoise) {
+		auto denoiseStart = chrono::steady_clock::now();
+		cpu_denoise(cpuFrame.stats, cpuFrame.aovs, TEXTURE_WIDTH, TEXTURE_HEIGHT, denoiseIterations, denoised);
+		denoiseMs = chrono::duration<double, milli>(chrono::steady_clock::now() - denoiseStart).count();
+	}
+
+	printBatchSummary(settings, scheduler.samplesDone, seconds, rays, uint64_t(scheduler.samplesDone) * TEXTURE_WIDTH * TEXTURE_HEIGHT);
+	bool written = settings.denoise
+		? writeBatchOutput(settings.outputPath + "_noisy", cpuFrame.pixels) && writeBatchOutput(settings.outputPath, denoised)
+		: writeBatchOutput(settings.outputPath, cpuFrame.pixels);
+	if (settings.aovs) {
+		written = write_aovs(settings.outputPath, cpuFrame.aovs, TEXTURE_WIDTH, TEXTURE_HEIGHT, settings.aovExtras) && written;
+	}
+	return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int runBatchGpu(const RenderSettings &settings)
+{
+	// the window is never shown, it only provides the GL context
+	GLFWwindow* window = createWindow(false);
+	if (window == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	ComputeShaderVariants computeShaders("computeShader.c");
+	ComputeShader resolveShader("resolveShader.c", resolveDefines(GL_RGBA32F));
+	unsigned int texture = createRenderTexture(GL_RGBA32F);
+
+	int numTris, numSpheres, numMaterials, numNodes;
+	if (!setupBuffers(numTris, numSpheres, numMaterials, numNodes)) {
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
+	preparePathTraceShader(computeShaders);
+	gpuProfiler.init();
+	if (!settings.profileCsv.empty() && !gpuProfiler.openCsv(settings.profileCsv)) {
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
+
+	uint64_t rays = 0;
+	uint64_t samples = 0;
+	double seconds = 0.0;
+	double lastMessage = 0.0;
+	int frame = 0;
+	int samplesPerPixel = 0; // average when sampling adaptively
+	bool converged = false;
+	RayStatTotals rayStatTotals;
+	auto start = chrono::steady_clock::now();
+	while (!converged && !batchBudgetReached(settings, samplesPerPixel, seconds)) {
+		frame++;
+		accumulate = frame > 1 ? 1 : 0; // the buffers start out undefined
+		dispatchPathTrace(computeShaders, frame, (float)seconds, numSpheres, numTris, numMaterials, numNodes);
+
+		if (adaptiveSampling) {
+			gpuProfiler.begin(GPU_PASS_ADAPTIVE);
+			AdaptiveStatus status = updateAdaptiveTiles(1);
+			gpuProfiler.end();
+			samples += status.samplesTaken;
+			converged = status.activePixels == 0;
+		}
+		else {
+			samples += uint64_t(TEXTURE_WIDTH) * TEXTURE_HEIGHT;
+		}
+		samplesPerPixel = int(samples / (uint64_t(TEXTURE_WIDTH) * TEXTURE_HEIGHT));
+
+		uint64_t frameRays = readRayCounter(); // also waits for the dispatch, so the time budget is honest
+		rays += frameRays;
+		if (rayStats) {
+			readRayStats(rayStatTotals, frameRays, 1);
+		}
+		gpuProfiler.collect();
+		seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		if (seconds - lastMessage > 1.0) {
+			lastMessage = seconds;
+			printBatchProgress(samplesPerPixel, seconds, rays);
+		}
+	}
+	if (converged) {
+		cout << endl << "Every pixel converged" << endl;
+	}
+
+	vector<glm::vec4> pixels = readResolvedImage(resolveShader, texture);
+
+	vector<glm::vec4> denoised;
+	if (settings.denoise) {
+		ComputeShader denoiseShader("denoiseShader.c");
+		unsigned int denoiseTextures[2];
+		createDenoiseTextures(denoiseTextures);
+
+		denoised.resize(TEXTURE_WIDTH * TEXTURE_HEIGHT);
+		glBindTexture(GL_TEXTURE_2D, dispatchDenoise(denoiseShader, denoiseTextures));
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, denoised.data());
+		gpuProfiler.collect(true);
+		denoiseMs = gpuProfiler.lastMs(GPU_PASS_DENOISE);
+
+		glDeleteTextures(2, denoiseTextures);
+		glDeleteProgram(denoiseShader.ID);
+	}
+
+	printBatchSummary(settings, samplesPerPixel, seconds, rays, samples);
+	if (rayStats) {
+		printRayStats(rayStatTotals);
+	}
+	gpuProfiler.collect(true);
+	if (profilePasses) {
+		cout << endl;
+		gpuProfiler.print();
+	}
+	gpuProfiler.release();
+	frameConstants.release();
+	bool written = settings.denoise
+		? writeBatchOutput(settings.outputPath + "_noisy", pixels) && writeBatchOutput(settings.outputPath, denoised)
+		: writeBatchOutput(settings.outputPath, pixels);
+	if (settings.aovs) {
+		written = write_aovs(settings.outputPath, readAovs(), TEXTURE_WIDTH, TEXTURE_HEIGHT, settings.aovExtras) && written;
+	}
+	if (rayStats) {
+		written = write_pfm(settings.outputPath + "_nodes.pfm", readNodesPerRay(), TEXTURE_WIDTH, TEXTURE_HEIGHT) && written;
+	}
+
+	glDeleteTextures(1, &texture);
+	computeShaders.deletePrograms();
+	glDeleteProgram(resolveShader.ID);
+	glfwTerminate();
+
+	return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// --ray-bench: the same random segments through the scene with each visibility query
+struct RayQueryResult
+{
+	uint64_t rays;
+	uint64_t blocked;
+	double seconds;
+};
+
+void printRayQueryResult(const string &name, const RayQueryResult &result)
+{
+	cout << setw(28) << left << name << setw(12) << fixed << setprecision(2) << result.rays / result.seconds / 1e6
+		<< 100.0 * result.blocked / max(result.rays, uint64_t(1)) << " %" << endl;
+}
+
+RayQueryResult benchmarkCpuRayQuery(const RenderSettings &settings, TileScheduler &scheduler, bool closestHit)
+{
+	atomic<uint64_t> rays(0), blocked(0);
+	double seconds = 0.0;
+	scheduler.reset();
+	auto start = chrono::steady_clock::now();
+	while (!batchBudgetReached(settings, scheduler.samplesDone, seconds)) {
+		scheduler.runPass([&](const Tile &tile, int, int firstSample) {
+			uint64_t tileRays = 0, tileBlocked = 0;
+			for (int y = tile.y0; y < tile.y1; y++) {
+				for (int x = tile.x0; x < tile.x1; x++) {
+					tileBlocked += cpu_benchmark_ray_queries(cpuScene, y * TEXTURE_WIDTH + x, firstSample, closestHit, tileRays);
+				}
+			}
+			rays += tileRays;
+			blocked += tileBlocked;
+		}, 1);
+		seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+	return { rays, blocked, seconds };
+}
+
+// only the dispatches are timed, reading the blocked segments back is not
+RayQueryResult benchmarkGpuRayQuery(const RenderSettings &settings, ComputeShaderVariants &computeShaders, bool closestHit, int numSpheres, int numTris, int numNodes)
+{
+	RayQueryResult result = { 0, 0, 0.0 };
+	for (int frame = 0; !batchBudgetReached(settings, frame, result.seconds); frame++) {
+		auto start = chrono::steady_clock::now();
+		dispatchRayQueryBenchmark(computeShaders, frame, closestHit, numSpheres, numTris, numNodes);
+		result.rays += readRayCounter(); // waits for the dispatch
+		result.seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		result.blocked += readBlockedCounter();
+	}
+	return result;
+}
+
+// Times closest hit, which has to find the nearest surface before comparing it with the
+// segment, against the occlusion query in BVH build order and in occluder order. Every query
+// sees the same segments, so the blocked fractions have to agree
+int runRayBenchmark(const RenderSettings &settings)
+{
+	RayQueryResult closest, buildOrder, occluderOrder;
+	if (settings.cpu) {
+		TileScheduler scheduler(TEXTURE_WIDTH, TEXTURE_HEIGHT, 32, settings.threads);
+		closest = benchmarkCpuRayQuery(settings, scheduler, true);
+		cpu_ordered_occlusion = false;
+		buildOrder = benchmarkCpuRayQuery(settings, scheduler, false);
+		cpu_ordered_occlusion = true;
+		occluderOrder = benchmarkCpuRayQuery(settings, scheduler, false);
+	}
+	else {
+		GLFWwindow* window = createWindow(false);
+		if (window == NULL) {
+			return EXIT_FAILURE;
+		}
+		ComputeShaderVariants computeShaders("computeShader.c");
+		int numTris, numSpheres, numMaterials, numNodes;
+		if (!setupBuffers(numTris, numSpheres, numMaterials, numNodes)) {
+			glfwTerminate();
+			return EXIT_FAILURE;
+		}
+
+		chooseWorkgroupSize();
+
+		// the first dispatch of each occlusion order pays for compiling its shader variant
+		for (bool ordered : { false, true }) {
+			orderedOcclusion = ordered;
+			dispatchRayQueryBenchmark(computeShaders, 0, false, numSpheres, numTris, numNodes);
+		}
+		readRayCounter();
+		readBlockedCounter();
+
+		closest = benchmarkGpuRayQuery(settings, computeShaders, true, numSpheres, numTris, numNodes);
+		orderedOcclusion = false;
+		buildOrder = benchmarkGpuRayQuery(settings, computeShaders, false, numSpheres, numTris, numNodes);
+		orderedOcclusion = true;
+		occluderOrder = benchmarkGpuRayQuery(settings, computeShaders, false, numSpheres, numTris, numNodes);
+
+		computeShaders.deletePrograms();
+		glfwTerminate();
+	}
+	orderedOcclusion = cpu_ordered_occlusion = settings.orderedOcclusion;
+
+	cout << endl;
+	cout << setw(20) << left << "Scene: " << settings.objPath << endl;
+	cout << setw(20) << left << "Backend: " << (settings.cpu ? "cpu" : "gpu") << endl;
+	cout << setw(28) << left << "Query" << setw(12) << "Mrays/s" << "Blocked" << endl;
+	printRayQueryResult("closest hit", closest);
+	printRayQueryResult("occlusion, build order", buildOrder);
+	printRayQueryResult("occlusion, occluder order", occluderOrder);
+	return EXIT_SUCCESS;
+}
+
+// --sort-bench: the same samples traced as a wavefront in pixel order and in sorted order.
+// The counter-based random numbers make both images identical, so only the speed of the
+// bounces after the first and how often their BVH nodes are already cached may differ
+WavefrontStats benchmarkWavefront(const RenderSettings &settings, TileScheduler &scheduler, bool sorted, CpuFrame &cpuFrame)
+{
+	CpuCamera cam = cpu_make_camera(camera_position, camera_direction, TEXTURE_WIDTH, TEXTURE_HEIGHT);
+	WavefrontStats total;
+	mutex totalMutex;
+	cpuFrame.reset(TEXTURE_WIDTH, TEXTURE_HEIGHT);
+	scheduler.reset();
+	while (scheduler.samplesDone < settings.samplesPerPixel) {
+		scheduler.runPass([&](const Tile &tile, int spp, int firstSample) {
+			WavefrontStats stats;
+			NodeCacheModel cache;
+			cpu_render_tile_wavefront(cpuScene, cam, tile, TEXTURE_WIDTH, TEXTURE_HEIGHT, spp, firstSample, sorted, cpuFrame, 1, stats, &cache);
+			lock_guard<mutex> lock(totalMutex);
+			total.add(stats);
+		}, settings.samplesPerPixel - scheduler.samplesDone);
+	}
+	return total;
+}
+
+void printWavefrontResult(const string &name, const WavefrontStats &stats, int threads)
+{
+	double seconds = stats.secondarySeconds / threads;
+	cout << setw(16) << left << name << setw(20) << fixed << setprecision(2) << stats.secondaryRays / seconds / 1e6
+		<< setw(18) << setprecision(1) << 100.0 * stats.nodeHits / max(stats.nodeAccesses, uint64_t(1))
+		<< setprecision(1) << 1000.0 * stats.sortSeconds / threads << endl;
+}
+
+int runSortBenchmark(const RenderSettings &settings)
+{
+	TileScheduler scheduler(TEXTURE_WIDTH, TEXTURE_HEIGHT, 32, settings.threads);
+	CpuFrame unsortedFrame, sortedFrame;
+	WavefrontStats unsorted = benchmarkWavefront(settings, scheduler, false, unsortedFrame);
+	WavefrontStats sorted = benchmarkWavefront(settings, scheduler, true, sortedFrame);
+
+	cout << endl;
+	cout << setw(20) << left << "Scene: " << settings.objPath << endl;
+	cout << setw(20) << left << "Samples per pixel: " << settings.samplesPerPixel << endl;
+	cout << setw(20) << left << "Bounce 2+ rays: " << sorted.secondaryRays << " of " << sorted.rays << endl;
+	cout << setw(16) << left << "Ray order" << setw(20) << "Mrays/s, bounce 2+" << setw(18) << "L1 node hits %" << "Sort ms" << endl;
+	printWavefrontResult("pixel order", unsorted, scheduler.numThreads());
+	printWavefrontResult("sorted", sorted, scheduler.numThreads());
+	bool identical = unsortedFrame.stats == sortedFrame.stats;
+	cout << setw(20) << left << "Images identical: " << (identical ? "yes" : "no") << endl;
+	return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// --tune-workgroup: the same --spp frames rendered with every candidate workgroup shape. Each
+// pixel's samples do not depend on the shape, so every image has to match the default
+// shape's; a shape that renders differently is never picked and is recorded so --workgroup
+// falls back to 8x8 for it. The fastest is saved for this driver and used by every later GPU
+// render
+int runWorkgroupTuner(const RenderSettings &settings)
+{
+	GLFWwindow* window = createWindow(false);
+	if (window == NULL) {
+		return EXIT_FAILURE;
+	}
+	ComputeShaderVariants computeShaders("computeShader.c");
+	ComputeShader resolveShader("resolveShader.c", resolveDefines(GL_RGBA32F));
+	unsigned int texture = createRenderTexture(GL_RGBA32F);
+	int numTris, numSpheres, numMaterials, numNodes;
+	if (!setupBuffers(numTris, numSpheres, numMaterials, numNodes)) {
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
+
+	cout << setw(12) << left << "Workgroup" << setw(12) << "ms/frame" << setw(12) << "Mrays/s" << "Image" << endl;
+	WorkgroupSize fastest;
+	double fastestMs = 0.0, defaultMs = 0.0, originalMs = 0.0;
+	vector<glm::vec4> reference;
+	vector<WorkgroupSize> differing;
+	for (const WorkgroupSize &candidate : WORKGROUP_CANDIDATES) {
+		if (!workgroupSupported(candidate)) {
+			cout << setw(12) << left << candidate.name() << "too large for this device" << endl;
+			continue;
+		}
+		workgroupSize = candidate;
+
+		// frame 0 compiles the variant and is not timed
+		uint64_t rays = 0;
+		double seconds = 0.0;
+		for (int frame = 0; frame <= settings.samplesPerPixel; frame++) {
+			accumulate = frame > 1 ? 1 : 0;
+			auto start = chrono::steady_clock::now();
+			dispatchPathTrace(computeShaders, max(frame, 1), 0.0f, numSpheres, numTris, numMaterials, numNodes);
+			uint64_t frameRays = readRayCounter(); // waits for the dispatch
+			if (frame > 0) {
+				rays += frameRays;
+				seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			}
+		}
+		double ms = 1000.0 * seconds / settings.samplesPerPixel;
+
+		vector<glm::vec4> pixels = readResolvedImage(resolveShader, texture);
+		if (reference.empty()) {
+			reference = pixels;
+		}
+		bool matches = pixels == reference;
+		cout << setw(12) << left << candidate.name() << setw(12) << fixed << setprecision(2) << ms << setw(12) << setprecision(3) << rays / seconds / 1e6
+			<< (matches ? "same" : "differs") << endl;
+
+		if (!matches) {
+			differing.push_back(candidate);
+		}
+		if (candidate == WorkgroupSize()) {
+			defaultMs = ms;
+		}
+		if (candidate == WORKGROUP_ORIGINAL && matches) {
+			originalMs = ms;
+		}
+		if (matches && (fastestMs == 0.0 || ms < fastestMs)) {
+			fastest = candidate;
+			fastestMs = ms;
+		}
+	}
+
+	glDeleteTextures(1, &texture);
+	computeShaders.deletePrograms();
+	glDeleteProgram(resolveShader.ID);
+
+	cout << endl;
+	// against the original shape, or the default where the original renders wrongly
+	WorkgroupSize baseline = originalMs > 0.0 ? WORKGROUP_ORIGINAL : WorkgroupSize();
+	double baselineMs = originalMs > 0.0 ? originalMs : defaultMs;
+	cout << setw(20) << left << "Fastest: " << fastest.name() << ", " << fixed << setprecision(1) << 100.0 * (baselineMs / fastestMs - 1.0)
+		<< " % faster than " << baseline.name() << endl;
+	bool saved = saveTunedWorkgroupSize(fastest, differing);
+	if (saved) {
+		cout << "Saved to " << WORKGROUP_CACHE_FILE << endl;
+	}
+	glfwTerminate();
+	return saved ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// the sample counts of the last view --benchmark measures the error at, ascending
+const int BENCHMARK_ERROR_SAMPLES[] = { 1, 4, 16, 64 };
+const int BENCHMARK_ERROR_COUNTS = sizeof(BENCHMARK_ERROR_SAMPLES) / sizeof(BENCHMARK_ERROR_SAMPLES[0]);
+
+// --benchmark: flies the camera along a recorded path, replayStep seconds of it per frame, and
+// renders every frame the way the gpu viewer does (one sample, the reprojection when the camera
+// has moved, adaptive sampling and the denoiser when asked for) minus the blit. Each frame is
+// waited for, so its time is the whole frame's. Then measures how far the last view is from
+// --spp samples of it rendered from scratch, once it has BENCHMARK_ERROR_SAMPLES samples: the
+// counts the flight went past are read back when it reached them, and the last view keeps
+// accumulating, as in the viewer with the camera held still, for the others. So paths that end
+// moving and paths that end still are compared at the same sample counts
+int runFlythroughBenchmark(const RenderSettings &settings)
+{
+	if (settings.cpu) {
+		cout << "The flythrough benchmark runs on the GPU backend" << endl;
+		return EXIT_FAILURE;
+	}
+	CameraPath path;
+	if (!path.load(settings.benchmarkPath)) {
+		return EXIT_FAILURE;
+	}
+
+	GLFWwindow* window = createWindow(false);
+	if (window == NULL) {
+		return EXIT_FAILURE;
+	}
+	ComputeShaderVariants computeShaders("computeShader.c");
+	ComputeShader resolveShader("resolveShader.c", resolveDefines(GL_RGBA32F));
+	ComputeShader reprojectShader("reprojectShader.c");
+	ComputeShader denoiseShader("denoiseShader.c");
+	unsigned int texture = createRenderTexture(GL_RGBA32F);
+	unsigned int denoiseTextures[2];
+	createDenoiseTextures(denoiseTextures);
+
+	int numTris, numSpheres, numMaterials, numNodes;
+	if (!setupBuffers(numTris, numSpheres, numMaterials, numNodes)) {
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
+	preparePathTraceShader(computeShaders);
+	gpuProfiler.init();
+	if (!settings.profileCsv.empty() && !gpuProfiler.openCsv(settings.profileCsv)) {
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
+
+	int frameCount = 0;           // since the camera last moved
+	int adaptiveDispatches = 0;
+	// one frame of the current view, returns the texture it is shown from
+	auto renderFrame = [&]() {
+		if (adaptiveSampling && frameCount == 1) {
+			resetAdaptiveTiles();
+			adaptiveDispatches = 0;
+		}
+		RenderedView historyView = lastView;
+		bool reprojecting = frameCount == 1 && reprojection && historyView.valid;
+		if (reprojecting) {
+			dispatchReprojection(reprojectShader, 0, historyView);
+		}
+		else if (frameCount == 1) {
+			clearReprojection();
+		}
+		dispatchPathTrace(computeShaders, frameCount, 0.0f, numSpheres, numTris, numMaterials, numNodes);
+		adaptiveDispatches++;
+		if (reprojecting) {
+			dispatchReprojection(reprojectShader, 1, historyView);
+		}
+		if (adaptiveSampling && adaptiveDispatches >= adaptiveInterval) {
+			gpuProfiler.begin(GPU_PASS_ADAPTIVE);
+			updateAdaptiveTiles(adaptiveDispatches);
+			gpuProfiler.end();
+			adaptiveDispatches = 0;
+		}
+		if (denoiseEnabled) {
+			return dispatchDenoise(denoiseShader, denoiseTextures);
+		}
+		dispatchResolve(resolveShader);
+		return texture;
+	};
+
+	// the last view as shown at each of BENCHMARK_ERROR_SAMPLES, empty until it gets there
+	vector<glm::vec4> viewAtSamples[BENCHMARK_ERROR_COUNTS];
+	auto keepLastView = [&](unsigned int shown) {
+		for (int i = 0; i < BENCHMARK_ERROR_COUNTS; i++) {
+			if (frameCount == BENCHMARK_ERROR_SAMPLES[i]) {
+				viewAtSamples[i].resize(TEXTURE_WIDTH * TEXTURE_HEIGHT);
+				glBindTexture(GL_TEXTURE_2D, shown);
+				glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, viewAtSamples[i].data());
+			}
+		}
+	};
+
+	int frames = path.frames(settings.replayStep);
+	cout << "Replaying " << settings.benchmarkPath << ": " << frames << " frames, " << path.duration() << " s" << endl;
+	vector<double> frameMs;
+	for (int frame = 0; frame < frames; frame++) {
+		glm::vec4 position, direction;
+		path.sample(frame * settings.replayStep, position, direction);
+		if (frame == 0 || position != camera_position || direction != camera_direction) {
+			camera_position = position;
+			camera_direction = direction;
+			frameCount = 0;
+			for (vector<glm::vec4> &view : viewAtSamples) {
+				view.clear();
+			}
+		}
+		frameCount++;
+		accumulate = frameCount > 1 ? 1 : 0;
+
+		auto start = chrono::steady_clock::now();
+		unsigned int shown = renderFrame();
+		glFinish();
+		frameMs.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+		frameConstants.endFrame();
+		gpuProfiler.collect();
+		keepLastView(shown); // after the timing, the readback is not part of the frame
+	}
+
+	// the last view on to the largest of BENCHMARK_ERROR_SAMPLES, untimed
+	int pathEndSamples = frameCount;
+	while (frameCount < BENCHMARK_ERROR_SAMPLES[BENCHMARK_ERROR_COUNTS - 1]) {
+		frameCount++;
+		accumulate = 1;
+		unsigned int shown = renderFrame();
+		frameConstants.endFrame();
+		gpuProfiler.collect();
+		keepLastView(shown);
+	}
+
+	// the last view from scratch, untimed. the reference starts over at the same sample indices, so it
+	// draws them with another sampler to not repeat the last view's samples
+	adaptiveSampling = false; // the reference samples every pixel alike
+	samplerType = samplerType == SAMPLER_INDEPENDENT ? SAMPLER_SOBOL : SAMPLER_INDEPENDENT;
+	clearReprojection();
+	for (int frame = 1; frame <= settings.samplesPerPixel; frame++) {
+		accumulate = frame > 1 ? 1 : 0;
+		dispatchPathTrace(computeShaders, frame, 0.0f, numSpheres, numTris, numMaterials, numNodes, false);
+		frameConstants.endFrame();
+		if (frame % 16 == 0) {
+			glFinish(); // keeps the driver from queueing minutes of work
+		}
+	}
+	vector<glm::vec4> reference = readResolvedImage(resolveShader, texture);
+
+	cout << endl;
+	cout << setw(20) << left << "Scene: " << settings.objPath << endl;
+	cout << setw(20) << left << "Resolution: " << TEXTURE_WIDTH << "x" << TEXTURE_HEIGHT << endl;
+	cout << setw(20) << left << "Camera path: " << settings.benchmarkPath << ", " << settings.replayStep << " s per frame" << endl;
+	print_frame_time_stats(frame_time_stats(frameMs));
+	cout << setw(20) << left << "Last view: " << pathEndSamples << (pathEndSamples == 1 ? " sample" : " samples")
+		<< " at the end of the path, errors against " << settings.samplesPerPixel << " samples" << endl;
+	cout << setw(20) << left << "Samples" << setw(14) << "RMSE" << "Relative MSE" << endl;
+	// root mean square error, and the mean of the squared error relative to the reference's
+	// value, which weighs dark and bright parts of the image alike
+	for (int i = 0; i < BENCHMARK_ERROR_COUNTS; i++) {
+		double squared = 0.0, relative = 0.0;
+		for (size_t p = 0; p < reference.size(); p++) {
+			for (int c = 0; c < 3; c++) {
+				double d = double(viewAtSamples[i][p][c]) - reference[p][c];
+				squared += d * d;
+				relative += d * d / (double(reference[p][c]) * reference[p][c] + 0.01);
+			}
+		}
+		size_t values = reference.size() * 3;
+		cout << setw(20) << left << BENCHMARK_ERROR_SAMPLES[i] << setw(14) << setprecision(5) << sqrt(squared / values)
+			<< relative / values << defaultfloat << setprecision(6) << endl;
+	}
+	gpuProfiler.collect(true);
+	if (profilePasses) {
+		cout << endl;
+		gpuProfiler.print();
+	}
+
+	bool written = true;
+	if (!settings.outputPath.empty()) {
+		for (int i = 0; i < BENCHMARK_ERROR_COUNTS; i++) {
+			written = writeBatchOutput(settings.outputPath + "_" + to_string(BENCHMARK_ERROR_SAMPLES[i]) + "spp", viewAtSamples[i]) && written;
+		}
+		written = writeBatchOutput(settings.outputPath + "_reference", reference) && written;
+	}
+
+	gpuProfiler.release();
+	frameConstants.release();
+	glDeleteTextures(1, &texture);
+	glDeleteTextures(2, denoiseTextures);
+	computeShaders.deletePrograms();
+	glDeleteProgram(resolveShader.ID);
+	glDeleteProgram(reprojectShader.ID);
+	glDeleteProgram(denoiseShader.ID);
+	glfwTerminate();
+	return written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int runBatch(const RenderSettings &settings)
+{
+	applySettings(settings);
+	displayMode = 1;
+	if (!loadScene(settings)) {
+		return EXIT_FAILURE;
+	}
+	if (settings.rayBenchmark) {
+		return runRayBenchmark(settings);
+	}
+	if (settings.sortBenchmark) {
+		return runSortBenchmark(settings);
+	}
+	if (settings.tuneWorkgroup) {
+		return runWorkgroupTuner(settings);
+	}
+	if (!settings.benchmarkPath.empty()) {
+		return runFlythroughBenchmark(settings);
+	}
+
+	return settings.cpu ? runBatchCpu(settings) : runBatchGpu(settings);
+}
+
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef BLUE_NOISE_H
+#define BLUE_NOISE_H
+
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+const int BLUE_NOISE_SIZE = 64; // tile width and height, keep in sync with computeShader.c
+
+// Blue-noise dither tile from Ulichney's void-and-cluster method: every pixel gets a rank in
+// [0, size * size) such that the pixels below any threshold are spread as evenly as possible.
+// Energy is a toroidal gaussian so the tile repeats without seams. The second half of the
+// ranks is filled by the same largest-void search as the first instead of the inverted
+// pattern of the original paper, which is close enough for dithering sample shifts.
+vector<uint32_t> build_blue_noise(int size)
+{
+    const int n = size * size;
+    const float sigma = 1.5f;
+
+    vector<float> kernel(n);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            float dx = float(min(x, size - x));
+            float dy = float(min(y, size - y));
+            kernel[y * size + x] = exp(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+        }
+    }
+
+    vector<float> energy(n, 0.0f);
+    vector<char> set(n, 0);
+    auto toggle = [&](int p, bool on) {
+        set[p] = on;
+        int px = p % size, py = p / size;
+        float sign = on ? 1.0f : -1.0f;
+        for (int y = 0; y < size; y++) {
+            const float* row = &kernel[((y - py + size) % size) * size];
+            for (int x = 0; x < size; x++) {
+                energy[y * size + x] += sign * row[(x - px + size) % size];
+            }
+        }
+    };
+    auto tightestCluster = [&]() {
+        int best = 0;
+        float bestEnergy = -INFINITY;
+        for (int p = 0; p < n; p++) {
+            if (set[p] && energy[p] > bestEnergy) { best = p; bestEnergy = energy[p]; }
+        }
+        return best;
+    };
+    auto largestVoid = [&]() {
+        int best = 0;
+        float bestEnergy = INFINITY;
+        for (int p = 0; p < n; p++) {
+            if (!set[p] && energy[p] < bestEnergy) { best = p; bestEnergy = energy[p]; }
+        }
+        return best;
+    };
+
+    // a tenth of the pixels at random, then moved from the tightest cluster to the largest
+    // void until that stops changing anything
+    int ones = n / 10;
+    uint32_t state = 0x9e3779b9u;
+    for (int placed = 0; placed < ones;) {
+        state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+        int p = int(state % uint32_t(n));
+        if (!set[p]) {
+            toggle(p, true);
+            placed++;
+        }
+    }
+    for (;;) {
+        int cluster = tightestCluster();
+        toggle(cluster, false);
+        int gap = largestVoid();
+        toggle(gap, true);
+        if (gap == cluster) break;
+    }
+
+    vector<uint32_t> ranks(n);
+    vector<float> initialEnergy = energy;
+    vector<char> initialSet = set;
+
+    for (int rank = ones - 1; rank >= 0; rank--) {
+        int cluster = tightestCluster();
+        toggle(cluster, false);
+        ranks[cluster] = uint32_t(rank);
+    }
+
+    energy = initialEnergy;
+    set = initialSet;
+    for (int rank = ones; rank < n; rank++) {
+        int gap = largestVoid();
+        toggle(gap, true);
+        ranks[gap] = uint32_t(rank);
+    }
+    return ranks;
+}
+
+
+#endif
@@ -6,6 +6,9 @@
 #include "triangle.h"
 #include <vector>
 #include <queue>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
 
 using namespace std;
 
@@ -242,6 +245,8 @@ void buildSAHTreeHelper(vector<Triangle> &triangle_reference, vector<Triangle> t
     BVH temp1, temp2;
     bounds.push_back(temp1);
     bounds.push_back(temp2);
+    overall.data.x = -1; // not a leaf, traversal skips the triangle tests
+    overall.data.y = -1;
     overall.data.z = bounds.size() - 2;
     overall.data.w = bounds.size() - 1;
     buildSAHTreeHelper(triangle_reference, leftSubset, bounds, overall.data.z);
@@ -268,6 +273,63 @@ vector<BVH> buildSAHTree(vector<Triangle>& triangles) {
 }
 
 
+// sum of the triangle areas below node and, in score, min(surface area, 2 * that sum) for
+// every node under it. A ray through a box of surface area S hits a triangle of area A
+// inside it with probability about 2A / S (mean projected areas S / 4 and A / 2), so the
+// score is roughly how often the node both gets entered and blocks the ray
+double occluder_score(const vector<BVH> &tree, const vector<Triangle> &triangles, int node, vector<double> &score) {
+    const BVH &b = tree[node];
+    double area;
+    if (b.data.x > -1) {
+        area = 0.0;
+        for (int tri : { int(b.data.x), int(b.data.y) }) {
+            const Triangle &t = triangles[tri];
+            area += 0.5 * glm::length(glm::cross(glm::vec3(t.v1 - t.v0), glm::vec3(t.v2 - t.v0)));
+        }
+        if (b.data.x == b.data.y) {
+            area *= 0.5; // single triangle leaf
+        }
+    }
+    else {
+        int child1 = int(b.data.z);
+        int child2 = int(tree[child1].data.w);
+        area = occluder_score(tree, triangles, child1, score) + occluder_score(tree, triangles, child2, score);
+    }
+    BVH box = b;
+    score[node] = min(surface_area(box), 2.0 * area);
+    return area;
+}
+
+void build_occlusion_links_helper(const vector<BVH> &tree, const vector<double> &score, vector<glm::vec2> &links, int cur, int next_right_node) {
+    if (tree[cur].data.x > -1) {
+        links[cur] = glm::vec2(next_right_node, next_right_node);
+        return;
+    }
+    int child1 = int(tree[cur].data.z);
+    int child2 = int(tree[child1].data.w);
+    if (score[child2] > score[child1]) {
+        swap(child1, child2);
+    }
+    links[cur] = glm::vec2(child1, next_right_node);
+    build_occlusion_links_helper(tree, score, links, child1, child2);
+    build_occlusion_links_helper(tree, score, links, child2, next_right_node);
+}
+
+// {hit, miss} links over the nodes of a tree from buildSAHTree for occlusion queries, which
+// can stop at the first hit: every node visits the child most likely to block the ray first
+// instead of the order the build produced. Same nodes, so only the links need a second copy
+vector<glm::vec2> build_occlusion_links(const vector<BVH> &tree, const vector<Triangle> &triangles) {
+    vector<glm::vec2> links(tree.size());
+    if (tree.empty()) {
+        return links;
+    }
+    vector<double> score(tree.size());
+    occluder_score(tree, triangles, 0, score);
+    build_occlusion_links_helper(tree, score, links, 0, -1);
+    return links;
+}
+
+
 vector<BVH> buildTree(vector<Triangle> &triangles){
     vector<BVH> tree;
     vector<int> tris_remaining;
@@ -360,6 +422,138 @@ vector<BVH> buildTree(vector<Triangle> &triangles){
 }
 
 
+// Light hierarchy (Conty Estevez and Kulla 2018, as in pbrt-v4): every node bounds the
+// position, emitted directions and power of the lights below it, so sampling can descend
+// towards the lights likely to matter at a shading point. One light per leaf.
+struct LightNode {
+    glm::vec4 minPoint; // w = power
+    glm::vec4 maxPoint; // w = cos of the normal cone half angle (theta_o)
+    glm::vec4 axis;     // normal cone axis, w = cos of the emission spread around it (theta_e)
+    glm::vec4 data;     //{light index or first child, second child (-1 for leaves), two sided, unused}
+};
+
+// what build_light_tree needs to know about a light
+struct LightBounds {
+    glm::vec3 minPoint;
+    glm::vec3 maxPoint;
+    glm::vec3 axis;
+    float cosThetaO;
+    float cosThetaE;
+    float power;
+    bool twoSided;
+};
+
+// smallest cone around both cones, written over a
+void light_cone_union(glm::vec3 &axisA, float &cosA, glm::vec3 axisB, float cosB, bool twoSided) {
+    if (twoSided && glm::dot(axisA, axisB) < 0.0f) {
+        axisB = -axisB; // the same light either way round
+    }
+    if (cosA <= -1.0f || cosB <= -1.0f) {
+        cosA = -1.0f;
+        return;
+    }
+
+    float thetaA = acos(glm::clamp(cosA, -1.0f, 1.0f));
+    float thetaB = acos(glm::clamp(cosB, -1.0f, 1.0f));
+    float thetaD = acos(glm::clamp(glm::dot(axisA, axisB), -1.0f, 1.0f));
+    if (min(thetaD + thetaB, 3.141592f) <= thetaA) {
+        return;
+    }
+    if (min(thetaD + thetaA, 3.141592f) <= thetaB) {
+        axisA = axisB;
+        cosA = cosB;
+        return;
+    }
+
+    float thetaO = (thetaA + thetaD + thetaB) / 2.0f;
+    glm::vec3 rotationAxis = glm::cross(axisA, axisB);
+    if (thetaO >= 3.141592f || glm::length(rotationAxis) < 1e-7f) {
+        cosA = -1.0f;
+        return;
+    }
+
+    // rotate axisA towards axisB by thetaO - thetaA (Rodrigues)
+    glm::vec3 k = glm::normalize(rotationAxis);
+    float thetaR = thetaO - thetaA;
+    axisA = glm::normalize(axisA * cos(thetaR) + glm::cross(k, axisA) * sin(thetaR) + k * glm::dot(k, axisA) * (1.0f - cos(thetaR)));
+    cosA = cos(thetaO);
+}
+
+LightBounds light_bounds_union(const LightBounds &a, const LightBounds &b) {
+    LightBounds u = a;
+    u.minPoint = glm::min(a.minPoint, b.minPoint);
+    u.maxPoint = glm::max(a.maxPoint, b.maxPoint);
+    u.twoSided = a.twoSided || b.twoSided;
+    light_cone_union(u.axis, u.cosThetaO, b.axis, b.cosThetaO, a.twoSided && b.twoSided);
+    u.cosThetaE = min(a.cosThetaE, b.cosThetaE);
+    u.power = a.power + b.power;
+    return u;
+}
+
+LightNode make_light_node(const LightBounds &b, int first, int second) {
+    LightNode node;
+    node.minPoint = glm::vec4(b.minPoint, b.power);
+    node.maxPoint = glm::vec4(b.maxPoint, b.cosThetaO);
+    node.axis = glm::vec4(b.axis, b.cosThetaE);
+    node.data = glm::vec4(first, second, b.twoSided ? 1.0f : 0.0f, 0.0f);
+    return node;
+}
+
+// Splits at the median centroid along the longest axis, so the depth (and the cost of a
+// pick) is ceil(log2(lights)). trails[i] receives the branches from the root to light i,
+// bit d set = second child at depth d.
+LightBounds buildLightTreeHelper(const vector<LightBounds> &lights, vector<int> &order, int begin, int end, vector<LightNode> &nodes, vector<uint32_t> &trails, uint32_t trail, int depth) {
+    int insert = nodes.size();
+    nodes.push_back(LightNode());
+
+    if (end - begin == 1) {
+        int light = order[begin];
+        trails[light] = trail;
+        nodes[insert] = make_light_node(lights[light], light, -1);
+        return lights[light];
+    }
+
+    glm::vec3 cmin = glm::vec3(INFINITY), cmax = glm::vec3(-INFINITY);
+    for (int i = begin; i < end; i++) {
+        glm::vec3 c = 0.5f * (lights[order[i]].minPoint + lights[order[i]].maxPoint);
+        cmin = glm::min(cmin, c);
+        cmax = glm::max(cmax, c);
+    }
+    glm::vec3 extent = cmax - cmin;
+    int axis = extent.x > extent.y && extent.x > extent.z ? 0 : (extent.y > extent.z ? 1 : 2);
+
+    int mid = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+        [&lights, axis](int a, int b) {
+            return lights[a].minPoint[axis] + lights[a].maxPoint[axis] < lights[b].minPoint[axis] + lights[b].maxPoint[axis];
+        });
+
+    int first = nodes.size();
+    LightBounds left = buildLightTreeHelper(lights, order, begin, mid, nodes, trails, trail, depth + 1);
+    int second = nodes.size();
+    LightBounds right = buildLightTreeHelper(lights, order, mid, end, nodes, trails, trail | (1u << depth), depth + 1);
+
+    LightBounds overall = light_bounds_union(left, right);
+    nodes[insert] = make_light_node(overall, first, second);
+    return overall;
+}
+
+vector<LightNode> buildLightTree(const vector<LightBounds> &lights, vector<uint32_t> &trails) {
+    vector<LightNode> nodes;
+    trails.assign(lights.size(), 0);
+    if (lights.empty()) {
+        return nodes;
+    }
+
+    vector<int> order(lights.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    buildLightTreeHelper(lights, order, 0, lights.size(), nodes, trails, 0, 0);
+    return nodes;
+}
+
+
 //This goes on the GPU
 /*bool bvh_intersect(BVH& b, Ray& r)
 { 
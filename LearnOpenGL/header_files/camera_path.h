@@ -0,0 +1,156 @@
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+using namespace std;
+
+struct CameraKey
+{
+    double time; // seconds since the recording started
+    glm::vec4 position;
+    glm::vec4 direction;
+};
+
+// A recorded camera flight: the viewer's camera at increasing times, played back by sampling
+// it at any time in between. Saved as text, one "time px py pz dx dy dz" key per line, so a
+// path can be written or edited by hand. A camera that holds still only keeps the first and
+// last key of the stretch, which interpolates to the same camera.
+class CameraPath
+{
+public:
+    vector<CameraKey> keys;
+
+    double duration() const { return keys.empty() ? 0.0 : keys.back().time; }
+
+    // frames of a replay that advances step seconds per frame, the first at time 0 and the
+    // last at or just before the end
+    int frames(double step) const { return int(duration() / step + 1e-6) + 1; }
+
+    void add(double time, const glm::vec4& position, const glm::vec4& direction)
+    {
+        size_t n = keys.size();
+        if (n >= 2 && sameCamera(keys[n - 1], position, direction) && sameCamera(keys[n - 2], position, direction)) {
+            keys[n - 1].time = time;
+            return;
+        }
+        keys.push_back({ time, position, direction });
+    }
+
+    // the camera at time, linear between the keys around it and held before the first and
+    // after the last. exactly a key's camera at its time
+    void sample(double time, glm::vec4& position, glm::vec4& direction) const
+    {
+        if (keys.empty()) return;
+        auto next = upper_bound(keys.begin(), keys.end(), time, [](double t, const CameraKey& key) { return t < key.time; });
+        if (next == keys.begin() || next == keys.end()) {
+            const CameraKey& key = next == keys.begin() ? keys.front() : keys.back();
+            position = key.position;
+            direction = key.direction;
+            return;
+        }
+        const CameraKey& a = *(next - 1);
+        const CameraKey& b = *next;
+        float f = float((time - a.time) / (b.time - a.time));
+        if (f <= 0.0f || sameCamera(a, b.position, b.direction)) {
+            position = a.position;
+            direction = a.direction;
+            return;
+        }
+        position = glm::mix(a.position, b.position, f);
+        direction = glm::mix(a.direction, b.direction, f); // the camera normalizes it
+    }
+
+    bool save(const string& path) const
+    {
+        ofstream f(path);
+        if (!f.is_open()) {
+            cout << "Failed to open camera path: " << path << endl;
+            return false;
+        }
+        f << "# camera path: seconds, position x y z, direction x y z\n" << setprecision(9);
+        for (const CameraKey& key : keys) {
+            f << key.time << " " << key.position.x << " " << key.position.y << " " << key.position.z << " "
+                << key.direction.x << " " << key.direction.y << " " << key.direction.z << "\n";
+        }
+        return true;
+    }
+
+    bool load(const string& path)
+    {
+        ifstream f(path);
+        if (!f.is_open()) {
+            cout << "Failed to open camera path: " << path << endl;
+            return false;
+        }
+        keys.clear();
+        string line;
+        int lineNumber = 0;
+        while (getline(f, line)) {
+            lineNumber++;
+            if (line.empty() || line[0] == '#') continue;
+            istringstream in(line);
+            CameraKey key;
+            key.position.w = key.direction.w = 0.0f;
+            if (!(in >> key.time >> key.position.x >> key.position.y >> key.position.z >> key.direction.x >> key.direction.y >> key.direction.z)
+                || (!keys.empty() && key.time < keys.back().time)) {
+                cout << "Bad camera key on line " << lineNumber << " of " << path << endl;
+                return false;
+            }
+            keys.push_back(key);
+        }
+        if (keys.empty()) {
+            cout << "Camera path has no keys: " << path << endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static bool sameCamera(const CameraKey& key, const glm::vec4& position, const glm::vec4& direction)
+    {
+        return key.position == position && key.direction == direction;
+    }
+};
+
+// mean and percentiles of the frame times of a replay
+struct FrameTimeStats
+{
+    int count = 0;
+    double meanMs = 0.0, p50Ms = 0.0, p95Ms = 0.0, p99Ms = 0.0, maxMs = 0.0;
+};
+
+FrameTimeStats frame_time_stats(vector<double> frameMs)
+{
+    FrameTimeStats s;
+    if (frameMs.empty()) return s;
+    sort(frameMs.begin(), frameMs.end());
+    s.count = (int)frameMs.size();
+    for (double ms : frameMs) s.meanMs += ms;
+    s.meanMs /= frameMs.size();
+    auto percentile = [&](double p) { return frameMs[min(frameMs.size() - 1, size_t(p * frameMs.size()))]; };
+    s.p50Ms = percentile(0.5);
+    s.p95Ms = percentile(0.95);
+    s.p99Ms = percentile(0.99);
+    s.maxMs = frameMs.back();
+    return s;
+}
+
+void print_frame_time_stats(const FrameTimeStats& s)
+{
+    cout << setw(20) << left << "Frames: " << s.count << endl;
+    cout << setw(20) << left << "Frame time: " << fixed << setprecision(2) << "mean " << s.meanMs << " ms, p50 " << s.p50Ms
+        << ", p95 " << s.p95Ms << ", p99 " << s.p99Ms << ", max " << s.maxMs << " ms" << defaultfloat << setprecision(6) << endl;
+}
+
+
+#endif
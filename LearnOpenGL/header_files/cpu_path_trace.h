@@ -0,0 +1,877 @@
+#ifndef CPU_PATH_TRACE_H
+#define CPU_PATH_TRACE_H
+
+
+#include <glm/glm.hpp>
+
+#include "triangle.h"
+#include "material.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "random_stream.h"
+#include "aov.h"
+#include "light_sampling.h"
+#include "environment_map.h"
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+// CPU port of computeShader.c. Keep the two in sync: every function here mirrors
+// the GLSL function of the same name so both backends produce the same image.
+
+struct CpuScene
+{
+    vector<Triangle> triangles;
+    vector<BVH> heirarchy;
+    vector<glm::vec2> occlusionLinks; // see build_occlusion_links
+    vector<Sphere> spheres;
+    vector<Material> materials;
+    vector<Light> lights; // alias table over the emissive primitives, see light_sampling.h
+    vector<LightNode> lightTree;
+    float lightPower = 0.0f;
+    EnvironmentMap environment; // width 0 = sky gradient
+};
+
+struct CpuCamera
+{
+    glm::vec3 position;
+    glm::vec3 forward;
+    glm::vec3 right;
+    glm::vec3 up;
+};
+
+int cpu_max_bounce_count = 16;
+int cpu_min_bounce_count = 3;
+bool cpu_next_event_estimation = true;
+bool cpu_light_tree_sampling = true;
+bool cpu_ordered_occlusion = true;
+uint32_t cpu_sampler = SAMPLER_SOBOL;
+const bool cpu_render_triangles = true;
+const bool cpu_render_spheres = true;
+const bool cpu_anti_alias = true;
+const bool cpu_environment_enabled = true;
+const float cpu_shadow_epsilon = 0.001f;
+const float cpu_environment_select_probability = 0.5f;
+const float cpu_environment_distance = 1e30f;
+const int CPU_RAY_QUERY_BENCHMARK_RAYS = 16; // RAY_QUERY_BENCHMARK_RAYS in computeShader.c
+
+// direct-mapped model of a 32 KB L1 data cache in front of the BVH node array, counting how
+// often traversal finds the line holding a node already loaded. coarser than a real
+// set-associative cache, but enough to compare ray orders
+struct NodeCacheModel
+{
+    static const int LINES = 512; // 64 bytes each
+    uint32_t tags[LINES];
+    uint64_t accesses;
+    uint64_t hits;
+
+    void reset()
+    {
+        fill(tags, tags + LINES, 0u);
+        accesses = hits = 0;
+    }
+
+    void touch(int node)
+    {
+        uint32_t line = uint32_t(node) * uint32_t(sizeof(BVH)) / 64u + 1u; // 0 marks an empty slot
+        uint32_t& tag = tags[line % LINES];
+        accesses++;
+        if (tag == line) hits++;
+        tag = line;
+    }
+};
+
+// installed by the thread that wants its traversals counted, see ray_sorting.h
+thread_local NodeCacheModel* cpu_node_cache = nullptr;
+
+float cpu_random(RandomStream& state)
+{
+    return random_stream_float(state);
+}
+
+// u and v complete w (normalized) to an orthonormal basis (Duff et al., "Building an
+// Orthonormal Basis, Revisited", JCGT 2017)
+void cpu_orthonormal_basis(glm::vec3 w, glm::vec3& u, glm::vec3& v)
+{
+    float signZ = w.z >= 0.0f ? 1.0f : -1.0f;
+    float a = -1.0f / (signZ + w.z);
+    float b = w.x * w.y * a;
+    u = glm::vec3(1.0f + signZ * w.x * w.x * a, signZ * b, -signZ * w.x);
+    v = glm::vec3(b, signZ + w.y * w.y * a, -w.y);
+}
+
+// cosine-weighted direction around n from two uniform numbers, a point on the unit disk
+// projected up onto the hemisphere
+glm::vec3 cpu_cosine_hemisphere(glm::vec3 n, float u1, float u2)
+{
+    glm::vec3 u, v;
+    cpu_orthonormal_basis(n, u, v);
+    float r = sqrt(u1);
+    float phi = 2.0f * 3.141592f * u2;
+    return glm::normalize(u * (r * cos(phi)) + v * (r * sin(phi)) + n * sqrt(max(1.0f - u1, 0.0f)));
+}
+
+glm::ivec2 cpu_environment_texel(const EnvironmentMap& env, glm::vec3 dir)
+{
+    float phi = dir.x == 0.0f && dir.y == 0.0f ? 0.0f : atan2(dir.y, dir.x);
+    float u = 0.5f - phi / (2.0f * 3.141592f);
+    float v = 1.0f - acos(glm::clamp(dir.z, -1.0f, 1.0f)) / 3.141592f;
+    return glm::ivec2(min(max(int(u * env.width), 0), env.width - 1), min(max(int(v * env.height), 0), env.height - 1));
+}
+
+glm::vec3 cpu_environment_light(const CpuScene& scene, glm::vec3 ray_d)
+{
+    if (!cpu_environment_enabled) {
+        return glm::vec3(0.0f);
+    }
+
+    glm::vec3 dir = glm::normalize(ray_d);
+    const EnvironmentMap& env = scene.environment;
+    if (env.width > 0) {
+        glm::ivec2 texel = cpu_environment_texel(env, dir);
+        return glm::vec3(env.pixels[(size_t)texel.y * env.width + texel.x]);
+    }
+    float t = 0.5f * (dir.z + 1.0f);
+    return (1.0f - t) * glm::vec3(1.0f, 1.0f, 1.0f) + t * glm::vec3(0.5f, 0.7f, 1.0f);
+}
+
+float cpu_environment_select_pmf(const CpuScene& scene)
+{
+    if (!cpu_next_event_estimation || scene.environment.integral <= 0.0f) {
+        return 0.0f;
+    }
+    return scene.lights.empty() ? 1.0f : cpu_environment_select_probability;
+}
+
+int cpu_environment_cdf_search(const EnvironmentMap& env, int row, int count, float u)
+{
+    const glm::vec2* cdf = &env.cdf[(size_t)row * env.cdfWidth];
+    int first = 0;
+    int last = count - 1;
+    while (first < last) {
+        int middle = (first + last) / 2;
+        if (cdf[middle].x > u) {
+            last = middle;
+        }
+        else {
+            first = middle + 1;
+        }
+    }
+    return first;
+}
+
+glm::vec3 cpu_sample_environment(const EnvironmentMap& env, float u1, float u2, float& pdf, glm::vec3& radiance)
+{
+    const glm::vec2* marginal = &env.cdf[(size_t)env.height * env.cdfWidth];
+    int row = cpu_environment_cdf_search(env, env.height, env.height, u1);
+    float rowStart = row > 0 ? marginal[row - 1].x : 0.0f;
+    float dv = (u1 - rowStart) / max(marginal[row].x - rowStart, 1e-12f);
+
+    const glm::vec2* conditional = &env.cdf[(size_t)row * env.cdfWidth];
+    int column = cpu_environment_cdf_search(env, row, env.width, u2);
+    float columnStart = column > 0 ? conditional[column - 1].x : 0.0f;
+    float du = (u2 - columnStart) / max(conditional[column].x - columnStart, 1e-12f);
+
+    float u = (column + glm::clamp(du, 0.0f, 1.0f)) / env.width;
+    float v = (row + glm::clamp(dv, 0.0f, 1.0f)) / env.height;
+    float theta = 3.141592f * (1.0f - v);
+    float phi = (0.5f - u) * 2.0f * 3.141592f;
+    float sinTheta = sin(theta);
+
+    pdf = sinTheta > 0.0f ? conditional[column].y / (env.integral * 2.0f * 3.141592f * 3.141592f * sinTheta) : 0.0f;
+    radiance = glm::vec3(env.pixels[(size_t)row * env.width + column]);
+    return glm::vec3(sinTheta * cos(phi), sinTheta * sin(phi), cos(theta));
+}
+
+float cpu_environment_pdf(const EnvironmentMap& env, glm::vec3 dir)
+{
+    float sinTheta = sqrt(max(1.0f - dir.z * dir.z, 0.0f));
+    if (sinTheta <= 0.0f) {
+        return 0.0f;
+    }
+    glm::ivec2 texel = cpu_environment_texel(env, dir);
+    return env.cdf[(size_t)texel.y * env.cdfWidth + texel.x].y / (env.integral * 2.0f * 3.141592f * 3.141592f * sinTheta);
+}
+
+float cpu_hit_sphere(const CpuScene& scene, glm::vec3 ray_o, glm::vec3 ray_d, int sphere_ind)
+{
+    const Sphere& s = scene.spheres[sphere_ind];
+    glm::vec3 sphere_p = glm::vec3(s.data.x, s.data.y, s.data.z);
+    float sphere_r = s.data.w;
+
+    glm::vec3 oc = ray_o - sphere_p;
+    float a = glm::dot(ray_d, ray_d);
+    float half_b = glm::dot(oc, ray_d);
+    float c = glm::dot(oc, oc) - sphere_r * sphere_r;
+    float discriminant = half_b * half_b - a * c;
+
+    if (discriminant < 0.0f) {
+        return -1.0f;
+    }
+    return (-half_b - sqrt(discriminant)) / a;
+}
+
+float cpu_hit_triangle(const CpuScene& scene, glm::vec3 ray_o, glm::vec3 ray_d, int triangle_ind, glm::vec3& normal)
+{
+    const Triangle& test = scene.triangles[triangle_ind];
+
+    glm::vec3 v0 = glm::vec3(test.v0.x, test.v0.y, test.v0.z);
+    glm::vec3 v1 = glm::vec3(test.v1.x, test.v1.y, test.v1.z);
+    glm::vec3 v2 = glm::vec3(test.v2.x, test.v2.y, test.v2.z);
+
+    glm::vec3 n = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+    normal = n;
+
+    float d = -glm::dot(n, v0);
+    float t = -(glm::dot(n, ray_o) + d) / glm::dot(n, ray_d);
+
+    if (t < 0) { return -1.0f; }
+
+    glm::vec3 p = ray_o + t * ray_d;
+
+    glm::vec3 edge0 = v1 - v0;
+    glm::vec3 edge1 = v2 - v1;
+    glm::vec3 edge2 = v0 - v2;
+    if (glm::dot(n, glm::cross(edge0, p - v0)) > 0 &&
+        glm::dot(n, glm::cross(edge1, p - v1)) > 0 &&
+        glm::dot(n, glm::cross(edge2, p - v2)) > 0) return t; // P is inside the triangle
+
+    return -1.0f;
+}
+
+bool cpu_bvh_intersect(const BVH& b, glm::vec3 ray_o, glm::vec3 ray_d, float cur_t)
+{
+    float tmin = (b.minPoint.x - ray_o.x) / ray_d.x;
+    float tmax = (b.maxPoint.x - ray_o.x) / ray_d.x;
+    if (tmin > tmax) swap(tmin, tmax);
+
+    float tymin = (b.minPoint.y - ray_o.y) / ray_d.y;
+    float tymax = (b.maxPoint.y - ray_o.y) / ray_d.y;
+    if (tymin > tymax) swap(tymin, tymax);
+
+    if ((tmin > tymax) || (tymin > tmax))
+        return false;
+    if (tymin > tmin) tmin = tymin;
+    if (tymax < tmax) tmax = tymax;
+
+    float tzmin = (b.minPoint.z - ray_o.z) / ray_d.z;
+    float tzmax = (b.maxPoint.z - ray_o.z) / ray_d.z;
+    if (tzmin > tzmax) swap(tzmin, tzmax);
+
+    if ((tmin > tzmax) || (tzmin > tmax))
+        return false;
+    if (tzmin > tmin) tmin = tzmin;
+
+    return tmin <= cur_t;
+}
+
+void cpu_calculate_ray_collision(const CpuScene& scene, glm::vec3 ray_o, glm::vec3 ray_d, glm::vec3& normal, glm::vec3& hitPoint, bool& hit, int& materialIndex, int& objectIndex, int& lightIndex)
+{
+    float t = INFINITY;
+    lightIndex = -1;
+
+    if (cpu_render_spheres) {
+        for (int sphere_index = 0; sphere_index < (int)scene.spheres.size(); sphere_index++) {
+            float hit_t = cpu_hit_sphere(scene, ray_o, ray_d, sphere_index);
+            if (hit_t > 0.0001f && hit_t < t) {
+                const Sphere& s = scene.spheres[sphere_index];
+                glm::vec3 sphere_p = glm::vec3(s.data.x, s.data.y, s.data.z);
+                glm::vec3 potential_normal = glm::normalize(ray_o + (hit_t * ray_d) - sphere_p);
+                if (glm::dot(potential_normal, ray_d) > 0.0f) { potential_normal = -1.0f * potential_normal; }
+                hit = true;
+                t = hit_t;
+                normal = potential_normal;
+                hitPoint = ray_o + hit_t * ray_d;
+                materialIndex = int(s.materialData.x);
+                objectIndex = int(s.materialData.y);
+                lightIndex = int(s.materialData.z);
+            }
+        }
+    }
+
+    if (!cpu_render_triangles || scene.heirarchy.empty()) { return; }
+
+    glm::vec3 running_normal, running_normal2;
+    NodeCacheModel* cache = cpu_node_cache;
+    for (int bvh_ind = 0; bvh_ind > -1;) {
+        const BVH& b = scene.heirarchy[bvh_ind];
+        if (cache) cache->touch(bvh_ind);
+
+        bool hit_box = cpu_bvh_intersect(b, ray_o, ray_d, t);
+        int next_index = hit_box ? int(b.data.z) : int(b.data.w);
+
+        if (hit_box && (b.data.x > -1)) {
+            float hit_t = cpu_hit_triangle(scene, ray_o, ray_d, int(b.data[0]), running_normal);
+            float hit_t2 = cpu_hit_triangle(scene, ray_o, ray_d, int(b.data[1]), running_normal2);
+
+            if (hit_t > 0.0001f && hit_t < t && (hit_t < hit_t2 || hit_t2 < 0.0001f)) {
+                if (glm::dot(running_normal, ray_d) > 0.0f) { running_normal = -1.0f * running_normal; }
+                hit = true;
+                t = hit_t;
+                normal = running_normal;
+                hitPoint = ray_o + (hit_t * ray_d);
+                materialIndex = int(scene.triangles[int(b.data[0])].materialData.x);
+                objectIndex = int(scene.triangles[int(b.data[0])].materialData.y);
+                lightIndex = int(scene.triangles[int(b.data[0])].materialData.z);
+            }
+            else if (hit_t2 > 0.0001f && hit_t2 < t) {
+                if (glm::dot(running_normal2, ray_d) > 0.0f) { running_normal2 = -1.0f * running_normal2; }
+                hit = true;
+                t = hit_t2;
+                normal = running_normal2;
+                hitPoint = ray_o + (hit_t2 * ray_d);
+                materialIndex = int(scene.triangles[int(b.data[1])].materialData.x);
+                objectIndex = int(scene.triangles[int(b.data[1])].materialData.y);
+                lightIndex = int(scene.triangles[int(b.data[1])].materialData.z);
+            }
+        }
+        bvh_ind = next_index;
+    }
+}
+
+bool cpu_is_occluded(const CpuScene& scene, glm::vec3 ray_o, glm::vec3 ray_d, float maxT)
+{
+    if (cpu_render_spheres) {
+        for (int sphere_index = 0; sphere_index < (int)scene.spheres.size(); sphere_index++) {
+            float hit_t = cpu_hit_sphere(scene, ray_o, ray_d, sphere_index);
+            if (hit_t > 0.0001f && hit_t < maxT) {
+                return true;
+            }
+        }
+    }
+
+    if (!cpu_render_triangles || scene.heirarchy.empty()) { return false; }
+
+    glm::vec3 normal;
+    NodeCacheModel* cache = cpu_node_cache;
+    for (int bvh_ind = 0; bvh_ind > -1;) {
+        const BVH& b = scene.heirarchy[bvh_ind];
+        if (cache) cache->touch(bvh_ind);
+
+        bool hit_box = cpu_bvh_intersect(b, ray_o, ray_d, maxT);
+        if (hit_box && (b.data.x > -1)) {
+            float hit_t = cpu_hit_triangle(scene, ray_o, ray_d, int(b.data[0]), normal);
+            if (hit_t > 0.0001f && hit_t < maxT) {
+                return true;
+            }
+            if (b.data[1] != b.data[0]) {
+                hit_t = cpu_hit_triangle(scene, ray_o, ray_d, int(b.data[1]), normal);
+                if (hit_t > 0.0001f && hit_t < maxT) {
+                    return true;
+                }
+            }
+        }
+        glm::vec2 links = cpu_ordered_occlusion ? scene.occlusionLinks[bvh_ind] : glm::vec2(b.data.z, b.data.w);
+        bvh_ind = hit_box ? int(links.x) : int(links.y);
+    }
+    return false;
+}
+
+float cpu_light_power_pmf(const CpuScene& scene, int index)
+{
+    glm::vec4 light = scene.lights[index].data;
+    int primitive = int(light.y);
+    if (int(light.x) == LIGHT_TRIANGLE) {
+        const Triangle& tri = scene.triangles[primitive];
+        return light_luminance(material_emission(scene.materials[int(tri.materialData.x)])) * triangle_area(tri) / scene.lightPower;
+    }
+    float r = scene.spheres[primitive].data.w;
+    return light_luminance(material_emission(scene.materials[int(scene.spheres[primitive].materialData.x)])) * 4.0f * 3.141592f * r * r / scene.lightPower;
+}
+
+float cpu_cos_sub_clamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+}
+
+float cpu_sin_sub_clamped(float sinA, float cosA, float sinB, float cosB)
+{
+    return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+}
+
+float cpu_light_node_importance(const LightNode& node, glm::vec3 p, glm::vec3 n)
+{
+    glm::vec3 pMin = glm::vec3(node.minPoint);
+    glm::vec3 pMax = glm::vec3(node.maxPoint);
+    float power = node.minPoint.w;
+    float cosThetaO = node.maxPoint.w;
+    float cosThetaE = node.axis.w;
+
+    glm::vec3 center = 0.5f * (pMin + pMax);
+    float radiusSquared = 0.25f * glm::dot(pMax - pMin, pMax - pMin);
+    float distanceSquared = glm::dot(p - center, p - center);
+    float falloff = max(distanceSquared, 0.5f * glm::length(pMax - pMin));
+    if (distanceSquared <= radiusSquared) {
+        return power / falloff;
+    }
+
+    glm::vec3 wi = (p - center) / sqrt(distanceSquared);
+    float cosThetaW = glm::dot(glm::vec3(node.axis), wi);
+    if (node.data.z > 0.0f) {
+        cosThetaW = abs(cosThetaW);
+    }
+    float sinThetaW = sqrt(max(1.0f - cosThetaW * cosThetaW, 0.0f));
+    float sinThetaO = sqrt(max(1.0f - cosThetaO * cosThetaO, 0.0f));
+    float cosThetaB = sqrt(max(1.0f - radiusSquared / distanceSquared, 0.0f));
+    float sinThetaB = sqrt(max(1.0f - cosThetaB * cosThetaB, 0.0f));
+
+    float cosThetaX = cpu_cos_sub_clamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float sinThetaX = cpu_sin_sub_clamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float cosThetaP = cpu_cos_sub_clamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= cosThetaE) {
+        return 0.0f;
+    }
+
+    float cosThetaI = abs(glm::dot(wi, n));
+    float sinThetaI = sqrt(max(1.0f - cosThetaI * cosThetaI, 0.0f));
+    float cosThetaIP = cpu_cos_sub_clamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+
+    return power * cosThetaP * cosThetaIP / falloff;
+}
+
+float cpu_light_tree_pmf(const CpuScene& scene, int index, glm::vec3 p, glm::vec3 n)
+{
+    uint32_t trail = uint32_t(scene.lights[index].tree.x);
+    float pmf = 1.0f;
+    int node = 0;
+    while (scene.lightTree[node].data.y >= 0.0f) {
+        const LightNode& parent = scene.lightTree[node];
+        float importance0 = cpu_light_node_importance(scene.lightTree[int(parent.data.x)], p, n);
+        float importance1 = cpu_light_node_importance(scene.lightTree[int(parent.data.y)], p, n);
+        if (importance0 + importance1 <= 0.0f) {
+            return 0.0f;
+        }
+        bool second = (trail & 1u) != 0u;
+        pmf *= (second ? importance1 : importance0) / (importance0 + importance1);
+        node = int(second ? parent.data.y : parent.data.x);
+        trail >>= 1u;
+    }
+    return pmf;
+}
+
+float cpu_light_selection_pmf(const CpuScene& scene, int index, glm::vec3 p, glm::vec3 n)
+{
+    return cpu_light_tree_sampling ? cpu_light_tree_pmf(scene, index, p, n) : cpu_light_power_pmf(scene, index);
+}
+
+int cpu_pick_light(const CpuScene& scene, glm::vec3 p, glm::vec3 n, RandomStream& state, float& pmf)
+{
+    random_stream_set_dimension(state, DIMENSION_LIGHT_PICK);
+    if (!cpu_light_tree_sampling) {
+        int numLights = scene.lights.size();
+        int index = min(int(cpu_random(state) * float(numLights)), numLights - 1);
+        glm::vec4 light = scene.lights[index].data;
+        if (cpu_random(state) >= light.z) {
+            index = int(light.w);
+        }
+        pmf = cpu_light_power_pmf(scene, index);
+        return index;
+    }
+
+    float u = cpu_random(state);
+    pmf = 1.0f;
+    int node = 0;
+    while (scene.lightTree[node].data.y >= 0.0f) {
+        const LightNode& parent = scene.lightTree[node];
+        float importance0 = cpu_light_node_importance(scene.lightTree[int(parent.data.x)], p, n);
+        float importance1 = cpu_light_node_importance(scene.lightTree[int(parent.data.y)], p, n);
+        if (importance0 + importance1 <= 0.0f) {
+            return -1;
+        }
+        float p0 = importance0 / (importance0 + importance1);
+        if (u < p0) {
+            u = min(u / p0, 0.99999994f);
+            pmf *= p0;
+            node = int(parent.data.x);
+        }
+        else {
+            u = min((u - p0) / (1.0f - p0), 0.99999994f);
+            pmf *= 1.0f - p0;
+            node = int(parent.data.y);
+        }
+    }
+    return int(scene.lightTree[node].data.x);
+}
+
+float cpu_triangle_light_pdf(const CpuScene& scene, int t, glm::vec3 from, glm::vec3 p, glm::vec3 n)
+{
+    glm::vec3 toLight = p - from;
+    float distanceSquared = glm::dot(toLight, toLight);
+    float cosLight = abs(glm::dot(n, toLight)) / sqrt(distanceSquared);
+    return distanceSquared / (max(cosLight, 1e-6f) * triangle_area(scene.triangles[t]));
+}
+
+float cpu_sphere_light_pdf(const CpuScene& scene, int s, glm::vec3 from)
+{
+    glm::vec3 toCenter = glm::vec3(scene.spheres[s].data) - from;
+    float r = scene.spheres[s].data.w;
+    float distanceSquared = glm::dot(toCenter, toCenter);
+    if (distanceSquared <= r * r) {
+        return 0.0f;
+    }
+    float cosMax = sqrt(max(1.0f - r * r / distanceSquared, 0.0f));
+    return 1.0f / (2.0f * 3.141592f * (1.0f - cosMax));
+}
+
+float cpu_light_pdf(const CpuScene& scene, int index, glm::vec3 from, glm::vec3 n, glm::vec3 p, glm::vec3 lightNormal)
+{
+    glm::vec4 light = scene.lights[index].data;
+    float pointPdf = int(light.x) == LIGHT_TRIANGLE ? cpu_triangle_light_pdf(scene, int(light.y), from, p, lightNormal) : cpu_sphere_light_pdf(scene, int(light.y), from);
+    return (1.0f - cpu_environment_select_pmf(scene)) * cpu_light_selection_pmf(scene, index, from, n) * pointPdf;
+}
+
+bool cpu_sample_light(const CpuScene& scene, glm::vec3 from, glm::vec3 n, RandomStream& state, glm::vec3& lightDir, float& lightDistance, float& pdf, glm::vec3& emission)
+{
+    random_stream_set_dimension(state, DIMENSION_LIGHT_SELECT);
+    float environmentPmf = cpu_environment_select_pmf(scene);
+    if (environmentPmf > 0.0f && cpu_random(state) < environmentPmf) {
+        random_stream_set_dimension(state, DIMENSION_LIGHT_POINT);
+        float u1 = cpu_random(state);
+        float u2 = cpu_random(state);
+        lightDir = cpu_sample_environment(scene.environment, u1, u2, pdf, emission);
+        lightDistance = cpu_environment_distance;
+        pdf *= environmentPmf;
+        return pdf > 0.0f;
+    }
+
+    float pmf;
+    int index = cpu_pick_light(scene, from, n, state, pmf);
+    random_stream_set_dimension(state, DIMENSION_LIGHT_POINT);
+    float u1 = cpu_random(state);
+    float u2 = cpu_random(state);
+    if (index < 0) {
+        return false;
+    }
+    glm::vec4 light = scene.lights[index].data;
+    int primitive = int(light.y);
+
+    if (int(light.x) == LIGHT_TRIANGLE) {
+        const Triangle& tri = scene.triangles[primitive];
+        emission = material_emission(scene.materials[int(tri.materialData.x)]);
+
+        glm::vec3 v0 = glm::vec3(tri.v0), v1 = glm::vec3(tri.v1), v2 = glm::vec3(tri.v2);
+        float su = sqrt(u1);
+        glm::vec3 p = (1.0f - su) * v0 + (u2 * su) * v1 + (su * (1.0f - u2)) * v2;
+        glm::vec3 lightNormal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+
+        lightDistance = glm::length(p - from);
+        lightDir = (p - from) / lightDistance;
+        pdf = pmf * cpu_triangle_light_pdf(scene, primitive, from, p, lightNormal);
+    }
+    else {
+        const Sphere& sphere = scene.spheres[primitive];
+        emission = material_emission(scene.materials[int(sphere.materialData.x)]);
+
+        glm::vec3 toCenter = glm::vec3(sphere.data) - from;
+        float r = sphere.data.w;
+        float distanceSquared = glm::dot(toCenter, toCenter);
+        if (distanceSquared <= r * r) {
+            return false;
+        }
+
+        float cosMax = sqrt(max(1.0f - r * r / distanceSquared, 0.0f));
+        float cosTheta = 1.0f - u1 * (1.0f - cosMax);
+        float sinTheta = sqrt(max(1.0f - cosTheta * cosTheta, 0.0f));
+        float phi = 2.0f * 3.141592f * u2;
+
+        glm::vec3 w = toCenter / sqrt(distanceSquared);
+        glm::vec3 u, v;
+        cpu_orthonormal_basis(w, u, v);
+
+        lightDir = glm::normalize(u * (cos(phi) * sinTheta) + v * (sin(phi) * sinTheta) + w * cosTheta);
+        lightDistance = sqrt(distanceSquared) * cosTheta - sqrt(max(r * r - distanceSquared * sinTheta * sinTheta, 0.0f));
+        pdf = pmf * cpu_sphere_light_pdf(scene, primitive, from);
+    }
+    pdf *= 1.0f - environmentPmf;
+    return pdf > 0.0f;
+}
+
+// one path of cpu_trace between bounces. cpu_trace runs its bounces back to back; the
+// wavefront renderer in ray_sorting.h interleaves the bounces of many paths instead. The
+// random stream is counter based, so both give the same image
+struct CpuPath
+{
+    glm::vec3 ray_o, ray_d;
+    glm::vec3 incomingLight;
+    glm::vec3 rayColor;
+    float bsdfPdf; // see Trace
+    glm::vec3 bsdfNormal;
+    RandomStream state;
+    PixelAovs aovs;
+    int bounce;    // next bounce to trace
+    bool active;
+};
+
+// what the current ray of a path hit, from cpu_calculate_ray_collision
+struct CpuHit
+{
+    glm::vec3 normal;
+    glm::vec3 hitPoint;
+    bool hit;
+    int materialInd;
+    int objectInd;
+    int lightInd;
+};
+
+CpuPath cpu_begin_path(glm::vec3 ray_o, glm::vec3 ray_d, const RandomStream& state)
+{
+    CpuPath path;
+    path.ray_o = ray_o;
+    path.ray_d = ray_d;
+    path.incomingLight = glm::vec3(0.0f);
+    path.rayColor = glm::vec3(1.0f);
+    path.bsdfPdf = 0.0f;
+    path.bsdfNormal = glm::vec3(0.0f);
+    path.state = state;
+    path.aovs.normalDepth = glm::vec4(0.0f);
+    path.aovs.albedo = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+    path.aovs.position = glm::vec4(0.0f, 0.0f, 0.0f, -1.0f);
+    path.bounce = 0;
+    path.active = true;
+    return path;
+}
+
+void cpu_intersect_path(const CpuScene& scene, const CpuPath& path, CpuHit& h, uint64_t& rays)
+{
+    h.normal = glm::vec3(0.0f);
+    h.hitPoint = glm::vec3(0.0f);
+    h.hit = false;
+    h.materialInd = 0;
+    h.objectInd = 0;
+    h.lightInd = -1;
+    cpu_calculate_ray_collision(scene, path.ray_o, path.ray_d, h.normal, h.hitPoint, h.hit, h.materialInd, h.objectInd, h.lightInd);
+    rays++;
+}
+
+// one bounce of Trace for a path whose ray hit h: adds the light it found, traces the shadow
+// ray and picks the next ray. clears path.active when the path ends. rays counts the shadow ray
+void cpu_shade_path(const CpuScene& scene, CpuPath& path, const CpuHit& h, uint64_t& rays)
+{
+    int i = path.bounce;
+    RandomStream& state = path.state;
+    glm::vec3& ray_o = path.ray_o;
+    glm::vec3& ray_d = path.ray_d;
+    glm::vec3& rayColor = path.rayColor;
+    glm::vec3 normal = h.normal;
+    glm::vec3 hitPoint = h.hitPoint;
+    bool nextEventEstimation = cpu_next_event_estimation && (!scene.lights.empty() || cpu_environment_select_pmf(scene) > 0.0f);
+
+    random_stream_set_bounce(state, i + 1);
+    path.bounce++;
+    path.active = false;
+
+    if (!h.hit) {
+        float misWeight = 1.0f;
+        float environmentPmf = cpu_environment_select_pmf(scene);
+        if (environmentPmf > 0.0f && path.bsdfPdf > 0.0f) {
+            float environmentLightPdf = environmentPmf * cpu_environment_pdf(scene.environment, glm::normalize(ray_d));
+            misWeight = path.bsdfPdf / (path.bsdfPdf + environmentLightPdf);
+        }
+        path.incomingLight += cpu_environment_light(scene, ray_d) * rayColor * misWeight;
+        return;
+    }
+
+    if (i == 0) {
+        path.aovs.normalDepth = glm::vec4(normal, glm::length(hitPoint - ray_o));
+        path.aovs.albedo = glm::vec4(glm::vec3(scene.materials[h.materialInd].color), float(h.materialInd));
+        path.aovs.position = glm::vec4(hitPoint, float(h.objectInd));
+    }
+
+    const Material& hit_mat = scene.materials[h.materialInd];
+    float specularProbability = hit_mat.data.z;
+    float smoothness = hit_mat.data.y;
+
+    glm::vec3 emittedLight = material_emission(hit_mat);
+    float misWeight = 1.0f;
+    if (nextEventEstimation && path.bsdfPdf > 0.0f && h.lightInd >= 0) {
+        float hitLightPdf = cpu_light_pdf(scene, h.lightInd, ray_o, path.bsdfNormal, hitPoint, normal);
+        misWeight = path.bsdfPdf / (path.bsdfPdf + hitLightPdf);
+    }
+    path.incomingLight += emittedLight * rayColor * misWeight;
+
+    ray_o = hitPoint;
+    random_stream_set_dimension(state, DIMENSION_BSDF);
+    float diffuseU1 = cpu_random(state);
+    float diffuseU2 = cpu_random(state);
+    glm::vec3 diffuseDir = cpu_cosine_hemisphere(normal, diffuseU1, diffuseU2);
+    glm::vec3 specularDir = glm::normalize(glm::reflect(ray_d, normal));
+
+    glm::vec3 color = glm::vec3(hit_mat.color.r, hit_mat.color.g, hit_mat.color.b);
+
+    float isSpecularBounce = 0.0f;
+    random_stream_set_dimension(state, DIMENSION_LOBE);
+    if (specularProbability > cpu_random(state)) {
+        isSpecularBounce = 1.0f;
+    }
+
+    ray_d = glm::mix(diffuseDir, specularDir, smoothness * isSpecularBounce);
+
+    float diffuseProbability = 1.0f - specularProbability;
+    if (nextEventEstimation && diffuseProbability > 0.0f && i < cpu_max_bounce_count) {
+        glm::vec3 lightDir, lightEmission;
+        float lightDistance, lightPdf;
+        if (cpu_sample_light(scene, hitPoint, normal, state, lightDir, lightDistance, lightPdf, lightEmission)) {
+            float cosSurface = glm::dot(normal, lightDir);
+            if (cosSurface > 0.0f) {
+                rays++;
+                if (!cpu_is_occluded(scene, hitPoint, lightDir, lightDistance * (1.0f - cpu_shadow_epsilon))) {
+                    float lightBsdfPdf = diffuseProbability * cosSurface / 3.141592f;
+                    path.incomingLight += rayColor * color * lightEmission * (lightBsdfPdf / (lightPdf + lightBsdfPdf));
+                }
+            }
+        }
+    }
+    path.bsdfPdf = isSpecularBounce > 0.0f ? 0.0f : diffuseProbability * max(glm::dot(normal, ray_d), 0.0f) / 3.141592f;
+    path.bsdfNormal = normal;
+
+    glm::vec3 specularColor = glm::vec3(hit_mat.specularColor.r, hit_mat.specularColor.g, hit_mat.specularColor.b);
+    rayColor = rayColor * glm::mix(color, specularColor, isSpecularBounce);
+
+    // Russian roulette, same as Trace
+    float survival = min(max(rayColor.r, max(rayColor.g, rayColor.b)), 0.95f);
+    random_stream_set_dimension(state, DIMENSION_ROULETTE);
+    if (survival <= 0.0f || (i >= cpu_min_bounce_count && cpu_random(state) >= survival)) {
+        return;
+    }
+    if (i >= cpu_min_bounce_count) {
+        rayColor /= survival;
+    }
+    path.active = path.bounce <= cpu_max_bounce_count;
+}
+
+// rays counts every ray cast (primary, bounces and shadow rays)
+glm::vec3 cpu_trace(const CpuScene& scene, glm::vec3 ray_o, glm::vec3 ray_d, RandomStream& state, uint64_t& rays, PixelAovs& aovs)
+{
+    CpuPath path = cpu_begin_path(ray_o, ray_d, state);
+    while (path.active) {
+        CpuHit h;
+        cpu_intersect_path(scene, path, h, rays);
+        cpu_shade_path(scene, path, h, rays);
+    }
+    aovs = path.aovs;
+    return path.incomingLight;
+}
+
+// benchmarkRayQueries: closestHit picks cpu_calculate_ray_collision over cpu_is_occluded
+int cpu_benchmark_ray_queries(const CpuScene& scene, uint32_t pixelIndex, int frame, bool closestHit, uint64_t& rays)
+{
+    RandomStream state = make_random_stream(pixelIndex, uint32_t(frame), 0u, 0u, SAMPLER_INDEPENDENT);
+    glm::vec3 boundsMin = glm::vec3(scene.heirarchy[0].minPoint);
+    glm::vec3 extent = glm::vec3(scene.heirarchy[0].maxPoint) - boundsMin;
+
+    int blocked = 0;
+    for (int i = 0; i < CPU_RAY_QUERY_BENCHMARK_RAYS; i++) {
+        glm::vec3 a, b;
+        a.x = cpu_random(state);
+        a.y = cpu_random(state);
+        a.z = cpu_random(state);
+        b.x = cpu_random(state);
+        b.y = cpu_random(state);
+        b.z = cpu_random(state);
+        a = boundsMin + extent * a;
+        b = boundsMin + extent * b;
+        float segmentLength = glm::length(b - a);
+        glm::vec3 ray_d = (b - a) / max(segmentLength, 1e-6f);
+
+        bool isBlocked;
+        if (closestHit) {
+            glm::vec3 normal, hitPoint;
+            bool hit = false;
+            int materialInd, objectInd, lightInd;
+            cpu_calculate_ray_collision(scene, a, ray_d, normal, hitPoint, hit, materialInd, objectInd, lightInd);
+            isBlocked = hit && glm::length(hitPoint - a) < segmentLength;
+        }
+        else {
+            isBlocked = cpu_is_occluded(scene, a, ray_d, segmentLength);
+        }
+        rays++;
+        blocked += isBlocked ? 1 : 0;
+    }
+    return blocked;
+}
+
+CpuCamera cpu_make_camera(glm::vec4 camera_position, glm::vec4 camera_direction, int width, int height)
+{
+    CpuCamera cam;
+    cam.position = glm::vec3(camera_position.x, camera_position.y, camera_position.z);
+    cam.forward = glm::normalize(glm::vec3(camera_direction.x, camera_direction.y, camera_direction.z));
+    cam.right = glm::normalize(glm::cross(cam.forward, glm::vec3(0.0f, 0.0f, 1.0f)));
+    cam.up = glm::normalize(glm::cross(cam.right, cam.forward)) * float(height) / float(width);
+    return cam;
+}
+
+// the camera ray of one sample, same ray generation as main() in computeShader.c
+CpuPath cpu_camera_path(const CpuCamera& cam, int px, int py, int width, int height, int sampleIndex)
+{
+    RandomStream randomState = make_random_stream(uint32_t(py * width + px), uint32_t(sampleIndex), uint32_t(px), uint32_t(py), cpu_sampler);
+
+    float antiAX = 0, antiAY = 0;
+    if (cpu_anti_alias) {
+        antiAX = cpu_random(randomState);
+        antiAY = cpu_random(randomState);
+    }
+    float x = (px + antiAX) / width - 0.5f;
+    float z = (py + antiAY) / height - 0.5f;
+
+    glm::vec3 ray_d = glm::normalize(cam.forward + cam.right * x + cam.up * z);
+
+    return cpu_begin_path(cam.position, ray_d, randomState);
+}
+
+// one sample for one pixel
+glm::vec3 cpu_render_sample(const CpuScene& scene, const CpuCamera& cam, int px, int py, int width, int height, int sampleIndex, uint64_t& rays, PixelAovs& aovs)
+{
+    CpuPath path = cpu_camera_path(cam, px, py, width, height, sampleIndex);
+    return cpu_trace(scene, path.ray_o, path.ray_d, path.state, rays, aovs);
+}
+
+// cpu backend accumulation, two entries per pixel: the mean and m2 of PixelStats in
+// computeShader.c (without the double sum), and the AovBlock layout. pixels holds the
+// displayed layer in the render texture layout
+struct CpuFrame
+{
+    vector<glm::vec4> stats;
+    vector<glm::vec4> aovs;
+    vector<glm::vec4> pixels;
+
+    void reset(int width, int height)
+    {
+        stats.assign(2 * width * height, glm::vec4(0.0f));
+        aovs.assign(AOV_ENTRIES * width * height, glm::vec4(0.0f));
+        pixels.assign(width * height, glm::vec4(0.0f));
+    }
+};
+
+// adds one sample to pixel `index`, the running mean and variance update of main() in computeShader.c
+void cpu_accumulate_sample(CpuFrame& frame, int index, glm::vec3 pixel, const PixelAovs& sampleAovs, int displayMode)
+{
+    glm::vec4& mean = frame.stats[2 * index];
+    glm::vec4& m2 = frame.stats[2 * index + 1];
+
+    mean.w += 1.0f;
+    glm::vec3 delta = pixel - glm::vec3(mean);
+    glm::vec3 newMean = glm::vec3(mean) + delta / mean.w;
+    glm::vec3 newM2 = glm::vec3(m2) + delta * (pixel - newMean);
+    mean = glm::vec4(newMean, mean.w);
+    m2 = glm::vec4(newM2, m2.w);
+
+    glm::vec4& normalDepth = frame.aovs[AOV_ENTRIES * index];
+    glm::vec4& albedo = frame.aovs[AOV_ENTRIES * index + 1];
+    glm::vec4& position = frame.aovs[AOV_ENTRIES * index + 2];
+    normalDepth += (sampleAovs.normalDepth - normalDepth) / mean.w;
+    albedo = glm::vec4(glm::vec3(albedo) + (glm::vec3(sampleAovs.albedo) - glm::vec3(albedo)) / mean.w, albedo.w);
+    position = glm::vec4(glm::vec3(position) + (glm::vec3(sampleAovs.position) - glm::vec3(position)) / mean.w, position.w);
+    if (mean.w == 1.0f) {
+        albedo.w = sampleAovs.albedo.w;
+        position.w = sampleAovs.position.w;
+    }
+
+    frame.pixels[index] = aov_display_color(displayMode, mean, normalDepth, albedo);
+}
+
+
+#endif
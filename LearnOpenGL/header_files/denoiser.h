@@ -0,0 +1,160 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+
+#include <glm/glm.hpp>
+
+#include <aov.h>
+
+#include <vector>
+#include <cmath>
+#include <thread>
+#include <algorithm>
+
+using namespace std;
+
+// CPU port of denoiseShader.c, an edge-avoiding A-Trous wavelet filter with the SVGF
+// variance guided luminance weight. Keep the weights in sync with the shader.
+// Inputs use the PixelStatsBlock and AovBlock layouts of computeShader.c and the output
+// the render texture layout with the variance in alpha.
+
+const int DENOISE_ITERATIONS = 5;
+
+const float DENOISE_SIGMA_LUMINANCE = 4.0f;
+const float DENOISE_SIGMA_NORMAL = 128.0f;  // exponent on dot(n_p, n_q)
+const float DENOISE_SIGMA_DEPTH = 0.02f;    // relative change in distance per pixel of offset
+const float DENOISE_SIGMA_ALBEDO = 0.1f;
+
+const float denoise_kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+float denoise_luminance(glm::vec3 c)
+{
+    return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// mean color and variance of the mean luminance, loadColor's first iteration in the shader
+glm::vec4 denoise_input(const vector<glm::vec4>& stats, int index)
+{
+    const glm::vec4& mean = stats[2 * index];
+    const glm::vec4& m2 = stats[2 * index + 1];
+    float variance = mean.w > 1.0f ? denoise_luminance(glm::vec3(m2)) / ((mean.w - 1.0f) * mean.w) : 1e4f;
+    return glm::vec4(glm::vec3(mean), max(variance, 0.0f));
+}
+
+float denoise_filtered_variance(const vector<glm::vec4>& colors, int width, int height, int px, int py)
+{
+    float sum = 0.0f;
+    float weightSum = 0.0f;
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            int qx = px + x, qy = py + y;
+            if (qx < 0 || qy < 0 || qx >= width || qy >= height) {
+                continue;
+            }
+            float w = denoise_kernel[abs(x) + 1] * denoise_kernel[abs(y) + 1];
+            sum += colors[qy * width + qx].w * w;
+            weightSum += w;
+        }
+    }
+    return sum / weightSum;
+}
+
+float denoise_feature_weight(const glm::vec4& normalDepthP, const glm::vec4& albedoP, const glm::vec4& normalDepthQ, const glm::vec4& albedoQ, float offset)
+{
+    bool hitP = normalDepthP.w > 0.0f;
+    bool hitQ = normalDepthQ.w > 0.0f;
+    if (hitP != hitQ) {
+        return 0.0f;
+    }
+    if (!hitP) {
+        return 1.0f; // both see the environment
+    }
+
+    glm::vec3 nP = glm::normalize(glm::vec3(normalDepthP));
+    glm::vec3 nQ = glm::normalize(glm::vec3(normalDepthQ));
+    float wNormal = pow(max(glm::dot(nP, nQ), 0.0f), DENOISE_SIGMA_NORMAL);
+    float wDepth = exp(-abs(normalDepthP.w - normalDepthQ.w) / (DENOISE_SIGMA_DEPTH * normalDepthP.w * offset + 1e-4f));
+    float wAlbedo = exp(-glm::length(glm::vec3(albedoP) - glm::vec3(albedoQ)) / DENOISE_SIGMA_ALBEDO);
+    return wNormal * wDepth * wAlbedo;
+}
+
+// one A-Trous iteration for pixel (px, py), main() of the shader
+glm::vec4 denoise_pixel(const vector<glm::vec4>& colors, const vector<glm::vec4>& aovs, int width, int height, int px, int py, int stepWidth)
+{
+    int indexP = py * width + px;
+    const glm::vec4& normalDepthP = aovs[AOV_ENTRIES * indexP];
+    const glm::vec4& albedoP = aovs[AOV_ENTRIES * indexP + 1];
+
+    const glm::vec4& colorP = colors[indexP];
+    float luminanceP = denoise_luminance(glm::vec3(colorP));
+    float sigmaL = DENOISE_SIGMA_LUMINANCE * sqrt(denoise_filtered_variance(colors, width, height, px, py)) + 1e-6f;
+
+    glm::vec3 colorSum = glm::vec3(0.0f);
+    float varianceSum = 0.0f;
+    float weightSum = 0.0f;
+    for (int y = -2; y <= 2; y++) {
+        for (int x = -2; x <= 2; x++) {
+            int qx = px + x * stepWidth, qy = py + y * stepWidth;
+            if (qx < 0 || qy < 0 || qx >= width || qy >= height) {
+                continue;
+            }
+
+            int indexQ = qy * width + qx;
+            const glm::vec4& colorQ = colors[indexQ];
+            float w = denoise_kernel[abs(x)] * denoise_kernel[abs(y)];
+            if (x != 0 || y != 0) {
+                float offset = float(stepWidth) * sqrt(float(x * x + y * y));
+                w *= denoise_feature_weight(normalDepthP, albedoP, aovs[AOV_ENTRIES * indexQ], aovs[AOV_ENTRIES * indexQ + 1], offset);
+                w *= exp(-abs(luminanceP - denoise_luminance(glm::vec3(colorQ))) / sigmaL);
+            }
+
+            colorSum += glm::vec3(colorQ) * w;
+            varianceSum += colorQ.w * w * w;
+            weightSum += w;
+        }
+    }
+
+    return glm::vec4(colorSum / weightSum, varianceSum / (weightSum * weightSum));
+}
+
+// runs rowFunction(y) for every row, split over the hardware threads
+template <typename RowFunction>
+void denoise_parallel_rows(int height, RowFunction rowFunction)
+{
+    int numThreads = max(1, min((int)thread::hardware_concurrency(), height));
+    vector<thread> workers;
+    for (int t = 0; t < numThreads; t++) {
+        workers.emplace_back([=]() {
+            for (int y = t; y < height; y += numThreads) {
+                rowFunction(y);
+            }
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+// denoises the accumulated image in `stats` guided by `aovs` into `out`
+void cpu_denoise(const vector<glm::vec4>& stats, const vector<glm::vec4>& aovs, int width, int height, int iterations, vector<glm::vec4>& out)
+{
+    vector<glm::vec4> colors(width * height);
+    for (int i = 0; i < width * height; i++) {
+        colors[i] = denoise_input(stats, i);
+    }
+
+    out.resize(width * height);
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        int stepWidth = 1 << iteration;
+        denoise_parallel_rows(height, [&](int y) {
+            for (int x = 0; x < width; x++) {
+                out[y * width + x] = denoise_pixel(colors, aovs, width, height, x, y, stepWidth);
+            }
+        });
+        swap(colors, out);
+    }
+    swap(colors, out);
+}
+
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef ENVIRONMENT_MAP_H
+#define ENVIRONMENT_MAP_H
+
+
+#include <glm/glm.hpp>
+
+#include "image_io.h"
+
+#include <vector>
+#include <string>
+#include <cmath>
+
+using namespace std;
+
+// Equirectangular HDR environment, z up. A direction at polar angle theta from +z and azimuth
+// phi = atan(y, x) maps to u = 0.5 - phi / 2pi, v = 1 - theta / pi, so +x sits in the middle
+// of the image and row 0, like every image here, is at the bottom (-z).
+//
+// Light is sampled from a piecewise constant 2D distribution over the texels, proportional to
+// their luminance times sin(theta) (pbrt's Distribution2D): first a row from the marginal CDF,
+// then a texel from that row's conditional CDF. cdf holds both in the layout of the GPU's
+// environmentCdf texture, max(width, height) x (height + 1) texels:
+//   row y < height: {conditional CDF at the end of texel x, texel's function value}
+//   row height:     {marginal CDF at the end of row x, row's integral} for x < height
+// so each search is a binary search along one row.
+
+struct EnvironmentMap
+{
+    int width = 0;
+    int height = 0;
+    vector<glm::vec4> pixels; // radiance, already scaled by the intensity
+    int cdfWidth = 0;
+    vector<glm::vec2> cdf;
+    float integral = 0.0f;    // of the function over [0,1]^2, 0 when the map is black
+};
+
+// builds the marginal and conditional CDFs over env.pixels
+void build_environment_distribution(EnvironmentMap& env)
+{
+    int w = env.width, h = env.height;
+    env.cdfWidth = max(w, h);
+    env.cdf.assign((size_t)env.cdfWidth * (h + 1), glm::vec2(0.0f));
+
+    vector<double> rowIntegral(h);
+    for (int y = 0; y < h; y++) {
+        float sinTheta = sin(3.141592f * (1.0f - (y + 0.5f) / h));
+        glm::vec2* row = &env.cdf[(size_t)y * env.cdfWidth];
+
+        double sum = 0.0;
+        for (int x = 0; x < w; x++) {
+            glm::vec4 c = env.pixels[(size_t)y * w + x];
+            float f = (0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b) * sinTheta;
+            row[x].y = f;
+            sum += f;
+        }
+        rowIntegral[y] = sum / w;
+
+        // a black row is never picked by the marginal, but keep its CDF valid
+        double running = 0.0;
+        for (int x = 0; x < w; x++) {
+            running += sum > 0.0 ? row[x].y : 1.0;
+            row[x].x = float(running / (sum > 0.0 ? sum : w));
+        }
+        row[w - 1].x = 1.0f;
+    }
+
+    double total = 0.0;
+    for (int y = 0; y < h; y++) {
+        total += rowIntegral[y];
+    }
+    env.integral = float(total / h);
+
+    glm::vec2* marginal = &env.cdf[(size_t)h * env.cdfWidth];
+    double running = 0.0;
+    for (int y = 0; y < h; y++) {
+        running += total > 0.0 ? rowIntegral[y] : 1.0;
+        marginal[y] = glm::vec2(float(running / (total > 0.0 ? total : h)), float(rowIntegral[y]));
+    }
+    marginal[h - 1].x = 1.0f;
+}
+
+// loads an equirectangular .hdr or .pfm, scales it by intensity and builds its distribution
+bool load_environment_map(const string& path, float intensity, EnvironmentMap& env)
+{
+    if (!read_hdr_image(path, env.pixels, env.width, env.height)) {
+        return false;
+    }
+    for (glm::vec4& p : env.pixels) {
+        p = glm::vec4(glm::vec3(p) * intensity, 1.0f);
+    }
+    build_environment_distribution(env);
+    return true;
+}
+
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef FRAME_BUDGET_H
+#define FRAME_BUDGET_H
+
+
+#include <algorithm>
+
+using namespace std;
+
+const int FRAME_BUDGET_MAX_SAMPLES = 256;       // per pixel per displayed frame
+const int FRAME_BUDGET_SAMPLES_PER_DISPATCH = 8; // more are split over several dispatches
+
+// How many samples per pixel the viewer renders between two presented frames. At one sample
+// per frame a still camera converges at the pace of the per-frame overhead (uniforms,
+// barriers, blit, swap) rather than of the path tracer. While the camera is still this
+// scales the samples until a frame takes about targetMs, and drops back to one the moment
+// the camera moves so the view stays responsive.
+class FrameBudget
+{
+public:
+    explicit FrameBudget(double targetMs = 0.0) : targetMs(targetMs) {}
+
+    bool enabled() const { return targetMs > 0.0; }
+
+    int samplesPerFrame() const { return enabled() ? max(1, int(rate)) : 1; }
+
+    // camera input, the next frame renders a single sample
+    void reset() { rate = 1.0; }
+
+    // after each presented frame, with the wall time it took. moves the samples halfway
+    // towards the count that would have hit the target, at most doubling or halving them
+    void update(double frameMs)
+    {
+        if (!enabled() || frameMs <= 0.0) return;
+        double scale = 1.0 + 0.5 * (targetMs / frameMs - 1.0);
+        rate = clamp(rate * clamp(scale, 0.5, 2.0), 1.0, double(FRAME_BUDGET_MAX_SAMPLES));
+    }
+
+private:
+    double targetMs;
+    double rate = 1.0;
+};
+
+
+#endif
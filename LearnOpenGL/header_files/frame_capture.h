@@ -0,0 +1,264 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include <image_io.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+const int FRAME_CAPTURE_BUFFERS = 3; // readbacks in flight, frames the gpu may run behind the captures
+
+// files a capture writes, any combination
+const int CAPTURE_PFM = 1; // linear HDR
+const int CAPTURE_PNG = 2; // tonemapped like the viewer
+
+// the formats a capture path asks for by its extension, which is cut off: .png for a
+// tonemapped PNG, .pfm or no extension for the linear HDR image
+int capture_formats(string& path)
+{
+    string ext = path.size() > 4 ? path.substr(path.size() - 4) : "";
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == ".png" || ext == ".pfm") {
+        path.resize(path.size() - 4);
+    }
+    return ext == ".png" ? CAPTURE_PNG : CAPTURE_PFM;
+}
+
+// Reads frames back from the gpu without waiting for it. capture() has glReadPixels copy the
+// image into the next of FRAME_CAPTURE_BUFFERS pixel pack buffers and fences the copy, which
+// the gpu does after the frame's other work while the cpu moves on. poll() passes every
+// buffer whose fence has signalled to a worker thread, which copies the pixels out and
+// encodes and writes the files, so the render loop never waits for the readback or the disk.
+// Only when all the buffers are still in flight does capture() wait for the oldest. On 4.4
+// contexts the buffers stay mapped and the worker reads them directly; older ones map and copy
+// them on the render thread in poll().
+class FrameCapture
+{
+public:
+    void init()
+    {
+        glGenFramebuffers(1, &framebuffer);
+        shutdown = false;
+        worker = thread(&FrameCapture::workerLoop, this);
+    }
+
+    // writes out everything still in flight first
+    void release()
+    {
+        if (framebuffer == 0) return;
+        for (int i = 0; i < FRAME_CAPTURE_BUFFERS; i++) {
+            waitForSlot(slots[i]);
+        }
+        {
+            lock_guard<mutex> lock(jobMutex);
+            shutdown = true;
+        }
+        jobCondition.notify_all();
+        worker.join();
+
+        for (Slot& slot : slots) {
+            releaseBuffer(slot);
+        }
+        glDeleteFramebuffers(1, &framebuffer);
+        framebuffer = 0;
+        if (captured > 0) {
+            cout << endl << "Captured " << captured << (captured == 1 ? " frame" : " frames");
+            if (stalls > 0) {
+                cout << ", waited for a free readback buffer " << stalls << (stalls == 1 ? " time" : " times");
+            }
+            cout << endl;
+        }
+    }
+
+    // starts the readback of the width x height corner of texture, to be written to path
+    // plus .pfm and/or .png. the copy happens after the gpu work issued so far
+    void capture(GLuint texture, int width, int height, const string& path, int formats)
+    {
+        Slot& slot = slots[next];
+        next = (next + 1) % FRAME_CAPTURE_BUFFERS;
+        if (slot.state != SLOT_FREE) {
+            stalls++;
+            waitForSlot(slot);
+        }
+
+        GLsizeiptr size = GLsizeiptr(width) * height * sizeof(glm::vec4);
+        if (size > slot.capacity) {
+            allocateBuffer(slot, size);
+        }
+        slot.width = width;
+        slot.height = height;
+        slot.path = path;
+        slot.formats = formats;
+
+        // rendered into by compute shaders, make their writes visible to the read
+        glMemoryBarrier(GL_FRAMEBUFFER_BARRIER_BIT | GL_PIXEL_BUFFER_BARRIER_BIT);
+        GLint previousFramebuffer;
+        glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &previousFramebuffer);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+        glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_FLOAT, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, previousFramebuffer);
+
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.state = SLOT_READING;
+        captured++;
+    }
+
+    // hands the readbacks the gpu has finished to the worker, never blocks. once per frame
+    void poll()
+    {
+        for (Slot& slot : slots) {
+            if (slot.state == SLOT_READING && glClientWaitSync(slot.fence, 0, 0) != GL_TIMEOUT_EXPIRED) {
+                encode(slot);
+            }
+        }
+    }
+
+    int framesCaptured() const { return captured; }
+
+private:
+    enum SlotState { SLOT_FREE, SLOT_READING, SLOT_ENCODING };
+
+    struct Slot
+    {
+        GLuint buffer = 0;
+        GLsizeiptr capacity = 0;
+        const char* mapped = NULL; // persistently, on 4.4
+        GLsync fence = 0;
+        atomic<SlotState> state{ SLOT_FREE }; // set to SLOT_FREE by the worker
+
+        int width = 0;
+        int height = 0;
+        string path;
+        int formats = 0;
+        vector<glm::vec4> pixels; // copied out of the buffer, rows bottom to top
+    };
+
+    void allocateBuffer(Slot& slot, GLsizeiptr size)
+    {
+        releaseBuffer(slot);
+        glGenBuffers(1, &slot.buffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        if (GLAD_GL_VERSION_4_4) {
+            GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NULL, flags);
+            slot.mapped = (const char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags);
+        }
+        else {
+            glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.capacity = size;
+    }
+
+    void releaseBuffer(Slot& slot)
+    {
+        if (slot.buffer == 0) return;
+        if (slot.mapped) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            slot.mapped = NULL;
+        }
+        glDeleteBuffers(1, &slot.buffer);
+        slot.buffer = 0;
+        slot.capacity = 0;
+    }
+
+    // the gpu is done with the slot's copy: queue it for the worker
+    void encode(Slot& slot)
+    {
+        glDeleteSync(slot.fence);
+        slot.fence = 0;
+        if (!slot.mapped) {
+            slot.pixels.resize(size_t(slot.width) * slot.height);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+            const void* data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot.pixels.size() * sizeof(glm::vec4), GL_MAP_READ_BIT);
+            memcpy(slot.pixels.data(), data, slot.pixels.size() * sizeof(glm::vec4));
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+        {
+            lock_guard<mutex> lock(jobMutex);
+            slot.state = SLOT_ENCODING;
+            jobs.push_back(&slot);
+        }
+        jobCondition.notify_one();
+    }
+
+    // blocks until the slot is free again
+    void waitForSlot(Slot& slot)
+    {
+        if (slot.state == SLOT_READING) {
+            while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+            encode(slot);
+        }
+        unique_lock<mutex> lock(jobMutex);
+        doneCondition.wait(lock, [&] { return slot.state == SLOT_FREE; });
+    }
+
+    void workerLoop()
+    {
+        while (true) {
+            Slot* slot;
+            {
+                unique_lock<mutex> lock(jobMutex);
+                jobCondition.wait(lock, [&] { return shutdown || !jobs.empty(); });
+                if (jobs.empty()) return;
+                slot = jobs.front();
+                jobs.pop_front();
+            }
+
+            if (slot->mapped) {
+                slot->pixels.resize(size_t(slot->width) * slot->height);
+                memcpy(slot->pixels.data(), slot->mapped, slot->pixels.size() * sizeof(glm::vec4));
+            }
+            if (slot->formats & CAPTURE_PFM) {
+                write_pfm(slot->path + ".pfm", slot->pixels, slot->width, slot->height);
+            }
+            if (slot->formats & CAPTURE_PNG) {
+                write_tonemapped_png(slot->path + ".png", slot->pixels, slot->width, slot->height);
+            }
+
+            {
+                lock_guard<mutex> lock(jobMutex);
+                slot->state = SLOT_FREE;
+            }
+            doneCondition.notify_all();
+        }
+    }
+
+    Slot slots[FRAME_CAPTURE_BUFFERS];
+    int next = 0;
+    GLuint framebuffer = 0;
+    int captured = 0;
+    int stalls = 0;
+
+    thread worker;
+    mutex jobMutex;
+    condition_variable jobCondition;
+    condition_variable doneCondition;
+    deque<Slot*> jobs;
+    bool shutdown = false;
+};
+
+
+#endif
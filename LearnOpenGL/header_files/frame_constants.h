@@ -0,0 +1,144 @@
+#ifndef FRAME_CONSTANTS_H
+#define FRAME_CONSTANTS_H
+
+
+#include <glad/glad.h>
+
+#include <glm/glm.hpp>
+
+#include <cstring>
+#include <cstdint>
+
+using namespace std;
+
+// std140 twin of the FrameConstants uniform block in computeShader.c, keep the two in sync
+struct FrameConstants
+{
+    glm::vec4 cameraPosition;
+    glm::vec4 cameraDirection;
+    int32_t imageDims[2];
+    float time;
+    int32_t frame;
+    int32_t numSpheres;
+    int32_t numTriangles;
+    int32_t numMaterials;
+    int32_t numNodes;
+    int32_t trianglesPerBlock;
+    int32_t nodesPerBlock;
+    int32_t accumulate;
+    int32_t samplesPerDispatch;
+    int32_t maxBounceCount;
+    int32_t minBounceCount;
+    int32_t numLights;
+    float lightPower;
+    float environmentIntegral;
+    float convergenceThreshold;
+    int32_t rayQueryBenchmark;
+    int32_t padding;
+};
+static_assert(sizeof(FrameConstants) == 112, "FrameConstants must match the std140 layout of the shader's block");
+
+const GLuint FRAME_CONSTANTS_BINDING = 0;
+const int FRAME_CONSTANTS_FRAMES = 3;     // regions of the ring, frames the cpu may run ahead
+const int FRAME_CONSTANTS_PER_FRAME = 64; // dispatches per region before it moves on by itself
+
+// The path tracer's per-dispatch constants, written straight into a persistently mapped
+// uniform buffer instead of a glBufferData and a string lookup per uniform. The buffer is a
+// ring of FRAME_CONSTANTS_FRAMES regions of FRAME_CONSTANTS_PER_FRAME slots. Every push()
+// fills the next slot and binds it; endFrame() fences the region the frame used and moves on,
+// and a region is only written again once its fence has passed, so the gpu never reads a slot
+// the cpu is overwriting. Batch renders never call endFrame(): a full region moves on by
+// itself. Contexts older than 4.4 have no glBufferStorage and update the slots with
+// glBufferSubData instead.
+class FrameConstantsRing
+{
+public:
+    void init()
+    {
+        GLint alignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        stride = (GLsizeiptr(sizeof(FrameConstants)) + alignment - 1) / alignment * alignment;
+        GLsizeiptr size = stride * FRAME_CONSTANTS_FRAMES * FRAME_CONSTANTS_PER_FRAME;
+
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        if (GLAD_GL_VERSION_4_4) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_UNIFORM_BUFFER, size, NULL, flags);
+            mapped = (char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, size, flags);
+        }
+        else {
+            glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    void release()
+    {
+        if (buffer == 0) return;
+        for (GLsync& fence : fences) {
+            if (fence) glDeleteSync(fence);
+            fence = 0;
+        }
+        if (mapped) {
+            glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+            glUnmapBuffer(GL_UNIFORM_BUFFER);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            mapped = NULL;
+        }
+        glDeleteBuffers(1, &buffer);
+        buffer = 0;
+    }
+
+    // copies the constants into the next slot and binds it for the next dispatch
+    void push(const FrameConstants& constants)
+    {
+        if (slot == FRAME_CONSTANTS_PER_FRAME) {
+            endFrame();
+        }
+        if (slot == 0) {
+            waitForRegion();
+        }
+        GLintptr offset = stride * (region * FRAME_CONSTANTS_PER_FRAME + slot);
+        if (mapped) {
+            memcpy(mapped + offset, &constants, sizeof(FrameConstants));
+        }
+        else {
+            glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+            glBufferSubData(GL_UNIFORM_BUFFER, offset, sizeof(FrameConstants), &constants);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        }
+        glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_CONSTANTS_BINDING, buffer, offset, sizeof(FrameConstants));
+        slot++;
+    }
+
+    // after the frame's last dispatch: the gpu signals the fence once it is done with them
+    void endFrame()
+    {
+        if (slot == 0) return;
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        region = (region + 1) % FRAME_CONSTANTS_FRAMES;
+        slot = 0;
+    }
+
+private:
+    // blocks until the gpu has finished the dispatches that last read this region
+    void waitForRegion()
+    {
+        GLsync& fence = fences[region];
+        if (!fence) return;
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+        glDeleteSync(fence);
+        fence = 0;
+    }
+
+    GLuint buffer = 0;
+    char* mapped = NULL;
+    GLsizeiptr stride = 0;
+    GLsync fences[FRAME_CONSTANTS_FRAMES] = {};
+    int region = 0;
+    int slot = 0;
+};
+
+
+#endif
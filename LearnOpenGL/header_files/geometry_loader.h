@@ -108,6 +108,8 @@ void load_vertex_data(string geometry_data, string material_data, vector<Triangl
 
     string currentMaterial;
     string preface;
+    int currentObject = 0; // stored in materialData.y, counts the "o" lines
+    bool objectSeen = false;
 
     while (!f.eof()) {
         char line[128];
@@ -121,6 +123,12 @@ void load_vertex_data(string geometry_data, string material_data, vector<Triangl
         if (line[0] == 'u') {
             s >> preface >> currentMaterial;
         }
+        if (line[0] == 'o') {
+            if (objectSeen) {
+                currentObject++;
+            }
+            objectSeen = true;
+        }
         if (line[0] == 'v') {
             glm::vec4 v;
             s >> identifier >> v.x >> v.y >> v.z;
@@ -133,7 +141,7 @@ void load_vertex_data(string geometry_data, string material_data, vector<Triangl
             if (!mmap.count(currentMaterial)) {
                 cout << "Could not locate material : " << currentMaterial << endl;
             }
-            trivect.push_back({ verts[f[0] - 1], verts[f[1] - 1], verts[f[2] - 1], glm::vec4(mmap[currentMaterial], 0.0, 0.0, 0.0) });
+            trivect.push_back({ verts[f[0] - 1], verts[f[1] - 1], verts[f[2] - 1], glm::vec4(mmap[currentMaterial], currentObject, 0.0, 0.0) });
         }
 
     }
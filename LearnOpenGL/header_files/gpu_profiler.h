@@ -0,0 +1,208 @@
+#ifndef GPU_PROFILER_H
+#define GPU_PROFILER_H
+
+
+#include <glad/glad.h>
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+
+using namespace std;
+
+// the passes of a frame the profiler times. GL_TIME_ELAPSED queries cannot nest, so passes
+// never overlap
+enum GpuPass
+{
+    GPU_PASS_UPLOAD,     // the image on the cpu backend
+    GPU_PASS_PATH_TRACE, // one dispatch, one sample per pixel (on average when adaptive)
+    GPU_PASS_ADAPTIVE,   // tile error readback and sample reallocation
+    GPU_PASS_REPROJECT,  // saving and reprojecting the history when the accumulation restarts
+    GPU_PASS_DENOISE,
+    GPU_PASS_RESOLVE,    // accumulation buffer to the display texture
+    GPU_PASS_BLIT,       // display texture to the screen quad
+    GPU_PASS_CAPTURE,    // display texture into a pixel buffer for a screenshot or recording
+    GPU_PASS_COUNT
+};
+
+const char* const GPU_PASS_NAMES[GPU_PASS_COUNT] = { "upload", "path trace", "adaptive", "reproject", "denoise", "resolve", "blit", "capture" };
+
+const int GPU_PROFILER_RING = 8;      // queries in flight per pass, frames the results may lag
+const int GPU_PROFILER_WINDOW = 256;  // results per pass the averages and percentiles cover
+
+struct GpuPassStats
+{
+    int count = 0;
+    double meanMs = 0.0, p50Ms = 0.0, p95Ms = 0.0, p99Ms = 0.0, maxMs = 0.0;
+};
+
+// GPU time of each pass from GL_TIME_ELAPSED queries. Every pass has a ring of query objects:
+// end() issues one, and collect() reads back the ones the GPU has finished without waiting,
+// so the render loop never stalls on them. A pass that laps its ring waits for its oldest
+// query instead of losing it. The queries are cheap enough to always run; --profile only
+// decides whether the results are printed.
+class GpuProfiler
+{
+public:
+    void init()
+    {
+        for (PassRing& ring : passes) {
+            glGenQueries(GPU_PROFILER_RING, ring.queries);
+        }
+        initialized = true;
+    }
+
+    void release()
+    {
+        if (!initialized) return;
+        for (PassRing& ring : passes) {
+            glDeleteQueries(GPU_PROFILER_RING, ring.queries);
+        }
+        initialized = false;
+        csv.close();
+    }
+
+    // every resolved query as a "frame,pass,ms" row
+    bool openCsv(const string& path)
+    {
+        csv.open(path);
+        if (!csv) {
+            cout << "Could not open " << path << endl;
+            return false;
+        }
+        csv << "frame,pass,ms\n";
+        return true;
+    }
+
+    void begin(GpuPass pass)
+    {
+        if (!initialized) return;
+        PassRing& ring = passes[pass];
+        if (ring.pending == GPU_PROFILER_RING) {
+            resolve(pass, true);
+        }
+        glBeginQuery(GL_TIME_ELAPSED, ring.queries[(ring.first + ring.pending) % GPU_PROFILER_RING]);
+        active = pass;
+    }
+
+    void end()
+    {
+        if (active == GPU_PASS_COUNT) return;
+        glEndQuery(GL_TIME_ELAPSED);
+        PassRing& ring = passes[active];
+        ring.frames[(ring.first + ring.pending) % GPU_PROFILER_RING] = frame;
+        ring.pending++;
+        active = GPU_PASS_COUNT;
+    }
+
+    // reads whatever has finished, everything when wait is set. call once per frame
+    void collect(bool wait = false)
+    {
+        if (!initialized) return;
+        for (int pass = 0; pass < GPU_PASS_COUNT; pass++) {
+            while (passes[pass].pending > 0 && resolve(GpuPass(pass), wait)) {}
+        }
+        frame++;
+    }
+
+    // GPU time of the pass in the most recent frame that has been read back
+    double lastMs(GpuPass pass) const
+    {
+        const PassRing& ring = passes[pass];
+        return ring.window.empty() ? 0.0 : ring.window[(ring.windowNext + ring.window.size() - 1) % ring.window.size()];
+    }
+
+    GpuPassStats stats(GpuPass pass) const
+    {
+        GpuPassStats s;
+        vector<double> sorted = passes[pass].window;
+        if (sorted.empty()) return s;
+        sort(sorted.begin(), sorted.end());
+        s.count = (int)sorted.size();
+        for (double ms : sorted) s.meanMs += ms;
+        s.meanMs /= sorted.size();
+        auto percentile = [&](double p) { return sorted[min(sorted.size() - 1, size_t(p * sorted.size()))]; };
+        s.p50Ms = percentile(0.5);
+        s.p95Ms = percentile(0.95);
+        s.p99Ms = percentile(0.99);
+        s.maxMs = sorted.back();
+        return s;
+    }
+
+    // one row per pass that has results, over the last GPU_PROFILER_WINDOW frames
+    void print() const
+    {
+        cout << setw(14) << left << "GPU pass" << setw(8) << "frames" << setw(10) << "mean ms" << setw(10) << "p50"
+            << setw(10) << "p95" << setw(10) << "p99" << "max" << endl;
+        cout << fixed << setprecision(3);
+        for (int pass = 0; pass < GPU_PASS_COUNT; pass++) {
+            GpuPassStats s = stats(GpuPass(pass));
+            if (s.count == 0) continue;
+            cout << setw(14) << GPU_PASS_NAMES[pass] << setw(8) << s.count << setw(10) << s.meanMs << setw(10) << s.p50Ms
+                << setw(10) << s.p95Ms << setw(10) << s.p99Ms << s.maxMs << endl;
+        }
+        cout << defaultfloat << setprecision(6);
+    }
+
+private:
+    struct PassRing
+    {
+        GLuint queries[GPU_PROFILER_RING];
+        int frames[GPU_PROFILER_RING];
+        int first = 0;   // oldest unresolved query
+        int pending = 0;
+        vector<double> window; // ring of the last GPU_PROFILER_WINDOW frames' times
+        size_t windowNext = 0;
+        int lastFrame = -1;    // of the newest entry in window
+    };
+
+    PassRing passes[GPU_PASS_COUNT];
+    GpuPass active = GPU_PASS_COUNT;
+    bool initialized = false;
+    int frame = 0;
+    ofstream csv;
+
+    // reads the oldest query of the pass, false if it is not available and wait is not set
+    bool resolve(GpuPass pass, bool wait)
+    {
+        PassRing& ring = passes[pass];
+        GLuint query = ring.queries[ring.first];
+        if (!wait) {
+            GLint available = 0;
+            glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) return false;
+        }
+        GLuint64 ns = 0;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+        double ms = ns / 1e6;
+
+        // a pass timed more than once in a frame counts once, with the summed time
+        if (ring.frames[ring.first] == ring.lastFrame) {
+            ring.window[(ring.windowNext + ring.window.size() - 1) % ring.window.size()] += ms;
+        }
+        else {
+            if (ring.window.size() < size_t(GPU_PROFILER_WINDOW)) {
+                ring.window.push_back(ms);
+            }
+            else {
+                ring.window[ring.windowNext] = ms;
+            }
+            ring.windowNext = (ring.windowNext + 1) % GPU_PROFILER_WINDOW;
+            ring.lastFrame = ring.frames[ring.first];
+        }
+        if (csv.is_open()) {
+            csv << ring.frames[ring.first] << "," << GPU_PASS_NAMES[pass] << "," << ms << "\n";
+        }
+
+        ring.first = (ring.first + 1) % GPU_PROFILER_RING;
+        ring.pending--;
+        return true;
+    }
+};
+
+
+#endif
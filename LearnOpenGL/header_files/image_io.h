@@ -0,0 +1,301 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+
+using namespace std;
+
+// Images are linear RGBA float, row 0 at the bottom, the same layout as the render texture.
+
+// same curve as ACESFilm in screenQuadFrag.c
+float aces_film(float val)
+{
+    float a = 2.51f;
+    float b = 0.03f;
+    float c = 2.43f;
+    float d = 0.59f;
+    float e = 0.14f;
+    float tone_mapped = (val * (a * val + b)) / (val * (c * val + d) + e);
+    return glm::clamp(tone_mapped, 0.0f, 1.0f);
+}
+
+// portable float map, linear HDR. PFM rows run bottom to top like ours
+bool write_pfm(const string& path, const vector<glm::vec4>& pixels, int width, int height)
+{
+    ofstream f(path, ios::binary);
+    if (!f.is_open()) {
+        cout << "Failed to open image file: " << path << endl;
+        return false;
+    }
+
+    f << "PF\n" << width << " " << height << "\n-1.0\n"; // negative scale = little endian
+
+    vector<float> row(width * 3);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const glm::vec4& p = pixels[y * width + x];
+            row[x * 3 + 0] = p.r;
+            row[x * 3 + 1] = p.g;
+            row[x * 3 + 2] = p.b;
+        }
+        f.write((const char*)row.data(), row.size() * sizeof(float));
+    }
+    return true;
+}
+
+uint32_t png_crc(const unsigned char* data, size_t length, uint32_t crc = 0xffffffffu)
+{
+    static uint32_t table[256];
+    static bool tableReady = false;
+    if (!tableReady) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        tableReady = true;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+void png_put_u32(vector<unsigned char>& out, uint32_t v)
+{
+    out.push_back((v >> 24) & 0xff);
+    out.push_back((v >> 16) & 0xff);
+    out.push_back((v >> 8) & 0xff);
+    out.push_back(v & 0xff);
+}
+
+void png_write_chunk(ofstream& f, const char* type, const vector<unsigned char>& data)
+{
+    vector<unsigned char> chunk(type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+
+    vector<unsigned char> length;
+    png_put_u32(length, (uint32_t)data.size());
+    vector<unsigned char> crc;
+    png_put_u32(crc, png_crc(chunk.data(), chunk.size()) ^ 0xffffffffu);
+
+    f.write((const char*)length.data(), 4);
+    f.write((const char*)chunk.data(), chunk.size());
+    f.write((const char*)crc.data(), 4);
+}
+
+// 8-bit RGB PNG, rows top to bottom. Uses uncompressed deflate blocks so there is no zlib dependency
+bool write_png(const string& path, const vector<unsigned char>& rgb, int width, int height)
+{
+    ofstream f(path, ios::binary);
+    if (!f.is_open()) {
+        cout << "Failed to open image file: " << path << endl;
+        return false;
+    }
+
+    const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    f.write((const char*)signature, 8);
+
+    vector<unsigned char> header;
+    png_put_u32(header, width);
+    png_put_u32(header, height);
+    header.push_back(8); // bit depth
+    header.push_back(2); // truecolor
+    header.push_back(0); // deflate
+    header.push_back(0); // adaptive filtering
+    header.push_back(0); // no interlace
+    png_write_chunk(f, "IHDR", header);
+
+    // scanlines, each prefixed with filter type 0
+    vector<unsigned char> raw;
+    raw.reserve((size_t)height * (width * 3 + 1));
+    for (int y = 0; y < height; y++) {
+        raw.push_back(0);
+        raw.insert(raw.end(), rgb.begin() + (size_t)y * width * 3, rgb.begin() + (size_t)(y + 1) * width * 3);
+    }
+
+    vector<unsigned char> zlib = { 0x78, 0x01 };
+    uint32_t a = 1, b = 0; // adler32
+    for (size_t pos = 0; pos < raw.size() || pos == 0; pos += 65535) {
+        size_t len = min((size_t)65535, raw.size() - pos);
+        zlib.push_back(pos + len >= raw.size() ? 1 : 0); // final block flag
+        zlib.push_back(len & 0xff);
+        zlib.push_back((len >> 8) & 0xff);
+        zlib.push_back(~len & 0xff);
+        zlib.push_back((~len >> 8) & 0xff);
+        zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + len);
+
+        for (size_t i = pos; i < pos + len; i++) {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+    }
+    png_put_u32(zlib, (b << 16) | a);
+    png_write_chunk(f, "IDAT", zlib);
+
+    png_write_chunk(f, "IEND", vector<unsigned char>());
+    return true;
+}
+
+// tonemaps with the ACES curve the viewer uses and writes a PNG
+bool write_tonemapped_png(const string& path, const vector<glm::vec4>& pixels, int width, int height)
+{
+    vector<unsigned char> rgb((size_t)width * height * 3);
+    for (int y = 0; y < height; y++) {
+        const glm::vec4* row = &pixels[(size_t)(height - 1 - y) * width]; // flip to top-down
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < 3; c++) {
+                rgb[((size_t)y * width + x) * 3 + c] = (unsigned char)(aces_film(row[x][c]) * 255.0f + 0.5f);
+            }
+        }
+    }
+    return write_png(path, rgb, width, height);
+}
+
+// reads a PFM written by write_pfm or another tool, colour ("PF") or greyscale ("Pf")
+bool read_pfm(const string& path, vector<glm::vec4>& pixels, int& width, int& height)
+{
+    ifstream f(path, ios::binary);
+    if (!f.is_open()) {
+        cout << "Failed to open image file: " << path << endl;
+        return false;
+    }
+
+    string type;
+    float scale;
+    f >> type >> width >> height >> scale;
+    f.get(); // the single whitespace character before the data
+    if ((type != "PF" && type != "Pf") || width <= 0 || height <= 0) {
+        cout << "Not a PFM image: " << path << endl;
+        return false;
+    }
+
+    int channels = type == "PF" ? 3 : 1;
+    bool swapBytes = scale > 0.0f; // big endian data, every machine we build for is little endian
+    vector<float> data((size_t)width * height * channels);
+    f.read((char*)data.data(), data.size() * sizeof(float));
+    if (!f) {
+        cout << "PFM image is truncated: " << path << endl;
+        return false;
+    }
+
+    pixels.resize((size_t)width * height);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        float c[3];
+        for (int k = 0; k < 3; k++) {
+            float v = data[i * channels + min(k, channels - 1)];
+            if (swapBytes) {
+                uint32_t bits;
+                memcpy(&bits, &v, 4);
+                bits = (bits >> 24) | ((bits >> 8) & 0xff00u) | ((bits << 8) & 0xff0000u) | (bits << 24);
+                memcpy(&v, &bits, 4);
+            }
+            c[k] = v;
+        }
+        pixels[i] = glm::vec4(c[0], c[1], c[2], 1.0f);
+    }
+    return true;
+}
+
+// Radiance RGBE (.hdr) with flat or run-length encoded scanlines, in the usual "-Y h +X w"
+// orientation. Flipped on reading so row 0 ends up at the bottom
+bool read_radiance_hdr(const string& path, vector<glm::vec4>& pixels, int& width, int& height)
+{
+    ifstream f(path, ios::binary);
+    if (!f.is_open()) {
+        cout << "Failed to open image file: " << path << endl;
+        return false;
+    }
+
+    string line;
+    getline(f, line);
+    if (line.compare(0, 2, "#?") != 0) {
+        cout << "Not a Radiance HDR image: " << path << endl;
+        return false;
+    }
+    while (getline(f, line) && !line.empty()) {
+        if (line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe") {
+            cout << "Unsupported HDR format (" << line << "): " << path << endl;
+            return false;
+        }
+    }
+    getline(f, line);
+    char yAxis[3], xAxis[3];
+    if (sscanf(line.c_str(), "%2s %d %2s %d", yAxis, &height, xAxis, &width) != 4 || string(yAxis) != "-Y" || string(xAxis) != "+X" || width <= 0 || height <= 0) {
+        cout << "Unsupported HDR orientation (" << line << "): " << path << endl;
+        return false;
+    }
+
+    pixels.resize((size_t)width * height);
+    vector<unsigned char> scanline((size_t)width * 4);
+    for (int y = 0; y < height; y++) {
+        unsigned char start[4];
+        f.read((char*)start, 4);
+        bool encoded = width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && ((start[2] << 8) | start[3]) == width;
+        if (!encoded) {
+            // flat scanline, the 4 bytes read are its first pixel
+            memcpy(scanline.data(), start, 4);
+            f.read((char*)scanline.data() + 4, scanline.size() - 4);
+        }
+        else {
+            // each of the four components is run-length encoded separately
+            for (int c = 0; c < 4; c++) {
+                for (int x = 0; x < width && f;) {
+                    int count = f.get();
+                    if (count > 128) {
+                        count -= 128;
+                        int value = f.get();
+                        for (int i = 0; i < count && x < width; i++) scanline[(size_t)(x++) * 4 + c] = (unsigned char)value;
+                    }
+                    else {
+                        for (int i = 0; i < count && x < width; i++) scanline[(size_t)(x++) * 4 + c] = (unsigned char)f.get();
+                    }
+                }
+            }
+        }
+        if (!f) {
+            cout << "HDR image is truncated: " << path << endl;
+            return false;
+        }
+
+        glm::vec4* row = &pixels[(size_t)(height - 1 - y) * width];
+        for (int x = 0; x < width; x++) {
+            const unsigned char* rgbe = &scanline[(size_t)x * 4];
+            float scale = rgbe[3] == 0 ? 0.0f : ldexp(1.0f, int(rgbe[3]) - (128 + 8));
+            row[x] = glm::vec4((rgbe[0] + 0.5f) * scale, (rgbe[1] + 0.5f) * scale, (rgbe[2] + 0.5f) * scale, 1.0f);
+        }
+    }
+    return true;
+}
+
+// .pfm or .hdr by extension
+bool read_hdr_image(const string& path, vector<glm::vec4>& pixels, int& width, int& height)
+{
+    string ext = path.size() > 4 ? path.substr(path.size() - 4) : "";
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == ".pfm") {
+        return read_pfm(path, pixels, width, height);
+    }
+    if (ext == ".hdr") {
+        return read_radiance_hdr(path, pixels, width, height);
+    }
+    cout << "Unknown HDR image type (expected .hdr or .pfm): " << path << endl;
+    return false;
+}
+
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef LIGHT_SAMPLING_H
+#define LIGHT_SAMPLING_H
+
+
+#include <glm/glm.hpp>
+
+#include "triangle.h"
+#include "material.h"
+#include "sphere.h"
+#include "bvh.h"
+
+#include <vector>
+#include <cmath>
+
+using namespace std;
+
+// Emissive triangles and spheres for next-event estimation. A light is picked either in
+// proportion to its power (luminance of the emission * area) through an alias table (Vose's
+// method), one lookup whatever the number of lights, or by its estimated contribution at the
+// shading point through the light tree in bvh.h, ceil(log2(lights)) steps.
+// LightBlock and LightTreeBlock in computeShader.c hold the same entries.
+
+const int LIGHT_TRIANGLE = 0;
+const int LIGHT_SPHERE = 1;
+
+struct Light
+{
+	glm::vec4 data; // {type, primitive index, alias threshold, alias index}
+	glm::vec4 tree; // {branches from the light tree root to this light (see buildLightTree), unused, unused, unused}
+};
+
+float light_luminance(glm::vec3 c)
+{
+	return glm::dot(c, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// emitted radiance of a material, emissionColor * emissionStrength
+glm::vec3 material_emission(const Material& m)
+{
+	return glm::vec3(m.emissionColor) * m.data.x;
+}
+
+float triangle_area(const Triangle& t)
+{
+	return 0.5f * glm::length(glm::cross(glm::vec3(t.v1 - t.v0), glm::vec3(t.v2 - t.v0)));
+}
+
+// Collects every primitive whose material emits and builds the alias table over them.
+// totalPower receives the summed power, which the pdfs in the shader divide by. Stores each
+// primitive's light index in materialData.z (-1 if it does not emit) so a hit can find its pdf.
+vector<Light> build_light_table(vector<Triangle>& triangles, vector<Sphere>& spheres, const vector<Material>& materials, float& totalPower)
+{
+	vector<Light> lights;
+	vector<double> power;
+
+	for (int i = 0; i < (int)triangles.size(); i++) {
+		float p = light_luminance(material_emission(materials[int(triangles[i].materialData.x)])) * triangle_area(triangles[i]);
+		triangles[i].materialData.z = p > 0.0f ? float(lights.size()) : -1.0f;
+		if (p > 0.0f) {
+			lights.push_back({ glm::vec4(LIGHT_TRIANGLE, i, 1.0f, lights.size()), glm::vec4(0.0f) });
+			power.push_back(p);
+		}
+	}
+	for (int i = 0; i < (int)spheres.size(); i++) {
+		float r = spheres[i].data.w;
+		float p = light_luminance(material_emission(materials[int(spheres[i].materialData.x)])) * 4.0f * 3.141592f * r * r;
+		spheres[i].materialData.z = p > 0.0f ? float(lights.size()) : -1.0f;
+		if (p > 0.0f) {
+			lights.push_back({ glm::vec4(LIGHT_SPHERE, i, 1.0f, lights.size()), glm::vec4(0.0f) });
+			power.push_back(p);
+		}
+	}
+
+	totalPower = 0.0f;
+	double sum = 0.0;
+	for (double p : power) {
+		sum += p;
+	}
+	if (lights.empty()) {
+		return lights;
+	}
+	totalPower = float(sum);
+
+	// scale so the average is one, then pair every small entry with a large one
+	int n = lights.size();
+	vector<double> scaled(n);
+	vector<int> small, large;
+	for (int i = 0; i < n; i++) {
+		scaled[i] = power[i] * n / sum;
+		(scaled[i] < 1.0 ? small : large).push_back(i);
+	}
+	while (!small.empty() && !large.empty()) {
+		int s = small.back(); small.pop_back();
+		int l = large.back();
+
+		lights[s].data.z = float(scaled[s]);
+		lights[s].data.w = float(l);
+
+		scaled[l] -= 1.0 - scaled[s];
+		if (scaled[l] < 1.0) {
+			large.pop_back();
+			small.push_back(l);
+		}
+	}
+	// whatever is left is one up to rounding and keeps itself
+	for (int i : small) lights[i].data.z = 1.0f;
+	for (int i : large) lights[i].data.z = 1.0f;
+
+	return lights;
+}
+
+// Builds the light tree over the table and stores every light's path from the root in
+// tree.x. Triangles emit from both faces with a cosine falloff, spheres in every direction
+vector<LightNode> build_light_tree(vector<Light>& lights, const vector<Triangle>& triangles, const vector<Sphere>& spheres, const vector<Material>& materials)
+{
+	vector<LightBounds> bounds;
+	for (const Light& light : lights) {
+		LightBounds b;
+		int primitive = int(light.data.y);
+		if (int(light.data.x) == LIGHT_TRIANGLE) {
+			const Triangle& t = triangles[primitive];
+			b.minPoint = glm::min(glm::vec3(t.v0), glm::min(glm::vec3(t.v1), glm::vec3(t.v2)));
+			b.maxPoint = glm::max(glm::vec3(t.v0), glm::max(glm::vec3(t.v1), glm::vec3(t.v2)));
+			b.axis = glm::normalize(glm::cross(glm::vec3(t.v1 - t.v0), glm::vec3(t.v2 - t.v0)));
+			b.cosThetaO = 1.0f;
+			b.power = light_luminance(material_emission(materials[int(t.materialData.x)])) * triangle_area(t);
+			b.twoSided = true;
+		}
+		else {
+			const Sphere& s = spheres[primitive];
+			b.minPoint = glm::vec3(s.data) - s.data.w;
+			b.maxPoint = glm::vec3(s.data) + s.data.w;
+			b.axis = glm::vec3(0.0f, 0.0f, 1.0f);
+			b.cosThetaO = -1.0f;
+			b.power = light_luminance(material_emission(materials[int(s.materialData.x)])) * 4.0f * 3.141592f * s.data.w * s.data.w;
+			b.twoSided = false;
+		}
+		b.cosThetaE = 0.0f; // theta_e = 90 degrees
+		bounds.push_back(b);
+	}
+
+	// trails are stored as floats, exact up to 24 levels
+	vector<uint32_t> trails;
+	vector<LightNode> nodes = buildLightTree(bounds, trails);
+	for (int i = 0; i < (int)lights.size(); i++) {
+		lights[i].tree.x = float(trails[i]);
+	}
+	return nodes;
+}
+
+
+#endif
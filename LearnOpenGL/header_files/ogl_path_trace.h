@@ -17,33 +17,78 @@
 
 #include <sphere.h>
 #include <bvh.h>
+#include <cpu_path_trace.h>
+#include <tile_scheduler.h>
+#include <ray_sorting.h>
+#include <render_settings.h>
+#include <adaptive_sampling.h>
+#include <denoiser.h>
+#include <gpu_profiler.h>
+#include <workgroup_size.h>
+#include <frame_budget.h>
+#include <frame_constants.h>
+#include <render_resolution.h>
+#include <frame_capture.h>
+#include <camera_path.h>
 
 #include <cmath>
 #include <iomanip>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <ctime>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void renderQuad();
 void handleMovementInput(GLFWwindow* window, int key, int scancode, int action, int mods);
-void updateCameraBuffer();
+void updateCamera();
 static void cursorPosCallback(GLFWwindow* window, double xpos, double ypos);
-void setupBuffers(int &numSpheres, int &numTriangles, int &numMaterials, int &numNodes);
+bool loadScene(const RenderSettings &settings);
+bool setupBuffers(int &numTris, int &numSpheres, int &numMaterials, int &numNodes);
+void allocatePixelBuffers();
+uint64_t renderCpuPass(TileScheduler &scheduler, CpuFrame &cpuFrame, int sampleLimit = 0);
 
 GLuint sphereSSbo;
 GLuint triangleSSbo;
+GLuint triangleOverflowSSbo;
 GLuint materialSSbo;
-GLuint cameraSSbo;
 GLuint bvhSSbo;
+GLuint bvhOverflowSSbo;
+GLuint rayCounterSSbo;
+GLuint pixelStatsSSbo;
+GLuint tileSSbo;
+GLuint aovSSbo;
+GLuint lightSSbo;
+GLuint lightTreeSSbo;
+GLuint occlusionLinkSSbo;
+GLuint blueNoiseSSbo;
+GLuint rayStatsSSbo;
+GLuint historySSbo;
+GLuint reprojectedSSbo;
+GLuint environmentTexture;
+GLuint environmentCdfTexture;
+// camera, counts and modes of every path tracing dispatch, created by setupBuffers
+FrameConstantsRing frameConstants;
 
 const float PI = 3.141592f;
 
-// settings
-const unsigned int SCR_WIDTH = 1000;
-const unsigned int SCR_HEIGHT = 800;
+// settings, overridden from the command line by applySettings
+unsigned int SCR_WIDTH = 1000;
+unsigned int SCR_HEIGHT = 800;
 
-// texture size
-const unsigned int TEXTURE_WIDTH = 1000;
-const unsigned int TEXTURE_HEIGHT = 800;
+// texture size: the image path traced this frame. the per pixel buffers and the display and
+// denoise textures are allocated for TARGET_WIDTH x TARGET_HEIGHT and the frame uses their
+// corner, so the viewer's dynamic resolution never reallocates them
+unsigned int TEXTURE_WIDTH = 1000;
+unsigned int TEXTURE_HEIGHT = 800;
+unsigned int TARGET_WIDTH = 1000;
+unsigned int TARGET_HEIGHT = 800;
+
+// viewer: render scale, [ and ] change it, and the smaller scale while the camera moves
+RenderResolution renderResolution;
+
+int maxBounces = 16;
+int minBounces = 3;
 
 // timing 
 float deltaTime = 0.0f;
@@ -62,13 +107,161 @@ double pxpos = 0, pypos = 0; // previous mouse coordinates
 
 int userDefinedDisplayMode = 1;
 int displayMode = 1;
+// of the viewer's display texture. batch renders always resolve to GL_RGBA32F
+GLenum displayFormat = GL_RGBA16F;
 int userDefinedAccumulate = 1;
 int accumulate = 0;
 bool frameMessage = true;
 
+// samples per pixel between two presented frames while the camera is still (gpu backend),
+// see frame_budget.h. samplesPerDispatch is what one path tracing dispatch takes of them
+FrameBudget frameBudget;
+int samplesPerDispatch = 1;
+
+// adaptive sampling (gpu backend), toggled with V. tile samples are reallocated every adaptiveInterval frames
+bool adaptiveSampling = false;
+float convergenceThreshold = 0.02f;
+int adaptiveInterval = 4;
+
+// next-event estimation with multiple importance sampling, toggled with L. lights are picked
+// with the light tree, or by power alone without it
+bool nextEventEstimation = true;
+bool lightTreeSampling = true;
+
+// shadow rays walk the BVH with the most likely occluder first instead of in build order
+bool orderedOcclusion = true;
+
+// SAMPLER_* spreading each pixel's samples, see random_stream.h
+uint32_t samplerType = SAMPLER_SOBOL;
+
+// also keep the primary hit position and object / material ids in the AOV buffer
+bool aovExtras = false;
+
+// temporal reprojection (gpu viewer), toggled with H: a restarted accumulation starts from
+// the last view's image where the same surfaces are still visible, see reprojectShader.c.
+// lastView is the camera and size of the last path tracing dispatch, the history's view
+bool reprojection = true;
+struct RenderedView
+{
+	glm::vec4 position = glm::vec4(0.0);
+	glm::vec4 direction = glm::vec4(0.0);
+	int width = 0;
+	int height = 0;
+	bool valid = false; // false before the first dispatch and after the buffers are reallocated
+};
+RenderedView lastView;
+
+// frame capture (viewer): P saves the displayed HDR image as a screenshot, K starts and stops
+// recording every frame to capturePath_<n>. both read back the display texture asynchronously,
+// so they get the current display mode at displayFormat's precision, see frame_capture.h
+FrameCapture frameCapture;
+bool screenshotRequested = false;
+bool recording = false;
+string capturePath = "capture";
+int captureFormats = CAPTURE_PFM;
+int recordedFrames = 0;
+
+// camera path (viewer): --record-camera saves the camera of every frame on exit.
+// --replay-camera flies the camera along a saved path instead of the input, replayStep
+// seconds of the path per frame however long the frame took, and closes the viewer at its end.
+// A replay renders one sample per frame and times the dynamic resolution by the path, so two
+// replays render the same frames
+CameraPath cameraRecording;
+string cameraRecordingPath;
+CameraPath cameraReplay;
+bool replayingCamera = false;
+double replayStep = 1.0 / 30.0;
+int replayFrame = 0;
+
+// edge-aware denoiser, toggled with N. denoiseMs is the cost of the last denoised frame
+bool denoiseEnabled = false;
+int denoiseIterations = DENOISE_ITERATIONS;
+double denoiseMs = 0.0;
+
+// gpu time of every pass, see gpu_profiler.h. profilePasses prints the per-pass table
+// once a second in the viewer and at the end of a batch render
+GpuProfiler gpuProfiler;
+bool profilePasses = false;
+
+// traversal counters in the path tracing shader (RAY_STATS), compiled in for --ray-stats and
+// for the nodes-visited heatmap on key 5. rayStatsClear drops the per pixel counts before
+// the next dispatch, so the heatmap only covers samples that were counted
+bool rayStats = false;
+bool rayStatsClear = false;
+
+struct RayStatTotals
+{
+	uint64_t frames = 0;
+	uint64_t rays = 0; // shadow rays included
+	uint64_t nodes = 0;
+	uint64_t triangleTests = 0;
+	uint64_t sphereTests = 0;
+	uint64_t bounces = 0;
+};
+
+// local size of the path tracing shader. the one --tune-workgroup found fastest on this driver
+// unless --workgroup forces a shape, see workgroup_size.h
+WorkgroupSize workgroupSize;
+bool workgroupForced = false;
 
+// triangles and BVH nodes in the first of their two shader storage blocks, set by setupBuffers
+int trianglesPerBlock = 0;
+int nodesPerBlock = 0;
 
-int run()
+// cpu backend, toggled with C. T prints the per-tile cost of the last pass. sortRays traces
+// each tile as a wavefront with the rays sorted before every bounce, see ray_sorting.h
+CpuScene cpuScene;
+bool cpuBackend = false;
+bool printTileCost = false;
+bool sortRays = false;
+
+
+
+void applySettings(const RenderSettings &settings)
+{
+	SCR_WIDTH = TEXTURE_WIDTH = TARGET_WIDTH = settings.width;
+	SCR_HEIGHT = TEXTURE_HEIGHT = TARGET_HEIGHT = settings.height;
+	renderResolution = RenderResolution(settings.renderScale, settings.movingScale);
+	camera_position = settings.cameraPosition;
+	camera_direction = settings.cameraDirection;
+	maxBounces = settings.maxBounces;
+	cpu_max_bounce_count = settings.maxBounces;
+	minBounces = settings.minBounces;
+	cpu_min_bounce_count = settings.minBounces;
+	nextEventEstimation = cpu_next_event_estimation = settings.nextEventEstimation;
+	lightTreeSampling = cpu_light_tree_sampling = settings.lightTree;
+	orderedOcclusion = cpu_ordered_occlusion = settings.orderedOcclusion;
+	samplerType = cpu_sampler = settings.sampler;
+	profilePasses = settings.profile;
+	rayStats = settings.rayStats;
+	cpuBackend = settings.cpu;
+	sortRays = settings.sortRays;
+	adaptiveSampling = settings.adaptive;
+	convergenceThreshold = settings.convergenceThreshold;
+	denoiseEnabled = settings.denoise;
+	reprojection = settings.reprojection;
+	if (!settings.capturePath.empty()) {
+		capturePath = settings.capturePath;
+		captureFormats = capture_formats(capturePath);
+		recording = true;
+	}
+	aovExtras = settings.aovExtras;
+	displayFormat = settings.halfDisplay ? GL_RGBA16F : GL_RGBA32F;
+	frameBudget = FrameBudget(settings.frameBudgetMs);
+	cameraRecordingPath = settings.recordCameraPath;
+	replayingCamera = !settings.replayCameraPath.empty();
+	replayStep = settings.replayStep;
+	if (replayingCamera) {
+		frameBudget = FrameBudget(0.0);
+	}
+	workgroupForced = settings.workgroupWidth > 0;
+	if (workgroupForced) {
+		workgroupSize = { settings.workgroupWidth, settings.workgroupHeight };
+	}
+}
+
+// creates the window and GL context and loads the GL functions. returns NULL on failure
+GLFWwindow* createWindow(bool visible)
 {
 	// glfw: initialize and configure
 	// ------------------------------
@@ -76,6 +269,7 @@ int run()
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, visible ? GLFW_TRUE : GLFW_FALSE);
 
 #ifdef __APPLE__
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
@@ -88,7 +282,7 @@ int run()
 	{
 		std::cout << "Failed to create GLFW window" << std::endl;
 		glfwTerminate();
-		return -1;
+		return NULL;
 	}
 	glfwMakeContextCurrent(window);
 	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
@@ -99,8 +293,509 @@ int run()
 	if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
 	{
 		std::cout << "Failed to initialize GLAD" << std::endl;
+		glfwTerminate();
+		return NULL;
+	}
+
+	return window;
+}
+
+// the display texture: written by the resolve pass (or uploaded by the cpu backend) and
+// sampled by the screen quad. format is GL_RGBA16F or GL_RGBA32F
+unsigned int createRenderTexture(GLenum format)
+{
+	unsigned int texture;
+
+	glGenTextures(1, &texture);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, TARGET_WIDTH, TARGET_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+
+	glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, format);
+
+	//Set pixel color to the nearest texture value, no blurring
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+	return texture;
+}
+
+// uploads cpuScene's environment map and its CDFs to texture units 1 and 2, or black 1x1
+// stand-ins for the sky gradient so the samplers are always complete
+void createEnvironmentTextures()
+{
+	const EnvironmentMap &env = cpuScene.environment;
+	glm::vec4 black(0.0f);
+	glm::vec2 none(0.0f);
+
+	glGenTextures(1, &environmentTexture);
+	glBindTexture(GL_TEXTURE_2D, environmentTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	if (env.width > 0) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, env.width, env.height, 0, GL_RGBA, GL_FLOAT, env.pixels.data());
+	}
+	else {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 1, 1, 0, GL_RGBA, GL_FLOAT, &black);
+	}
+
+	glGenTextures(1, &environmentCdfTexture);
+	glBindTexture(GL_TEXTURE_2D, environmentCdfTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	if (env.width > 0) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, env.cdfWidth, env.height + 1, 0, GL_RG, GL_FLOAT, env.cdf.data());
+	}
+	else {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, 1, 1, 0, GL_RG, GL_FLOAT, &none);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+bool rayStatsCompiled()
+{
+	return rayStats || displayMode == 5;
+}
+
+// the #define preamble of the path tracing shader: every setting that only changes on a key
+// press or with the scene, so each combination gets a program without branches on them
+string pathTraceDefines()
+{
+	ostringstream defines;
+	if (rayStatsCompiled()) {
+		defines << "#define RAY_STATS\n";
+	}
+	defines << "#define WORKGROUP_WIDTH " << workgroupSize.width << "\n"
+		<< "#define WORKGROUP_HEIGHT " << workgroupSize.height << "\n"
+		<< "#define SAMPLER_TYPE " << samplerType << "\n"
+		<< "#define ADAPTIVE " << (adaptiveSampling ? 1 : 0) << "\n"
+		<< "#define AOV_EXTRAS " << (aovExtras ? 1 : 0) << "\n"
+		<< "#define LIGHT_TREE_SAMPLING " << (lightTreeSampling ? 1 : 0) << "\n"
+		<< "#define ORDERED_OCCLUSION " << (orderedOcclusion ? 1 : 0) << "\n"
+		<< "#define ENVIRONMENT_MAPPED " << (cpuScene.environment.width > 0 ? 1 : 0) << "\n"
+		<< "#define ENVIRONMENT_SAMPLING " << (nextEventEstimation && cpuScene.environment.integral > 0.0f ? 1 : 0) << "\n"
+		<< "#define RENDER_SPHERES " << (cpuScene.spheres.empty() ? "false" : "true") << "\n"
+		<< "#define RENDER_TRIANGLES " << (cpuScene.triangles.empty() ? "false" : "true") << "\n";
+	return defines.str();
+}
+
+// the tuned workgroup shape for this driver, unless one was forced or there is none yet
+void chooseWorkgroupSize()
+{
+	if (!workgroupForced && !loadTunedWorkgroupSize(workgroupSize)) {
+		workgroupSize = WorkgroupSize();
+	}
+	if (!workgroupSupported(workgroupSize)) {
+		cout << "Workgroup " << workgroupSize.name() << " is too large for this device, using 8x8" << endl;
+		workgroupSize = WorkgroupSize();
+	}
+	if (workgroupDiffers(workgroupSize)) {
+		cout << "Workgroup " << workgroupSize.name() << " renders a different image with this driver (see --tune-workgroup), using 8x8" << endl;
+		workgroupSize = WorkgroupSize();
+	}
+}
+
+// builds the variant for the current settings up front, so the first frame is not the one
+// paying for the compile
+void preparePathTraceShader(ComputeShaderVariants &computeShaders)
+{
+	chooseWorkgroupSize();
+	auto start = chrono::steady_clock::now();
+	bool fromCache = computeShaders.get(pathTraceDefines()).fromCache;
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	cout << setw(20) << left << "Compute shader: " << (fromCache ? "cached, " : "compiled, ") << fixed << setprecision(0) << ms << " ms, "
+		<< workgroupSize.name() << " workgroups" << defaultfloat << setprecision(6) << endl;
+}
+
+// enough workgroups to cover the render texture. the shader returns early for the pixels of
+// the partial workgroups past the right and top edges
+void dispatchPathTraceGroups()
+{
+	glDispatchCompute((TEXTURE_WIDTH + workgroupSize.width - 1) / workgroupSize.width, (TEXTURE_HEIGHT + workgroupSize.height - 1) / workgroupSize.height, 1);
+}
+
+// everything the path tracing shader reads from its FrameConstants block
+FrameConstants pathTraceConstants(int frame, float time, int numSpheres, int numTris, int numMaterials, int numNodes)
+{
+	FrameConstants constants = {};
+	constants.cameraPosition = camera_position;
+	constants.cameraDirection = camera_direction;
+	constants.imageDims[0] = TEXTURE_WIDTH;
+	constants.imageDims[1] = TEXTURE_HEIGHT;
+	constants.time = time;
+	constants.frame = frame;
+	constants.numSpheres = numSpheres;
+	constants.numTriangles = numTris;
+	constants.numMaterials = numMaterials;
+	constants.numNodes = numNodes;
+	constants.trianglesPerBlock = trianglesPerBlock;
+	constants.nodesPerBlock = nodesPerBlock;
+	constants.accumulate = accumulate;
+	constants.samplesPerDispatch = samplesPerDispatch;
+	constants.maxBounceCount = maxBounces;
+	constants.minBounceCount = minBounces;
+	constants.numLights = nextEventEstimation ? (int)cpuScene.lights.size() : 0;
+	constants.lightPower = cpuScene.lightPower;
+	constants.environmentIntegral = cpuScene.environment.integral;
+	constants.convergenceThreshold = convergenceThreshold;
+	return constants;
+}
+
+// one path tracing dispatch over the whole render texture. unless timed is false the dispatch
+// alone is timed as GPU_PASS_PATH_TRACE, not building the variant or clearing the ray stats
+void dispatchPathTrace(ComputeShaderVariants &computeShaders, int frame, float time, int numSpheres, int numTris, int numMaterials, int numNodes, bool timed = true)
+{
+	ComputeShader &computeShader = computeShaders.get(pathTraceDefines());
+	if (rayStatsClear) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayStatsSSbo);
+		glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_RGBA32UI, GL_RGBA_INTEGER, GL_UNSIGNED_INT, NULL);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		rayStatsClear = false;
+	}
+	computeShader.use();
+	frameConstants.push(pathTraceConstants(frame, time, numSpheres, numTris, numMaterials, numNodes));
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, environmentTexture);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, environmentCdfTexture);
+	glActiveTexture(GL_TEXTURE0);
+	if (timed) {
+		gpuProfiler.begin(GPU_PASS_PATH_TRACE);
+	}
+	dispatchPathTraceGroups();
+	if (timed) {
+		gpuProfiler.end();
+	}
+	lastView = { camera_position, camera_direction, int(TEXTURE_WIDTH), int(TEXTURE_HEIGHT), true };
+
+	// make sure the accumulation has finished before the resolve and denoise passes read it
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+// one step of the temporal reprojection, see reprojectShader.c: 0 saves the history from
+// historyView before the restarted accumulation's first dispatch, 1 reprojects it into the
+// current view after it
+void dispatchReprojection(ComputeShader &reprojectShader, int step, const RenderedView &historyView)
+{
+	gpuProfiler.begin(GPU_PASS_REPROJECT);
+	reprojectShader.use();
+	reprojectShader.setInt("reprojectStep", step);
+	reprojectShader.setIVec2("imageDims", TEXTURE_WIDTH, TEXTURE_HEIGHT);
+	reprojectShader.setIVec2("historyDims", historyView.width, historyView.height);
+	reprojectShader.setVec4("cameraPosition", camera_position);
+	reprojectShader.setVec4("cameraDirection", camera_direction);
+	reprojectShader.setVec4("historyCameraPosition", historyView.position);
+	reprojectShader.setVec4("historyCameraDirection", historyView.direction);
+	int width = step == 0 ? historyView.width : TEXTURE_WIDTH;
+	int height = step == 0 ? historyView.height : TEXTURE_HEIGHT;
+	glDispatchCompute((width + 7) / 8, (height + 7) / 8, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	gpuProfiler.end();
+}
+
+// drops the reprojected history, the accumulation restarts from nothing
+void clearReprojection()
+{
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, reprojectedSSbo);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_RGBA32F, GL_RGBA, GL_FLOAT, NULL);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// the #define preamble of the resolve pass
+string resolveDefines(GLenum format)
+{
+	return string("#define DISPLAY_FORMAT ") + (format == GL_RGBA16F ? "rgba16f" : "rgba32f") + "\n";
+}
+
+// writes the layer displayMode selects from the accumulation buffers into the display
+// texture bound to image unit 0
+void dispatchResolve(ComputeShader &resolveShader)
+{
+	gpuProfiler.begin(GPU_PASS_RESOLVE);
+	resolveShader.use();
+	resolveShader.setInt("displayMode", displayMode);
+	resolveShader.setIVec2("imageDims", TEXTURE_WIDTH, TEXTURE_HEIGHT);
+	glDispatchCompute((TEXTURE_WIDTH + 7) / 8, (TEXTURE_HEIGHT + 7) / 8, 1);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+	gpuProfiler.end();
+}
+
+// resolves the current layer and reads it back. waits for the gpu
+vector<glm::vec4> readResolvedImage(ComputeShader &resolveShader, unsigned int texture)
+{
+	dispatchResolve(resolveShader);
+	vector<glm::vec4> pixels(TEXTURE_WIDTH * TEXTURE_HEIGHT);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, pixels.data());
+	return pixels;
+}
+
+// one frame of the ray query benchmark instead of path tracing: every pixel adds how many of
+// its segments were blocked to the counter readBlockedCounter returns
+void dispatchRayQueryBenchmark(ComputeShaderVariants &computeShaders, int frame, bool closestHit, int numSpheres, int numTris, int numNodes)
+{
+	ComputeShader &computeShader = computeShaders.get(pathTraceDefines());
+	computeShader.use();
+	FrameConstants constants = pathTraceConstants(frame, 0.0f, numSpheres, numTris, 0, numNodes);
+	constants.rayQueryBenchmark = closestHit ? 1 : 2;
+	frameConstants.push(constants);
+	dispatchPathTraceGroups();
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+// capturePath_00042 for the 42nd recorded frame, without the extension
+string recordedFramePath(int frame)
+{
+	char number[16];
+	snprintf(number, sizeof(number), "_%05d", frame);
+	return capturePath + number;
+}
+
+// screenshot_<date>_<time> in the working directory, without the extension. a second one
+// within the same second gets a counter on top instead of overwriting the first
+string screenshotPath()
+{
+	static string lastPath;
+	static int repeats = 0;
+	char stamp[32];
+	time_t now = time(NULL);
+	strftime(stamp, sizeof(stamp), "screenshot_%Y%m%d_%H%M%S", localtime(&now));
+	string path = stamp;
+	repeats = path == lastPath ? repeats + 1 : 0;
+	lastPath = path;
+	return repeats > 0 ? path + "_" + to_string(repeats + 1) : path;
+}
+
+// the two rgba32f textures the denoiser ping-pongs between
+void createDenoiseTextures(unsigned int textures[2])
+{
+	glGenTextures(2, textures);
+	for (int i = 0; i < 2; i++) {
+		glBindTexture(GL_TEXTURE_2D, textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, TARGET_WIDTH, TARGET_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+	}
+}
+
+// reallocates the per pixel buffers and the display and denoise textures for
+// TARGET_WIDTH x TARGET_HEIGHT. what they held is lost, the caller restarts the accumulation
+void resizeRenderTargets(unsigned int texture, const unsigned int denoiseTextures[2])
+{
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, displayFormat, TARGET_WIDTH, TARGET_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+	glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, displayFormat);
+	for (int i = 0; i < 2; i++) {
+		glBindTexture(GL_TEXTURE_2D, denoiseTextures[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, TARGET_WIDTH, TARGET_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
+	}
+	allocatePixelBuffers();
+}
+
+// what camera movement is timed by: the path's time while replaying one, the wall clock otherwise
+double cameraClock()
+{
+	return replayingCamera ? replayFrame * replayStep : glfwGetTime();
+}
+
+// moves the camera on to the replayed path's next frame and returns whether it moved. closes
+// the window after the path's last frame
+bool replayCamera(GLFWwindow* window)
+{
+	replayFrame++;
+	if (replayFrame >= cameraReplay.frames(replayStep)) {
+		glfwSetWindowShouldClose(window, true);
+		return false;
+	}
+	glm::vec4 position, direction;
+	cameraReplay.sample(replayFrame * replayStep, position, direction);
+	bool moved = position != camera_position || direction != camera_direction;
+	camera_position = position;
+	camera_direction = direction;
+	return moved;
+}
+
+// viewer: follows the window's size, the render scale and the camera movement. returns true
+// if the render size or the render targets changed, which restarts the accumulation
+bool updateRenderSize(unsigned int texture, const unsigned int denoiseTextures[2])
+{
+	if (SCR_WIDTH == 0 || SCR_HEIGHT == 0) {
+		return false; // minimized
+	}
+	bool resized = false;
+	int width, height;
+	renderResolution.size(SCR_WIDTH, SCR_HEIGHT, false, width, height);
+	if (unsigned(width) != TARGET_WIDTH || unsigned(height) != TARGET_HEIGHT) {
+		TARGET_WIDTH = width;
+		TARGET_HEIGHT = height;
+		resizeRenderTargets(texture, denoiseTextures);
+		resized = true;
+	}
+	renderResolution.size(SCR_WIDTH, SCR_HEIGHT, renderResolution.moving(cameraClock()), width, height);
+	if (unsigned(width) != TEXTURE_WIDTH || unsigned(height) != TEXTURE_HEIGHT) {
+		TEXTURE_WIDTH = width;
+		TEXTURE_HEIGHT = height;
+		resized = true;
+	}
+	rayStatsClear = rayStatsClear || resized;
+	return resized;
+}
+
+// filters the accumulated image (pixelStats) guided by the first hit AOVs, one dispatch
+// per A-Trous iteration. returns the texture holding the result
+unsigned int dispatchDenoise(ComputeShader &denoiseShader, const unsigned int textures[2])
+{
+	gpuProfiler.begin(GPU_PASS_DENOISE);
+	denoiseShader.use();
+	int target = 0;
+	for (int iteration = 0; iteration < denoiseIterations; iteration++) {
+		denoiseShader.setInt("stepWidth", 1 << iteration);
+		denoiseShader.setInt("firstIteration", iteration == 0 ? 1 : 0);
+		denoiseShader.setIVec2("imageDims", TEXTURE_WIDTH, TEXTURE_HEIGHT);
+		glBindImageTexture(1, textures[1 - target], 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F); // unused on the first iteration
+		glBindImageTexture(2, textures[target], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+		glDispatchCompute((TEXTURE_WIDTH + 7) / 8, (TEXTURE_HEIGHT + 7) / 8, 1);
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+		target = 1 - target;
+	}
+
+	gpuProfiler.end();
+	return textures[1 - target];
+}
+
+// the AOV buffer of the last dispatch, AOV_ENTRIES per pixel. waits for the gpu
+vector<glm::vec4> readAovs()
+{
+	vector<glm::vec4> aovs(AOV_ENTRIES * TEXTURE_WIDTH * TEXTURE_HEIGHT);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, aovSSbo);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, aovs.size() * sizeof(glm::vec4), aovs.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return aovs;
+}
+
+// rays traced by the compute shader since the last call. waits for the gpu
+uint64_t readRayCounter()
+{
+	GLuint rays = 0, zero = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayCounterSSbo);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &rays);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return rays;
+}
+
+// segments the ray query benchmark found blocked since the last call. waits for the gpu
+uint64_t readBlockedCounter()
+{
+	GLuint blocked = 0, zero = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayCounterSSbo);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), sizeof(GLuint), &blocked);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), sizeof(GLuint), &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return blocked;
+}
+
+// adds the traversal totals of the dispatches since the last call, and the rays they traced
+// (from readRayCounter), to totals. waits for the gpu
+void readRayStats(RayStatTotals &totals, uint64_t rays, int frames)
+{
+	GLuint counts[4], zero[4] = { 0, 0, 0, 0 };
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayStatsSSbo);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counts), counts);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	totals.frames += frames;
+	totals.rays += rays;
+	totals.nodes += counts[0];
+	totals.triangleTests += counts[1];
+	totals.sphereTests += counts[2];
+	totals.bounces += counts[3];
+}
+
+// BVH nodes visited per ray of every pixel, over the samples accumulated so far. waits for the gpu
+vector<glm::vec4> readNodesPerRay()
+{
+	vector<GLuint> counts(4 * TEXTURE_WIDTH * TEXTURE_HEIGHT);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayStatsSSbo);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 4 * sizeof(GLuint), counts.size() * sizeof(GLuint), counts.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	vector<glm::vec4> nodesPerRay(TEXTURE_WIDTH * TEXTURE_HEIGHT);
+	for (size_t i = 0; i < nodesPerRay.size(); i++) {
+		nodesPerRay[i] = glm::vec4(float(counts[4 * i]) / float(max(counts[4 * i + 3], GLuint(1))));
+	}
+	return nodesPerRay;
+}
+
+void printRayStats(const RayStatTotals &totals)
+{
+	double rays = double(max(totals.rays, uint64_t(1)));
+	cout << setw(20) << left << "Rays/frame: " << fixed << setprecision(0) << double(totals.rays) / max(totals.frames, uint64_t(1)) << endl;
+	cout << setw(20) << left << "Bounces/frame: " << double(totals.bounces) / max(totals.frames, uint64_t(1)) << endl;
+	cout << setprecision(2);
+	cout << setw(20) << left << "Node visits/ray: " << totals.nodes / rays << endl;
+	cout << setw(20) << left << "Triangle tests/ray: " << totals.triangleTests / rays << endl;
+	cout << setw(20) << left << "Sphere tests/ray: " << totals.sphereTests / rays << endl;
+	cout << defaultfloat << setprecision(6);
+}
+
+// gives every tile one sample per pixel and clears the error counters, used when accumulation restarts
+void resetAdaptiveTiles()
+{
+	vector<AdaptiveTile> tiles(adaptive_tile_count(TEXTURE_WIDTH, TEXTURE_HEIGHT));
+	for (AdaptiveTile &t : tiles) {
+		t = { 0, 0, 1, 0 };
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileSSbo);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, tiles.size() * sizeof(AdaptiveTile), tiles.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// reads the tile errors gathered over the last `frames` dispatches and hands out the next
+// frame's samples, one sample per pixel per frame on average. waits for the gpu
+AdaptiveStatus updateAdaptiveTiles(int frames)
+{
+	vector<AdaptiveTile> tiles(adaptive_tile_count(TEXTURE_WIDTH, TEXTURE_HEIGHT));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileSSbo);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, tiles.size() * sizeof(AdaptiveTile), tiles.data());
+
+	AdaptiveStatus status = allocate_tile_samples(tiles, double(TEXTURE_WIDTH) * TEXTURE_HEIGHT, frames);
+
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, tiles.size() * sizeof(AdaptiveTile), tiles.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return status;
+}
+
+int run(const RenderSettings &settings)
+{
+	applySettings(settings);
+	if (replayingCamera) {
+		if (!cameraReplay.load(settings.replayCameraPath)) {
+			return EXIT_FAILURE;
+		}
+		cameraReplay.sample(0.0, camera_position, camera_direction);
+	}
+	if (!loadScene(settings)) {
+		return EXIT_FAILURE;
+	}
+
+	GLFWwindow* window = createWindow(true);
+	if (window == NULL) {
 		return -1;
 	}
+	// the framebuffer can be larger than the window on high dpi displays
+	int framebufferWidth, framebufferHeight;
+	glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+	SCR_WIDTH = framebufferWidth;
+	SCR_HEIGHT = framebufferHeight;
+	int renderWidth, renderHeight;
+	renderResolution.size(SCR_WIDTH, SCR_HEIGHT, false, renderWidth, renderHeight);
+	TEXTURE_WIDTH = TARGET_WIDTH = renderWidth;
+	TEXTURE_HEIGHT = TARGET_HEIGHT = renderHeight;
 
 	// query limitations
 	// -----------------
@@ -117,98 +812,246 @@ int run()
 	// build and compile shaders
 	// -------------------------
 	Shader screenQuad("screenQuadVert.c", "screenQuadFrag.c");
-	ComputeShader computeShader("computeShader.c");
+	ComputeShaderVariants computeShaders("computeShader.c");
+	ComputeShader denoiseShader("denoiseShader.c");
+	ComputeShader resolveShader("resolveShader.c", resolveDefines(displayFormat));
+	ComputeShader reprojectShader("reprojectShader.c");
 
 	screenQuad.use();
 	screenQuad.setInt("tex", 0);
 
 	// Create texture for opengl operation
 	// -----------------------------------
-	unsigned int texture;
-
-	glGenTextures(1, &texture);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, texture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, TEXTURE_WIDTH, TEXTURE_HEIGHT, 0, GL_RGBA, GL_FLOAT, NULL);
-
-	glBindImageTexture(0, texture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
-
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, texture);
-
-
-	//Set pixel color to the nearest texture value, no blurring
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	unsigned int texture = createRenderTexture(displayFormat);
+	unsigned int denoiseTextures[2];
+	createDenoiseTextures(denoiseTextures);
 
 	int numTris, numSpheres, numMaterials, numNodes;
-	setupBuffers(numTris, numSpheres, numMaterials, numNodes); // initialize buffer data and send to shaders
+	if (!setupBuffers(numTris, numSpheres, numMaterials, numNodes)) { // initialize buffer data and send to shaders
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
+	preparePathTraceShader(computeShaders);
+	gpuProfiler.init();
+	if (!settings.profileCsv.empty() && !gpuProfiler.openCsv(settings.profileCsv)) {
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
+	frameCapture.init();
 
 	//I have no idea what I am doing
 	glfwSetKeyCallback(window, handleMovementInput);
 	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 	glfwSetCursorPosCallback(window, cursorPosCallback);
 
+	TileScheduler scheduler(TEXTURE_WIDTH, TEXTURE_HEIGHT, 32, settings.threads);
+	CpuFrame cpuFrame;
+	cpuFrame.reset(TEXTURE_WIDTH, TEXTURE_HEIGHT);
+	vector<glm::vec4> cpuDenoised;
+
 	// render loop
 	// -----------
+	RayStatTotals rayStatTotals; // since the last status message
 	int frameCount = 0;
+	int adaptiveDispatches = 0;   // since the tiles' samples were last handed out
+	uint64_t messageSamples = 0;  // per pixel, since the last status message
 	float lastMessage = (float)glfwGetTime();
+	double recordingStart = glfwGetTime();
+	vector<double> replayFrameMs;
 	while (!glfwWindowShouldClose(window))
 	{
-		updateCameraBuffer();
+		gpuProfiler.collect();
+		if (denoiseEnabled && !cpuBackend) {
+			denoiseMs = gpuProfiler.lastMs(GPU_PASS_DENOISE);
+		}
+
+		if (!replayingCamera) {
+			updateCamera();
+		}
+		if (updateRenderSize(texture, denoiseTextures)) {
+			scheduler.resize(TEXTURE_WIDTH, TEXTURE_HEIGHT);
+			accumulate = 0;
+			frameCount = 0;
+		}
 
 		frameCount++;
 		// Set frame time
 		float currentTime = (float)glfwGetTime();
 		deltaTime = currentTime - lastFrameTime;
 		lastFrameTime = currentTime;
+		if (!cameraRecordingPath.empty()) {
+			cameraRecording.add(currentTime - recordingStart, camera_position, camera_direction);
+		}
+		if (replayingCamera && replayFrame > 0) {
+			replayFrameMs.push_back(1000.0 * deltaTime);
+		}
+		if (frameCount > 1) {
+			frameBudget.update(1000.0 * deltaTime); // the first frame after a camera move stays at one sample
+		}
 		if (frameMessage && (currentTime - lastMessage > 1)) {
+			std::cout << "\r" << setw(20) << left << "FPS: " << setw(10) << 1 / deltaTime << "  # Writes : " << frameCount << "   ";
+			if (!cpuBackend) {
+				std::cout << "Path trace: " << fixed << setprecision(2) << gpuProfiler.stats(GPU_PASS_PATH_TRACE).meanMs << " ms   "
+					<< setprecision(1) << messageSamples / (currentTime - lastMessage) << " spp/s (" << frameBudget.samplesPerFrame() << " per frame)   " << defaultfloat << setprecision(6);
+			}
 			lastMessage = currentTime;
-			std::cout << "\r" << setw(20) << left << "FPS: " << setw(10) << 1 / deltaTime << "  # Writes : " << frameCount << "   " << std::flush;
+			messageSamples = 0;
+			if (denoiseEnabled) {
+				std::cout << "Denoise: " << fixed << setprecision(2) << denoiseMs << " ms   " << defaultfloat << setprecision(6);
+			}
+			std::cout << std::flush;
+			if (profilePasses) {
+				std::cout << std::endl;
+				gpuProfiler.print();
+			}
+			if (rayStatTotals.frames > 0) {
+				std::cout << std::endl;
+				printRayStats(rayStatTotals);
+				rayStatTotals = RayStatTotals();
+			}
 		}
 
-		computeShader.use(); 
-		computeShader.setFloat("t", currentTime);
-		computeShader.setInt("frame", frameCount);
-		computeShader.setInt("numSpheres", numSpheres);
-		computeShader.setInt("numTriangles", numTris);
-		computeShader.setInt("numMaterials", numMaterials);
-		computeShader.setInt("numNodes", numNodes);
-		computeShader.setInt("accumulate", accumulate);
-		computeShader.setInt("displayMode", displayMode);
-		glDispatchCompute((unsigned int)TEXTURE_WIDTH / 10, (unsigned int)TEXTURE_HEIGHT / 10, 1);
-
-		// make sure writing to image has finished before read
-		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		bool denoise = denoiseEnabled && displayMode == 1;
+		unsigned int displayTexture = texture;
+		if (cpuBackend) {
+			if (frameCount == 1) {
+				scheduler.reset();
+				cpuFrame.reset(TEXTURE_WIDTH, TEXTURE_HEIGHT);
+			}
+			renderCpuPass(scheduler, cpuFrame);
+			vector<glm::vec4> *upload = &cpuFrame.pixels;
+			if (denoise) {
+				auto denoiseStart = chrono::steady_clock::now();
+				cpu_denoise(cpuFrame.stats, cpuFrame.aovs, TEXTURE_WIDTH, TEXTURE_HEIGHT, denoiseIterations, cpuDenoised);
+				denoiseMs = chrono::duration<double, milli>(chrono::steady_clock::now() - denoiseStart).count();
+				upload = &cpuDenoised;
+			}
+			gpuProfiler.begin(GPU_PASS_UPLOAD);
+			glBindTexture(GL_TEXTURE_2D, texture);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, TEXTURE_WIDTH, TEXTURE_HEIGHT, GL_RGBA, GL_FLOAT, upload->data());
+			gpuProfiler.end();
+			if (printTileCost) {
+				scheduler.printTileHeatmap();
+				printTileCost = false;
+			}
+		}
+		else {
+			if (adaptiveSampling && frameCount == 1) {
+				resetAdaptiveTiles();
+				adaptiveDispatches = 0;
+			}
+			// the accumulation restarts: keep what the last view showed to reproject it below
+			RenderedView historyView = lastView;
+			bool reprojecting = frameCount == 1 && reprojection && historyView.valid;
+			if (reprojecting) {
+				dispatchReprojection(reprojectShader, 0, historyView);
+			}
+			else if (frameCount == 1) {
+				clearReprojection();
+			}
+			// the frame's samples in dispatches of at most FRAME_BUDGET_SAMPLES_PER_DISPATCH.
+			// adaptive sampling hands out one sample per pixel per dispatch on average itself
+			int frameSamples = frameBudget.samplesPerFrame();
+			for (int done = 0; done < frameSamples; done += samplesPerDispatch) {
+				samplesPerDispatch = adaptiveSampling ? 1 : min(frameSamples - done, FRAME_BUDGET_SAMPLES_PER_DISPATCH);
+				dispatchPathTrace(computeShaders, frameCount, currentTime, numSpheres, numTris, numMaterials, numNodes);
+				accumulate = 1; // the rest of the frame's samples add to the first
+				adaptiveDispatches++;
+				if (rayStatsCompiled()) {
+					// every dispatch, the 32 bit totals would overflow within a second
+					readRayStats(rayStatTotals, readRayCounter(), 1);
+				}
+			}
+			if (reprojecting) {
+				dispatchReprojection(reprojectShader, 1, historyView);
+			}
+			messageSamples += frameSamples;
+			if (adaptiveSampling && adaptiveDispatches >= adaptiveInterval) {
+				gpuProfiler.begin(GPU_PASS_ADAPTIVE);
+				updateAdaptiveTiles(adaptiveDispatches);
+				gpuProfiler.end();
+				adaptiveDispatches = 0;
+			}
+			if (denoise) {
+				displayTexture = dispatchDenoise(denoiseShader, denoiseTextures);
+			}
+			else {
+				dispatchResolve(resolveShader);
+			}
+		}
 
 		// render image to quad
+		gpuProfiler.begin(GPU_PASS_BLIT);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		screenQuad.use();
+		screenQuad.setIVec2("imageDims", TEXTURE_WIDTH, TEXTURE_HEIGHT);
+		glBindTexture(GL_TEXTURE_2D, displayTexture);
 
 		renderQuad();
+		gpuProfiler.end();
+
+		// the displayed image for a screenshot or the recording. only the copy into a pixel
+		// buffer is queued here, frameCapture writes it out once the gpu is done
+		if (screenshotRequested || recording) {
+			gpuProfiler.begin(GPU_PASS_CAPTURE);
+			if (screenshotRequested) {
+				string path = screenshotPath();
+				frameCapture.capture(displayTexture, TEXTURE_WIDTH, TEXTURE_HEIGHT, path, CAPTURE_PFM | CAPTURE_PNG);
+				cout << endl << "Screenshot: " << path << ".pfm, " << path << ".png" << endl;
+				screenshotRequested = false;
+			}
+			if (recording) {
+				frameCapture.capture(displayTexture, TEXTURE_WIDTH, TEXTURE_HEIGHT, recordedFramePath(recordedFrames++), captureFormats);
+			}
+			gpuProfiler.end();
+		}
+		frameCapture.poll();
 
 		// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
 		// -------------------------------------------------------------------------------
 		glfwSwapBuffers(window);
 		glfwPollEvents();
+		frameConstants.endFrame();
 
+		bool cameraMoved = mF || mR || mB || mL || mU || mD || mC;
+		if (replayingCamera) {
+			cameraMoved = replayCamera(window);
+		}
 		accumulate = userDefinedAccumulate;
-		if (mF || mR || mB || mL || mU || mD || mC) {
+		if (cameraMoved) {
 			accumulate = 0;
 			frameCount = 0;
+			frameBudget.reset();
+			renderResolution.cameraMoved(cameraClock());
 		}
 		mC = false;
 	}
 
 	// optional: de-allocate all resources once they've outlived their purpose:
 	// ------------------------------------------------------------------------
+	frameCapture.release();
+	if (replayingCamera) {
+		cout << endl << "Replayed " << settings.replayCameraPath << endl;
+		print_frame_time_stats(frame_time_stats(replayFrameMs));
+	}
+	if (!cameraRecordingPath.empty() && cameraRecording.save(cameraRecordingPath)) {
+		cout << endl << "Saved the camera path to " << cameraRecordingPath << " (" << cameraRecording.duration() << " s, "
+			<< cameraRecording.keys.size() << " keys)" << endl;
+	}
 	glDeleteTextures(1, &texture);
+	glDeleteTextures(2, denoiseTextures);
+	gpuProfiler.collect(true);
+	if (profilePasses) {
+		std::cout << std::endl;
+		gpuProfiler.print();
+	}
+	gpuProfiler.release();
+	frameConstants.release();
 	glDeleteProgram(screenQuad.ID);
-	glDeleteProgram(computeShader.ID);
+	computeShaders.deletePrograms();
+	glDeleteProgram(denoiseShader.ID);
+	glDeleteProgram(resolveShader.ID);
+	glDeleteProgram(reprojectShader.ID);
 
 	glfwTerminate();
 
@@ -253,16 +1096,77 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 	// make sure the viewport matches the new window dimensions; note that width and 
 	// height will be significantly larger than specified on retina displays.
 	glViewport(0, 0, width, height);
+	// the render loop reallocates the render targets for the new size
+	SCR_WIDTH = width;
+	SCR_HEIGHT = height;
 }
 
 void handleMovementInput(GLFWwindow* window, int key, int scancode, int action, int mods) {
 
-	int prevDisplayMode = displayMode;
+	// every pass writes all AOVs, so switching layers keeps the accumulated samples
 	if (key == GLFW_KEY_1) displayMode = 1;
 	if (key == GLFW_KEY_2) displayMode = 2;
 	if (key == GLFW_KEY_3) displayMode = 3;
 	if (key == GLFW_KEY_4) displayMode = 4;
-	if (prevDisplayMode != displayMode) mC = true;
+	if (key == GLFW_KEY_5 && action == GLFW_PRESS && displayMode != 5) {
+		displayMode = 5;
+		rayStatsClear = !rayStats; // counted all along otherwise
+	}
+
+	if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+		cpuBackend = !cpuBackend;
+		mC = true;
+		cout << endl << (cpuBackend ? "Switched to CPU backend" : "Switched to GPU backend") << endl;
+	}
+	if (key == GLFW_KEY_T && action == GLFW_PRESS) printTileCost = true;
+
+	if (key == GLFW_KEY_N && action == GLFW_PRESS) {
+		denoiseEnabled = !denoiseEnabled;
+		cout << endl << (denoiseEnabled ? "Denoiser on" : "Denoiser off") << endl;
+	}
+
+	if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+		nextEventEstimation = cpu_next_event_estimation = !nextEventEstimation;
+		mC = true;
+		cout << endl << (nextEventEstimation ? "Next-event estimation on" : "Next-event estimation off") << endl;
+	}
+
+	if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+		samplerType = cpu_sampler = (samplerType + 1) % 3;
+		mC = true;
+		cout << endl << "Sampler: " << sampler_name(samplerType) << endl;
+	}
+
+	if ((key == GLFW_KEY_LEFT_BRACKET || key == GLFW_KEY_RIGHT_BRACKET) && action == GLFW_PRESS) {
+		renderResolution.step(key == GLFW_KEY_LEFT_BRACKET ? -1 : 1);
+		cout << endl << "Render scale: " << renderResolution.scale << endl;
+	}
+
+	if (key == GLFW_KEY_H && action == GLFW_PRESS) {
+		reprojection = !reprojection;
+		mC = true;
+		cout << endl << (reprojection ? "Reprojection on" : "Reprojection off") << endl;
+	}
+
+	if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+		screenshotRequested = true;
+	}
+
+	if (key == GLFW_KEY_K && action == GLFW_PRESS) {
+		recording = !recording;
+		if (recording) {
+			cout << endl << "Recording to " << recordedFramePath(recordedFrames) << (captureFormats == CAPTURE_PNG ? ".png" : ".pfm") << " and on" << endl;
+		}
+		else {
+			cout << endl << "Recording stopped after " << recordedFrames << " frames" << endl;
+		}
+	}
+
+	if (key == GLFW_KEY_V && action == GLFW_PRESS) {
+		adaptiveSampling = !adaptiveSampling;
+		mC = true;
+		cout << endl << (adaptiveSampling ? "Adaptive sampling on" : "Adaptive sampling off") << endl;
+	}
 
 
 	if (key == GLFW_KEY_W) {
@@ -298,7 +1202,8 @@ void handleMovementInput(GLFWwindow* window, int key, int scancode, int action,
 	if (key == GLFW_KEY_ESCAPE) glfwSetWindowShouldClose(window, true);
 }
 
-void updateCameraBuffer() {
+// moves the camera by the held movement keys, the next dispatch's constants pick it up
+void updateCamera() {
 	glm::vec4 forward = glm::normalize(camera_direction - glm::vec4(0.0, 0.0, camera_direction.z, 0.0));
 	glm::vec3 up3 = glm::vec3(0.0, 0.0, 1.0);
 	glm::vec4 up = glm::vec4(0.0, 0.0, 1.0, 0.0);
@@ -317,19 +1222,12 @@ void updateCameraBuffer() {
 	if (mU)	camera_position += up * moveSpeed * deltaTime;
 
 	if (mD)	camera_position -= up * moveSpeed * deltaTime;
-
-
-	glm::vec4 camera_buf_data[3] = { camera_position, camera_direction, glm::vec4(0.0) };
-
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cameraSSbo);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, 3 * sizeof(glm::vec4), camera_buf_data, GL_STATIC_DRAW); //sizeof(data) only works for statically sized C/C++ arrays.
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, cameraSSbo);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0); // unbind
 }
 
 
 //this may be scuffed
 static void cursorPosCallback(GLFWwindow* window, double xpos, double ypos) {
+	if (replayingCamera) return; // the path steers
 	mC = true;
 
 	double rotationAroundZ = glm::radians(pxpos - xpos) * rotSpeed;// *deltaTime;
@@ -364,53 +1262,52 @@ static void cursorPosCallback(GLFWwindow* window, double xpos, double ypos) {
 }
 
 
-void setupBuffers(int &numTris, int &numSpheres, int &numMaterials, int &numNodes) {
+// renders one progressive pass of the cpu backend into cpuFrame. sampleLimit > 0 caps the
+// samples per pixel of the pass. returns the number of rays traced
+uint64_t renderCpuPass(TileScheduler &scheduler, CpuFrame &cpuFrame, int sampleLimit) {
+	CpuCamera cam = cpu_make_camera(camera_position, camera_direction, TEXTURE_WIDTH, TEXTURE_HEIGHT);
+	int mode = displayMode;
+	std::atomic<uint64_t> rays(0);
 
-	
+	scheduler.runPass([&](const Tile &tile, int spp, int firstSample) {
+		if (sortRays) {
+			WavefrontStats stats;
+			cpu_render_tile_wavefront(cpuScene, cam, tile, TEXTURE_WIDTH, TEXTURE_HEIGHT, spp, firstSample, true, cpuFrame, mode, stats);
+			rays += stats.rays;
+			return;
+		}
 
-	cout << "Setting up buffers" << endl;
-	vector<Triangle> trivect;
-	vector<Material> matvect;
-	//load_vertex_data("scene_data/driftobj.txt", "scene_data/driftmtl.txt", trivect, matvect);
-	load_vertex_data("scene_data/freeobj.txt", "scene_data/freemtl.txt", trivect, matvect);
-	//load_vertex_data("scene_data/p2obj.txt", "scene_data/p2mtl.txt", trivect, matvect);
-	//load_vertex_data("scene_data/Racerobj.txt", "scene_data/Racermtl.txt", trivect, matvect);
+		uint64_t tileRays = 0;
+		for (int y = tile.y0; y < tile.y1; y++) {
+			for (int x = tile.x0; x < tile.x1; x++) {
+				for (int s = 0; s < spp; s++) {
+					PixelAovs aovs;
+					glm::vec3 pixel = cpu_render_sample(cpuScene, cam, x, y, TEXTURE_WIDTH, TEXTURE_HEIGHT, firstSample + s, tileRays, aovs);
+					cpu_accumulate_sample(cpuFrame, y * TEXTURE_WIDTH + x, pixel, aovs, mode);
+				}
+			}
+		}
+		rays += tileRays;
+	}, sampleLimit);
 
-	numTris = trivect.size();
+	return rays;
+}
 
-	cout << setw(20) << left << "# of polygons: " << numTris << endl;
+// loads the scene geometry, builds its BVH and adds the built-in materials and spheres.
+// the result lives in cpuScene, which setupBuffers uploads for the gpu
+bool loadScene(const RenderSettings &settings) {
 
-	glGenBuffers(1, &triangleSSbo);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, triangleSSbo);
-	GLint bufMask = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT; // the invalidate makes a big difference when re-writing
-	glBufferData(GL_SHADER_STORAGE_BUFFER, numTris * sizeof(struct Triangle), NULL, GL_STATIC_DRAW);
-
-	Triangle* tris = (Triangle*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, numTris * sizeof(Triangle), bufMask);
+	cout << "Loading scene" << endl;
+	vector<Triangle> trivect;
+	vector<Material> matvect;
+	load_vertex_data(settings.objPath, settings.mtlPath, trivect, matvect);
 
-	for (int triind = 0; triind < numTris; triind++) {
-		tris[triind] = trivect[triind];
+	if (trivect.empty()) {
+		cout << "Scene has no triangles: " << settings.objPath << endl;
+		return false;
 	}
 
-	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-
-
-
 	vector<BVH> heirarchy = buildSAHTree(trivect);
-	numNodes = heirarchy.size();
-
-	glGenBuffers(1, &bvhSSbo);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvhSSbo);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, numNodes * sizeof(struct BVH), NULL, GL_STATIC_DRAW);
-
-	BVH* heir = (BVH*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, numNodes * sizeof(BVH), bufMask);
-
-	for (int bvhind = 0; bvhind < numNodes; bvhind++) {
-		heir[bvhind] = heirarchy[bvhind];
-	}
-
-	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-
-
 
 	Material light;
 	light.color = glm::vec4(0.0, 0.0, 0.0, 1.0);
@@ -443,8 +1340,7 @@ void setupBuffers(int &numTris, int &numSpheres, int &numMaterials, int &numNode
 	metal.specularColor = glm::vec4(1.0, 1.0, 1.0, 1.0);
 	metal.data = glm::vec4(0.0, 0.9, 0.91, 0.0);
 
-	numMaterials = matvect.size();
-	cout << setw(20) << left << "# of materials: " << matvect.size() << endl;
+	int numMaterials = matvect.size();
 
 	matvect.push_back(light);
 	matvect.push_back(spec);
@@ -452,27 +1348,6 @@ void setupBuffers(int &numTris, int &numSpheres, int &numMaterials, int &numNode
 	matvect.push_back(ground);
 	matvect.push_back(metal);
 
-	glGenBuffers(1, &materialSSbo);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialSSbo);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, matvect.size() * sizeof(Material), NULL, GL_STATIC_DRAW);
-	Material* materials = (struct Material*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, matvect.size() * sizeof(Material), bufMask);
-
-	for (int matind = 0; matind < matvect.size(); matind++) {
-		materials[matind] = matvect[matind];
-	}
-
-	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-
-
-
-	numSpheres = 1;
-	cout << setw(20) << left << "# of spheres: " << numSpheres << endl;
-
-	glGenBuffers(1, &sphereSSbo);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereSSbo);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, numSpheres * sizeof(struct Sphere), NULL, GL_STATIC_DRAW);
-	Sphere* spheres = (Sphere*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, numSpheres * sizeof(Sphere), bufMask);
-
 	Sphere l;
 	l.data = glm::vec4(100.0, -15.0, 93.0, 100.0);
 	l.materialData = glm::vec4(numMaterials + 0.0, 0.0, 0.0, 0.0);
@@ -498,35 +1373,260 @@ void setupBuffers(int &numTris, int &numSpheres, int &numMaterials, int &numNode
 	s3.data = glm::vec4(-0.5, 3.0, 1.0, 0.8);
 	s3.materialData = glm::vec4(numMaterials + 4.0, 0.0, 0.0, 0.0);
 
-	spheres[0] = s3;
-	/*spheres[1] = g;
-	spheres[2] = s1;
-	spheres[3] = s2;
-	spheres[4] = l;*/
+	vector<Sphere> spherevect;
+	spherevect.push_back(s3);
+	/*spherevect.push_back(g);
+	spherevect.push_back(s1);
+	spherevect.push_back(s2);
+	spherevect.push_back(l);*/
+
+	// object ids for the AOVs: the loader numbers the obj's objects, each sphere gets its own after them
+	int numObjects = 0;
+	for (const Triangle &tri : trivect) {
+		numObjects = max(numObjects, int(tri.materialData.y) + 1);
+	}
+	for (size_t sphereind = 0; sphereind < spherevect.size(); sphereind++) {
+		spherevect[sphereind].materialData.y = float(numObjects + sphereind);
+	}
+
+	cpuScene.triangles = trivect;
+	cpuScene.heirarchy = heirarchy;
+	cpuScene.occlusionLinks = build_occlusion_links(heirarchy, trivect);
+	cpuScene.materials = matvect;
+	cpuScene.spheres = spherevect;
+	cpuScene.lights = build_light_table(cpuScene.triangles, cpuScene.spheres, matvect, cpuScene.lightPower);
+	cpuScene.lightTree = build_light_tree(cpuScene.lights, cpuScene.triangles, cpuScene.spheres, matvect);
+
+	cout << setw(20) << left << "# of polygons: " << trivect.size() << endl;
+	cout << setw(20) << left << "# of materials: " << numMaterials << endl;
+	cout << setw(20) << left << "# of spheres: " << spherevect.size() << endl;
+	cout << setw(20) << left << "# of lights: " << cpuScene.lights.size() << endl;
+
+	cpuScene.environment = EnvironmentMap();
+	if (!settings.environmentPath.empty()) {
+		if (!load_environment_map(settings.environmentPath, settings.environmentIntensity, cpuScene.environment)) {
+			return false;
+		}
+		cout << setw(20) << left << "Environment: " << settings.environmentPath << " (" << cpuScene.environment.width << "x" << cpuScene.environment.height << ")" << endl;
+	}
+
+	// built on first use otherwise, which would land in the first frame's timing
+	blue_noise_tile();
+	cout << setw(20) << left << "Sampler: " << sampler_name(settings.sampler) << endl;
+
+	return true;
+}
+
+// uploads items split over two shader storage buffers: as many as fit in one block of
+// maxBlockSize bytes into first and the rest into overflow. both get storage even when
+// empty so their bindings stay valid. returns how many items first holds, -1 if they do
+// not fit in two blocks
+template<typename T>
+int uploadSplitBuffer(const vector<T> &items, GLuint &first, GLuint &overflow, GLint64 maxBlockSize)
+{
+	size_t perBlock = size_t(maxBlockSize) / sizeof(T);
+	if (items.size() > 2 * perBlock) {
+		return -1;
+	}
+	size_t firstCount = min(items.size(), perBlock);
+	size_t counts[2] = { firstCount, items.size() - firstCount };
+	GLuint* buffers[2] = { &first, &overflow };
+
+	for (int i = 0; i < 2; i++) {
+		glGenBuffers(1, buffers[i]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, *buffers[i]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, max(counts[i], size_t(1)) * sizeof(T), NULL, GL_STATIC_DRAW);
+		if (counts[i] > 0) {
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, counts[i] * sizeof(T), items.data() + (i == 0 ? 0 : firstCount));
+		}
+	}
+	return int(firstCount);
+}
+
+// (re)allocates the buffers with an entry per pixel for TARGET_WIDTH x TARGET_HEIGHT and
+// binds them: the accumulation (PixelStats in computeShader.c: a double sum, the mean and the
+// variance, 64 bytes), the adaptive sampling tiles, the first hit AOVs for display, the
+// denoiser and batch output, the traversal totals followed by the per pixel counts that
+// only RAY_STATS variants write, and the reprojection history and its reprojected colors
+void allocatePixelBuffers()
+{
+	GLsizeiptr pixels = GLsizeiptr(TARGET_WIDTH) * TARGET_HEIGHT;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, pixelStatsSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, pixels * 4 * sizeof(glm::vec4), NULL, GL_DYNAMIC_COPY);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, adaptive_tile_count(TARGET_WIDTH, TARGET_HEIGHT) * sizeof(AdaptiveTile), NULL, GL_DYNAMIC_DRAW);
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, aovSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, pixels * AOV_ENTRIES * sizeof(glm::vec4), NULL, GL_DYNAMIC_COPY);
+
+	vector<GLuint> rayStatsZero(4 * (1 + pixels), 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayStatsSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, rayStatsZero.size() * sizeof(GLuint), rayStatsZero.data(), GL_DYNAMIC_COPY);
+
+	// HISTORY_ENTRIES and one entry per pixel in reprojectShader.c. nothing reprojected yet
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, historySSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, pixels * 2 * sizeof(glm::vec4), NULL, GL_DYNAMIC_COPY);
+	vector<glm::vec4> reprojectedZero(pixels, glm::vec4(0.0));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, reprojectedSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, reprojectedZero.size() * sizeof(glm::vec4), reprojectedZero.data(), GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	lastView.valid = false;
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, pixelStatsSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, tileSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, aovSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 19, rayStatsSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 20, historySSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 21, reprojectedSSbo);
+}
+
+// returns false (after printing why) if the scene does not fit in the device's shader storage blocks
+bool setupBuffers(int &numTris, int &numSpheres, int &numMaterials, int &numNodes) {
+
+	cout << "Setting up buffers" << endl;
+	vector<Triangle> &trivect = cpuScene.triangles;
+	vector<BVH> &heirarchy = cpuScene.heirarchy;
+	vector<Material> &matvect = cpuScene.materials;
+	vector<Sphere> &spherevect = cpuScene.spheres;
+
+	GLint64 maxBlockSize = 0;
+	glGetInteger64v(GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlockSize);
+	auto tooLarge = [&](const char* what, size_t count, size_t size) {
+		cout << "Scene too large: " << count << " " << what << " of " << size << " bytes, the device allows "
+			<< maxBlockSize / (1024 * 1024) << " MB per shader storage block" << endl;
+		return false;
+	};
+
+	numTris = trivect.size();
+	trianglesPerBlock = uploadSplitBuffer(trivect, triangleSSbo, triangleOverflowSSbo, maxBlockSize);
+	if (trianglesPerBlock < 0) {
+		return tooLarge("triangles", trivect.size(), sizeof(Triangle));
+	}
+
+	numNodes = heirarchy.size();
+	nodesPerBlock = uploadSplitBuffer(heirarchy, bvhSSbo, bvhOverflowSSbo, maxBlockSize);
+	if (nodesPerBlock < 0) {
+		return tooLarge("BVH nodes", heirarchy.size(), sizeof(BVH));
+	}
+
+	if (trianglesPerBlock < numTris || nodesPerBlock < numNodes) {
+		cout << "Geometry split over two storage blocks of " << maxBlockSize / (1024 * 1024) << " MB" << endl;
+	}
+
+	if (spherevect.size() * sizeof(Sphere) > size_t(maxBlockSize)) {
+		return tooLarge("spheres", spherevect.size(), sizeof(Sphere));
+	}
+	if (matvect.size() * sizeof(Material) > size_t(maxBlockSize)) {
+		return tooLarge("materials", matvect.size(), sizeof(Material));
+	}
+
+	GLint bufMask = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT; // the invalidate makes a big difference when re-writing
+
+
+
+	numMaterials = matvect.size();
+
+	glGenBuffers(1, &materialSSbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, matvect.size() * sizeof(Material), NULL, GL_STATIC_DRAW);
+	Material* materials = (struct Material*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, matvect.size() * sizeof(Material), bufMask);
+
+	for (int matind = 0; matind < matvect.size(); matind++) {
+		materials[matind] = matvect[matind];
+	}
 
 	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
 
 
 
+	numSpheres = spherevect.size();
 
-	glGenBuffers(1, &cameraSSbo);
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cameraSSbo);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, 3 * sizeof(glm::vec4), NULL, GL_STATIC_DRAW);
-	glm::vec4* camera_buffer_data = (glm::vec4*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, 3 * sizeof(glm::vec4), bufMask);
+	glGenBuffers(1, &sphereSSbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, numSpheres * sizeof(struct Sphere), NULL, GL_STATIC_DRAW);
+	Sphere* spheres = (Sphere*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, numSpheres * sizeof(Sphere), bufMask);
 
-	camera_buffer_data[0] = camera_position;
-	camera_buffer_data[1] = camera_direction;
-	camera_buffer_data[2] = glm::vec4(0.0); // TODO replace with data such as fov
+	for (int sphereind = 0; sphereind < numSpheres; sphereind++) {
+		spheres[sphereind] = spherevect[sphereind];
+	}
 
 	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
 
 
 
+	GLuint counters[2] = { 0, 0 }; // rays, blocked benchmark segments
+	glGenBuffers(1, &rayCounterSSbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, rayCounterSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(counters), counters, GL_DYNAMIC_READ);
+
+
+
+	// per pixel accumulation, adaptive sampling tiles, AOVs and reprojection, sized by allocatePixelBuffers
+	glGenBuffers(1, &pixelStatsSSbo);
+	glGenBuffers(1, &tileSSbo);
+	glGenBuffers(1, &aovSSbo);
+	glGenBuffers(1, &rayStatsSSbo);
+	glGenBuffers(1, &historySSbo);
+	glGenBuffers(1, &reprojectedSSbo);
+	allocatePixelBuffers();
+	resetAdaptiveTiles();
+
+	// alias table and light tree for next-event estimation. never empty, so bindings 13 and 14 always have storage
+	vector<Light> &lightvect = cpuScene.lights;
+	glGenBuffers(1, &lightSSbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, max(lightvect.size(), size_t(1)) * sizeof(Light), NULL, GL_STATIC_DRAW);
+	if (!lightvect.empty()) {
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, lightvect.size() * sizeof(Light), lightvect.data());
+	}
+
+	vector<LightNode> &lightTree = cpuScene.lightTree;
+	glGenBuffers(1, &lightTreeSSbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightTreeSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, max(lightTree.size(), size_t(1)) * sizeof(LightNode), NULL, GL_STATIC_DRAW);
+	if (!lightTree.empty()) {
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, lightTree.size() * sizeof(LightNode), lightTree.data());
+	}
+
+
+
+
+	// second set of BVH links for shadow rays
+	vector<glm::vec2> &occlusionLinks = cpuScene.occlusionLinks;
+	glGenBuffers(1, &occlusionLinkSSbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, occlusionLinkSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, occlusionLinks.size() * sizeof(glm::vec2), occlusionLinks.data(), GL_STATIC_DRAW);
+
+	// blue-noise tile for the rank1 sampler, the same ranks the cpu backend reads
+	const vector<uint32_t> &blueNoise = blue_noise_tile();
+	glGenBuffers(1, &blueNoiseSSbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, blueNoiseSSbo);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, blueNoise.size() * sizeof(uint32_t), blueNoise.data(), GL_STATIC_DRAW);
+
+
+
+
+
+	frameConstants.init();
+
+
+
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, sphereSSbo);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, triangleSSbo);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, materialSSbo);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, cameraSSbo);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, bvhSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, rayCounterSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, lightSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, lightTreeSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, occlusionLinkSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, blueNoiseSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, triangleOverflowSSbo);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, bvhOverflowSSbo);
+	// 10, 11, 12 and 19 to 21 are bound by allocatePixelBuffers
+
+	createEnvironmentTextures();
+	return true;
 }
 
 
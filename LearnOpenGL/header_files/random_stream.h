@@ -0,0 +1,222 @@
+#ifndef RANDOM_STREAM_H
+#define RANDOM_STREAM_H
+
+
+#include <cstdint>
+#include <vector>
+
+#include "blue_noise.h"
+
+// Counter-based random numbers. Every value is a function of (pixel, sample index, bounce,
+// dimension), so a sample never depends on what was drawn before it, on which thread drew
+// it or on the order tiles were rendered in. computeShader.c has the GLSL twin of this file;
+// both use 32-bit integer math only and produce identical streams.
+//
+// The sampler decides how the values are spread over a pixel's samples:
+// - independent: a hash of all four, white noise
+// - sobol: Owen-scrambled Sobol points, each pixel scrambled by its own hash. Dimensions are
+//   taken three at a time from the first three Sobol dimensions, the sample index shuffled
+//   differently for every group (Burley, "Practical Hash-based Owen Scrambling", JCGT 2020)
+// - rank1: a rank-1 lattice sequence shifted per pixel by a blue-noise tile, so neighbouring
+//   pixels get well spread shifts and their errors look like blue noise rather than white
+//   (Georgiev and Fajardo, "Blue-noise Dithered Sampling", 2016). Dimensions past
+//   RANK1_DIMENSIONS fall back to sobol
+
+const uint32_t SAMPLER_INDEPENDENT = 0;
+const uint32_t SAMPLER_SOBOL = 1;
+const uint32_t SAMPLER_RANK1 = 2;
+
+const char* sampler_name(uint32_t sampler)
+{
+    return sampler == SAMPLER_SOBOL ? "sobol" : (sampler == SAMPLER_RANK1 ? "rank1" : "independent");
+}
+
+// every decision of a bounce reads a fixed dimension, so it gets the same coordinate of the
+// sample point whichever branches the path took before it
+const uint32_t DIMENSION_BSDF = 0;         // 2: diffuse direction
+const uint32_t DIMENSION_LOBE = 2;         // diffuse or specular
+const uint32_t DIMENSION_LIGHT_POINT = 3;  // 2: point on the light or environment direction
+const uint32_t DIMENSION_LIGHT_SELECT = 5; // environment or emitters
+const uint32_t DIMENSION_LIGHT_PICK = 6;   // 2: which emitter
+const uint32_t DIMENSION_ROULETTE = 8;
+const uint32_t DIMENSIONS_PER_BOUNCE = 9;
+
+struct RandomStream
+{
+    uint32_t pixel;       // y * width + x
+    uint32_t sampleIndex; // 0 for the first sample accumulated into the pixel
+    uint32_t bounce;      // 0 for camera ray generation, i + 1 for bounce i of the path
+    uint32_t dimension;   // advanced by every draw, reset on each bounce
+    uint32_t x, y;        // pixel coordinates, for the blue-noise tile
+    uint32_t sampler;
+};
+
+// pcg4d from Jarzynski and Olano, "Hash Functions for GPU Rendering" (JCGT 2020)
+void pcg4d(uint32_t v[4])
+{
+    for (int i = 0; i < 4; i++) v[i] = v[i] * 1664525u + 1013904223u;
+
+    v[0] += v[1] * v[3];
+    v[1] += v[2] * v[0];
+    v[2] += v[0] * v[1];
+    v[3] += v[1] * v[2];
+
+    for (int i = 0; i < 4; i++) v[i] ^= v[i] >> 16;
+
+    v[0] += v[1] * v[3];
+    v[1] += v[2] * v[0];
+    v[2] += v[0] * v[1];
+    v[3] += v[1] * v[2];
+}
+
+// second and third Sobol dimensions, the first is the bit-reversed index
+const uint32_t SOBOL_DIRECTIONS[2][32] = {
+    { 0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+      0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+      0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+      0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu },
+    { 0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+      0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+      0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+      0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u }
+};
+
+// generating vector of the rank-1 lattice sequence frac(radical inverse(i) * z), one entry per
+// dimension of the first bounces. Found by a component-by-component search minimizing the P2
+// discrepancy of every power of two prefix from 16 to 4096 points
+const uint32_t RANK1_DIMENSIONS = 32;
+const uint32_t RANK1_GENERATOR[RANK1_DIMENSIONS] = {
+    1u, 729u, 1589u, 1929u, 1723u, 695u, 1785u, 487u, 1223u, 679u, 1033u, 1769u, 1367u, 1607u, 871u, 87u,
+    233u, 1737u, 855u, 1209u, 1577u, 809u, 633u, 1863u, 617u, 41u, 601u, 313u, 663u, 1705u, 3463u, 553u
+};
+
+// pcg4d keys that keep the scrambling seeds apart from the independent sampler's values
+const uint32_t SOBOL_SEED_KEY = 0x50b01u;
+const uint32_t RANK1_SHIFT_KEY = 0x2a4c1u;
+
+// blue-noise tile ranks, shared by the CPU backend and the GPU's BlueNoiseBlock
+const vector<uint32_t>& blue_noise_tile()
+{
+    static const vector<uint32_t> tile = build_blue_noise(BLUE_NOISE_SIZE);
+    return tile;
+}
+
+RandomStream make_random_stream(uint32_t pixel, uint32_t sampleIndex, uint32_t x, uint32_t y, uint32_t sampler)
+{
+    RandomStream s = { pixel, sampleIndex, 0u, 0u, x, y, sampler };
+    return s;
+}
+
+void random_stream_set_bounce(RandomStream& s, uint32_t bounce)
+{
+    s.bounce = bounce;
+    s.dimension = 0u;
+}
+
+// the next draw reads DIMENSION_* dimension of the current bounce
+void random_stream_set_dimension(RandomStream& s, uint32_t dimension)
+{
+    s.dimension = dimension;
+}
+
+uint32_t reverse_bits(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// findLSB in GLSL, index must not be 0
+int lowest_set_bit(uint32_t x)
+{
+    int bit = 0;
+    if ((x & 0xffffu) == 0) { bit += 16; x >>= 16; }
+    if ((x & 0xffu) == 0) { bit += 8; x >>= 8; }
+    if ((x & 0xfu) == 0) { bit += 4; x >>= 4; }
+    if ((x & 0x3u) == 0) { bit += 2; x >>= 2; }
+    if ((x & 0x1u) == 0) { bit += 1; }
+    return bit;
+}
+
+uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling: a random permutation of every binary subdivision of [0, 1)
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+uint32_t sobol(uint32_t index, uint32_t dimension)
+{
+    if (dimension == 0) {
+        return reverse_bits(index);
+    }
+    // only the set bits, the shuffled index is a full 32-bit number
+    uint32_t x = 0;
+    for (; index != 0; index &= index - 1) {
+        x ^= SOBOL_DIRECTIONS[dimension - 1][lowest_set_bit(index)];
+    }
+    return x;
+}
+
+uint32_t sobol_sample(const RandomStream& s)
+{
+    uint32_t seeds[4] = { s.pixel, s.bounce, s.dimension / 3, SOBOL_SEED_KEY };
+    pcg4d(seeds);
+    uint32_t axis = s.dimension % 3;
+    uint32_t index = nested_uniform_scramble(s.sampleIndex, seeds[0]);
+    return nested_uniform_scramble(sobol(index, axis), seeds[1 + axis]);
+}
+
+uint32_t rank1_sample(const RandomStream& s, uint32_t latticeDimension)
+{
+    // the tile offset changes with the dimension but not the pixel, so every dimension sees
+    // a differently placed copy of the same blue-noise pattern. the rank gives the top 12 bits
+    // of the shift (the tile has 64 * 64 levels) and a hash the rest, so it stays uniform
+    uint32_t offset[4] = { latticeDimension, RANK1_SHIFT_KEY, 0u, 0u };
+    pcg4d(offset);
+    uint32_t tx = (s.x + offset[0]) % uint32_t(BLUE_NOISE_SIZE);
+    uint32_t ty = (s.y + offset[1]) % uint32_t(BLUE_NOISE_SIZE);
+    uint32_t jitter[4] = { s.pixel, RANK1_SHIFT_KEY, s.bounce, s.dimension };
+    pcg4d(jitter);
+    uint32_t shift = (blue_noise_tile()[ty * BLUE_NOISE_SIZE + tx] << 20) | (jitter[0] >> 12);
+    return reverse_bits(s.sampleIndex) * RANK1_GENERATOR[latticeDimension] + shift;
+}
+
+uint32_t random_stream_next(RandomStream& s)
+{
+    uint32_t value;
+    uint32_t latticeDimension = s.bounce * DIMENSIONS_PER_BOUNCE + s.dimension;
+    if (s.sampler == SAMPLER_RANK1 && s.dimension < DIMENSIONS_PER_BOUNCE && latticeDimension < RANK1_DIMENSIONS) {
+        value = rank1_sample(s, latticeDimension);
+    }
+    else if (s.sampler != SAMPLER_INDEPENDENT) {
+        value = sobol_sample(s);
+    }
+    else {
+        uint32_t v[4] = { s.pixel, s.sampleIndex, s.bounce, s.dimension };
+        pcg4d(v);
+        value = v[0];
+    }
+    s.dimension++;
+    return value;
+}
+
+// uniform in [0, 1). 24 bits so the float conversion is exact on every backend
+float random_stream_float(RandomStream& s)
+{
+    return float(random_stream_next(s) >> 8) * (1.0f / 16777216.0f);
+}
+
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef RAY_SORTING_H
+#define RAY_SORTING_H
+
+
+#include <glm/glm.hpp>
+
+#include "cpu_path_trace.h"
+#include "tile_scheduler.h"
+
+#include <vector>
+#include <cstdint>
+#include <chrono>
+
+using namespace std;
+
+// Wavefront rendering for the cpu backend. cpu_trace follows one path from the camera to its
+// end before starting the next, so after the first bounce consecutive rays leave from unrelated
+// points in unrelated directions and every traversal starts from a cold cache. Here all the
+// paths of a tile advance one bounce at a time, and before each bounce after the first the
+// rays are sorted so that rays heading into the same octant from nearby origins are traced
+// one after the other and share the BVH nodes they touch.
+
+const int RAY_SORT_ORIGIN_BITS = 9; // per axis of the grid the origins are quantized to
+
+// 9 bits -> every third bit of 27
+uint32_t ray_sort_spread_bits(uint32_t x)
+{
+    x &= 0x1ffu;
+    x = (x | (x << 16)) & 0x030000ffu;
+    x = (x | (x << 8)) & 0x0300f00fu;
+    x = (x | (x << 4)) & 0x030c30c3u;
+    x = (x | (x << 2)) & 0x09249249u;
+    return x;
+}
+
+// direction octant in the top three bits, then the Morton code of the origin's cell on a
+// 512^3 grid over the scene bounds
+uint32_t ray_sort_key(glm::vec3 o, glm::vec3 d, glm::vec3 boundsMin, glm::vec3 cellsPerUnit)
+{
+    uint32_t octant = (d.x < 0.0f ? 1u : 0u) | (d.y < 0.0f ? 2u : 0u) | (d.z < 0.0f ? 4u : 0u);
+    glm::vec3 cell = (o - boundsMin) * cellsPerUnit;
+    const float maxCell = float((1 << RAY_SORT_ORIGIN_BITS) - 1);
+    uint32_t x = uint32_t(glm::clamp(cell.x, 0.0f, maxCell));
+    uint32_t y = uint32_t(glm::clamp(cell.y, 0.0f, maxCell));
+    uint32_t z = uint32_t(glm::clamp(cell.z, 0.0f, maxCell));
+    uint32_t morton = ray_sort_spread_bits(x) | (ray_sort_spread_bits(y) << 1) | (ray_sort_spread_bits(z) << 2);
+    return (octant << (3 * RAY_SORT_ORIGIN_BITS)) | morton;
+}
+
+// LSD radix sort of key << 32 | path index, 8 bits of the key per pass. A pass is skipped
+// when every key has the same digit, which is common for the top bits of small scenes
+void radix_sort_rays(vector<uint64_t>& items, vector<uint64_t>& scratch)
+{
+    if (items.empty()) return;
+    scratch.resize(items.size());
+    for (int shift = 32; shift < 64; shift += 8) {
+        size_t offsets[257] = {};
+        for (uint64_t item : items) {
+            offsets[((item >> shift) & 0xff) + 1]++;
+        }
+        if (offsets[((items[0] >> shift) & 0xff) + 1] == items.size()) continue;
+        for (int digit = 0; digit < 256; digit++) {
+            offsets[digit + 1] += offsets[digit];
+        }
+        for (uint64_t item : items) {
+            scratch[offsets[(item >> shift) & 0xff]++] = item;
+        }
+        items.swap(scratch);
+    }
+}
+
+struct WavefrontStats
+{
+    uint64_t rays = 0;
+    uint64_t secondaryRays = 0;    // traced from the second bounce on, shadow rays included
+    double secondarySeconds = 0.0; // tracing and shading those bounces, sorting included
+    double sortSeconds = 0.0;
+    uint64_t nodeAccesses = 0;     // of the secondary rays, counted when a cache model is given
+    uint64_t nodeHits = 0;
+
+    void add(const WavefrontStats& other)
+    {
+        rays += other.rays;
+        secondaryRays += other.secondaryRays;
+        secondarySeconds += other.secondarySeconds;
+        sortSeconds += other.sortSeconds;
+        nodeAccesses += other.nodeAccesses;
+        nodeHits += other.nodeHits;
+    }
+};
+
+// renders spp samples of every pixel in the tile as a wavefront and accumulates them in pixel
+// and sample order, so the frame is identical to cpu_render_sample's. cache, if given, counts
+// the BVH node accesses of the secondary rays
+void cpu_render_tile_wavefront(const CpuScene& scene, const CpuCamera& cam, const Tile& tile, int width, int height, int spp, int firstSample,
+    bool sortRays, CpuFrame& frame, int displayMode, WavefrontStats& stats, NodeCacheModel* cache = nullptr)
+{
+    vector<CpuPath> paths;
+    paths.reserve((tile.x1 - tile.x0) * (tile.y1 - tile.y0) * spp);
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            for (int s = 0; s < spp; s++) {
+                paths.push_back(cpu_camera_path(cam, x, y, width, height, firstSample + s));
+            }
+        }
+    }
+
+    glm::vec3 boundsMin = glm::vec3(scene.heirarchy[0].minPoint);
+    glm::vec3 extent = glm::vec3(scene.heirarchy[0].maxPoint) - boundsMin;
+    glm::vec3 cellsPerUnit = glm::vec3(float(1 << RAY_SORT_ORIGIN_BITS)) / glm::max(extent, glm::vec3(1e-6f));
+
+    vector<uint64_t> queue(paths.size()), scratch;
+    for (size_t i = 0; i < paths.size(); i++) {
+        queue[i] = i;
+    }
+
+    if (cache) cache->reset();
+    for (bool primary = true; !queue.empty(); primary = false) {
+        auto start = chrono::steady_clock::now();
+        if (sortRays && !primary) {
+            for (uint64_t& item : queue) {
+                const CpuPath& path = paths[uint32_t(item)];
+                item = (uint64_t(ray_sort_key(path.ray_o, path.ray_d, boundsMin, cellsPerUnit)) << 32) | uint32_t(item);
+            }
+            radix_sort_rays(queue, scratch);
+            stats.sortSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        }
+
+        uint64_t accesses = cache ? cache->accesses : 0, hits = cache ? cache->hits : 0;
+        cpu_node_cache = primary ? nullptr : cache;
+        uint64_t bounceRays = 0;
+        size_t active = 0;
+        for (uint64_t item : queue) {
+            CpuPath& path = paths[uint32_t(item)];
+            CpuHit h;
+            cpu_intersect_path(scene, path, h, bounceRays);
+            cpu_shade_path(scene, path, h, bounceRays);
+            if (path.active) {
+                queue[active++] = uint32_t(item);
+            }
+        }
+        queue.resize(active);
+        cpu_node_cache = nullptr;
+
+        stats.rays += bounceRays;
+        if (!primary) {
+            stats.secondaryRays += bounceRays;
+            stats.secondarySeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            if (cache) {
+                stats.nodeAccesses += cache->accesses - accesses;
+                stats.nodeHits += cache->hits - hits;
+            }
+        }
+    }
+
+    size_t next = 0;
+    for (int y = tile.y0; y < tile.y1; y++) {
+        for (int x = tile.x0; x < tile.x1; x++) {
+            for (int s = 0; s < spp; s++, next++) {
+                cpu_accumulate_sample(frame, y * width + x, paths[next].incomingLight, paths[next].aovs, displayMode);
+            }
+        }
+    }
+}
+
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef RENDER_RESOLUTION_H
+#define RENDER_RESOLUTION_H
+
+
+#include <algorithm>
+
+using namespace std;
+
+const float RENDER_SCALE_MIN = 0.25f;
+const float RENDER_SCALE_MAX = 2.0f;
+const float RENDER_SCALE_STEP = 0.25f;      // per press of [ or ]
+const double RENDER_SCALE_SETTLE = 0.1;     // seconds without camera input before the full size returns
+
+// The size the viewer path traces at: its framebuffer's size times scale, and times
+// movingScale on top while the camera moves. A moving camera restarts the accumulation every
+// frame anyway, so rendering fewer pixels then buys frame rate without losing samples, and
+// the screen quad upscales them to the window. The full size comes back once the camera
+// has been still for RENDER_SCALE_SETTLE, so a slow mouse look does not flicker between the
+// two sizes.
+class RenderResolution
+{
+public:
+    explicit RenderResolution(float scale = 1.0f, float movingScale = 1.0f)
+        : scale(clamp(scale, RENDER_SCALE_MIN, RENDER_SCALE_MAX)), movingScale(clamp(movingScale, 0.1f, 1.0f)) {}
+
+    float scale;
+    float movingScale; // 1 turns dynamic resolution off
+
+    // camera input at time (seconds)
+    void cameraMoved(double time) { lastMove = time; }
+
+    bool moving(double time) const { return movingScale < 1.0f && time - lastMove < RENDER_SCALE_SETTLE; }
+
+    // one step of [ or ], direction -1 or 1
+    void step(int direction)
+    {
+        scale = clamp(scale + direction * RENDER_SCALE_STEP, RENDER_SCALE_MIN, RENDER_SCALE_MAX);
+    }
+
+    // the render size for a framebuffer of windowWidth x windowHeight, never below 1x1
+    void size(int windowWidth, int windowHeight, bool moving, int& width, int& height) const
+    {
+        float s = scale * (moving ? movingScale : 1.0f);
+        width = max(1, int(windowWidth * s + 0.5f));
+        height = max(1, int(windowHeight * s + 0.5f));
+    }
+
+private:
+    double lastMove = -1e9;
+};
+
+
+#endif
@@ -0,0 +1,375 @@
+#ifndef RENDER_SETTINGS_H
+#define RENDER_SETTINGS_H
+
+
+#include <glm/glm.hpp>
+
+#include "random_stream.h"
+
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+struct RenderSettings
+{
+    string objPath = "scene_data/shipobj.txt";
+    string mtlPath = "scene_data/shipmtl.txt";
+
+    glm::vec4 cameraPosition = glm::vec4(0.0, -6.0, 1.0, 0.0);
+    glm::vec4 cameraDirection = glm::vec4(0.0, 1.0, 0.0, 0.0);
+
+    int width = 1000;
+    int height = 800;
+    // paths end at maxBounces; after minBounces Russian roulette ends them early based on throughput
+    int maxBounces = 16;
+    int minBounces = 3;
+
+    // sample the emissive triangles and spheres directly at every diffuse bounce, picking
+    // them with the light tree (by estimated contribution) or by power alone
+    bool nextEventEstimation = true;
+    bool lightTree = true;
+    // shadow rays try the BVH child most likely to block them first
+    bool orderedOcclusion = true;
+    // how each pixel's samples are spread, SAMPLER_* from random_stream.h
+    uint32_t sampler = SAMPLER_SOBOL;
+
+    // equirectangular .hdr or .pfm lighting the scene instead of the sky gradient, scaled by
+    // environmentIntensity and importance sampled by next-event estimation
+    string environmentPath;
+    float environmentIntensity = 1.0f;
+
+    // batch mode: render until samplesPerPixel or timeBudget (seconds) is reached, whichever
+    // comes first, then write outputPath.pfm and outputPath.png
+    bool batch = false;
+    int samplesPerPixel = 0;
+    double timeBudget = 0.0;
+    string outputPath;
+
+    bool cpu = false;
+    int threads = 0; // 0 = one per hardware thread
+
+    // gpu: stop sampling pixels whose relative error drops below the threshold and
+    // spend their samples on the noisiest tiles instead
+    bool adaptive = false;
+    float convergenceThreshold = 0.02f;
+
+    // edge-aware denoiser on the final image. batch mode also writes the raw image as outputPath_noisy
+    bool denoise = false;
+
+    // batch: also write the first hit AOVs as outputPath_<layer>.pfm. extras adds the hit
+    // position and the material and object ids
+    bool aovs = false;
+    bool aovExtras = false;
+
+    // time closest-hit and occlusion queries on random segments instead of rendering.
+    // --spp sets the number of frames per query
+    bool rayBenchmark = false;
+
+    // cpu: trace each tile as a wavefront, sorting the rays by direction and origin before
+    // every bounce. the benchmark renders --spp samples with and without sorting and compares
+    bool sortRays = false;
+    bool sortBenchmark = false;
+
+    // gpu: print the time of every pass from timer queries (mean and percentiles over the last
+    // 256 frames) once a second and at exit. profileCsv also writes every measurement
+    bool profile = false;
+    string profileCsv;
+
+    // gpu: count BVH nodes visited, triangle and sphere tests and bounces in the shader and
+    // print them per ray and per frame
+    bool rayStats = false;
+
+    // gpu: local size of the path tracing shader, 0 for the shape tuned for this driver.
+    // tuneWorkgroup times every candidate shape, saves the fastest and exits
+    int workgroupWidth = 0;
+    int workgroupHeight = 0;
+    bool tuneWorkgroup = false;
+
+    // viewer: resolve the accumulation into an rgba16f display texture instead of rgba32f.
+    // batch renders always read full precision
+    bool halfDisplay = true;
+
+    // viewer: while the camera is still, render as many samples per frame as fit in this
+    // many milliseconds. 0 renders one sample per frame
+    double frameBudgetMs = 33.0;
+
+    // viewer: path trace at the window's size times renderScale, and times movingScale on top
+    // while the camera moves. the screen quad upscales the result
+    float renderScale = 1.0f;
+    float movingScale = 0.5f;
+
+    // viewer: when the camera moves, reproject the last view's image into the new one
+    // instead of restarting from a single sample
+    bool reprojection = true;
+
+    // viewer: record every frame as capturePath_<n>.pfm, or .png when capturePath ends in .png
+    string capturePath;
+
+    // viewer: save the camera of every frame to recordCameraPath on exit, or drive the camera
+    // from the path in replayCameraPath instead of the input, replayStep seconds of it per frame
+    string recordCameraPath;
+    string replayCameraPath;
+    double replayStep = 1.0 / 30.0;
+
+    // replay benchmarkPath headless at replayStep per frame, then report the frame times and
+    // the error of the last frame against a --spp sample render of its view
+    string benchmarkPath;
+};
+
+void print_usage(const char* program)
+{
+    cout << "usage: " << program << " [scene obj] [options]\n"
+        << "  --scene <obj> [mtl]        scene geometry and materials (mtl defaults to the obj name with obj -> mtl)\n"
+        << "  --camera px,py,pz,dx,dy,dz camera position and view direction\n"
+        << "  --size <width>x<height>    render resolution\n"
+        << "  --bounces <n>              maximum bounces per path\n"
+        << "  --min-bounces <n>          bounces before Russian roulette may end a path\n"
+        << "  --no-nee                   only find lights by bouncing into them\n"
+        << "  --no-light-tree            pick lights by power instead of with the light tree\n"
+        << "  --no-occluder-order        shadow rays walk the BVH in build order\n"
+        << "  --sampler <name>           sobol (default), rank1 (blue-noise lattice) or independent\n"
+        << "  --env <hdr>                equirectangular .hdr or .pfm environment map (z up)\n"
+        << "  --env-intensity <scale>    multiplies the environment map\n"
+        << "  --spp <n>                  batch: samples per pixel to render\n"
+        << "  --time <seconds>           batch: wall-clock budget\n"
+        << "  --output <path>            batch: render headless and write <path>.pfm and <path>.png\n"
+        << "  --cpu                      use the CPU backend\n"
+        << "  --threads <n>              CPU backend worker threads\n"
+        << "  --adaptive                 adaptive sampling (GPU backend); --spp becomes the average budget\n"
+        << "  --threshold <error>        relative error at which a pixel counts as converged\n"
+        << "  --denoise                  denoise the result, guided by normals, albedo and depth\n"
+        << "  --aovs                     batch: also write normal, albedo and depth images\n"
+        << "  --aov-extras               batch: --aovs plus hit position, material id and object id\n"
+        << "  --ray-bench                time closest-hit against occlusion queries and exit\n"
+        << "  --sort-rays                CPU backend: sort each bounce's rays by direction and origin\n"
+        << "  --sort-bench               CPU backend: compare bounces 2+ with and without --sort-rays and exit\n"
+        << "  --profile                  print GPU time per pass (path trace, denoise, uploads, blit)\n"
+        << "  --profile-csv <path>       --profile and write every pass time to a CSV file\n"
+        << "  --ray-stats                GPU backend: count node visits and primitive tests per ray\n"
+        << "  --workgroup <w>x<h>        GPU backend: path tracing workgroup shape instead of the tuned one\n"
+        << "  --tune-workgroup           GPU backend: time each workgroup shape, keep the fastest and exit\n"
+        << "  --float-display            viewer: rgba32f display texture instead of rgba16f\n"
+        << "  --frame-budget <ms>        viewer: frame time to fill with samples while the camera is still (0 = one per frame)\n"
+        << "  --no-reprojection          viewer: restart from one sample when the camera moves\n"
+        << "  --render-scale <scale>     viewer: render resolution relative to the window, 0.25 to 2\n"
+        << "  --moving-scale <scale>     viewer: further scale while the camera moves (1 = off)\n"
+        << "  --capture <path>           viewer: record every frame as <path>_<n>.pfm (.png if <path> ends in .png)\n"
+        << "  --record-camera <file>     viewer: save the camera path to <file> on exit\n"
+        << "  --replay-camera <file>     viewer: fly along a saved camera path and exit at its end\n"
+        << "  --replay-step <seconds>    path time per frame of --replay-camera and --benchmark (default 1/30)\n"
+        << "  --benchmark <file>         replay a camera path headless, report frame times and the error against --spp samples\n"
+        << endl;
+}
+
+// "scene_data/shipobj.txt" -> "scene_data/shipmtl.txt", the naming the scene_data folder uses
+string material_path_for(const string& objPath)
+{
+    string mtl = objPath;
+    size_t pos = mtl.rfind("obj");
+    if (pos != string::npos) {
+        mtl.replace(pos, 3, "mtl");
+    }
+    return mtl;
+}
+
+// returns false (after printing why) if the arguments could not be understood
+bool parse_arguments(int argc, char* argv[], RenderSettings& settings)
+{
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return false;
+        }
+        else if (arg == "--cpu") {
+            settings.cpu = true;
+        }
+        else if (arg == "--adaptive") {
+            settings.adaptive = true;
+        }
+        else if (arg == "--denoise") {
+            settings.denoise = true;
+        }
+        else if (arg == "--aovs") {
+            settings.aovs = true;
+        }
+        else if (arg == "--aov-extras") {
+            settings.aovs = true;
+            settings.aovExtras = true;
+        }
+        else if (arg == "--no-nee") {
+            settings.nextEventEstimation = false;
+        }
+        else if (arg == "--no-light-tree") {
+            settings.lightTree = false;
+        }
+        else if (arg == "--no-occluder-order") {
+            settings.orderedOcclusion = false;
+        }
+        else if (arg == "--ray-bench") {
+            settings.rayBenchmark = true;
+            settings.batch = true;
+        }
+        else if (arg == "--sort-rays") {
+            settings.sortRays = true;
+        }
+        else if (arg == "--sort-bench") {
+            settings.sortBenchmark = true;
+            settings.batch = true;
+        }
+        else if (arg == "--profile") {
+            settings.profile = true;
+        }
+        else if (arg == "--ray-stats") {
+            settings.rayStats = true;
+        }
+        else if (arg == "--no-reprojection") {
+            settings.reprojection = false;
+        }
+        else if (arg == "--float-display") {
+            settings.halfDisplay = false;
+        }
+        else if (arg == "--tune-workgroup") {
+            settings.tuneWorkgroup = true;
+            settings.batch = true;
+        }
+        else if (arg[0] != '-') {
+            // bare scene path, as in the readme
+            settings.objPath = arg;
+            settings.mtlPath = material_path_for(arg);
+        }
+        else if (!hasValue) {
+            cout << "Missing value for argument: " << arg << endl;
+            print_usage(argv[0]);
+            return false;
+        }
+        else if (arg == "--scene") {
+            settings.objPath = argv[++i];
+            settings.mtlPath = material_path_for(settings.objPath);
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                settings.mtlPath = argv[++i];
+            }
+        }
+        else if (arg == "--camera") {
+            glm::vec4& p = settings.cameraPosition;
+            glm::vec4& d = settings.cameraDirection;
+            if (sscanf(argv[++i], "%f,%f,%f,%f,%f,%f", &p.x, &p.y, &p.z, &d.x, &d.y, &d.z) != 6) {
+                cout << "Could not parse camera: " << argv[i] << endl;
+                return false;
+            }
+        }
+        else if (arg == "--size") {
+            if (sscanf(argv[++i], "%dx%d", &settings.width, &settings.height) != 2 || settings.width <= 0 || settings.height <= 0) {
+                cout << "Could not parse size: " << argv[i] << endl;
+                return false;
+            }
+        }
+        else if (arg == "--bounces") {
+            settings.maxBounces = atoi(argv[++i]);
+        }
+        else if (arg == "--min-bounces") {
+            settings.minBounces = atoi(argv[++i]);
+        }
+        else if (arg == "--sampler") {
+            string name = argv[++i];
+            if (name == "sobol") settings.sampler = SAMPLER_SOBOL;
+            else if (name == "rank1") settings.sampler = SAMPLER_RANK1;
+            else if (name == "independent") settings.sampler = SAMPLER_INDEPENDENT;
+            else {
+                cout << "Unknown sampler: " << name << endl;
+                return false;
+            }
+        }
+        else if (arg == "--env") {
+            settings.environmentPath = argv[++i];
+        }
+        else if (arg == "--env-intensity") {
+            settings.environmentIntensity = (float)atof(argv[++i]);
+        }
+        else if (arg == "--spp") {
+            settings.samplesPerPixel = atoi(argv[++i]);
+        }
+        else if (arg == "--time") {
+            settings.timeBudget = atof(argv[++i]);
+        }
+        else if (arg == "--output") {
+            settings.outputPath = argv[++i];
+            settings.batch = true;
+        }
+        else if (arg == "--threads") {
+            settings.threads = atoi(argv[++i]);
+        }
+        else if (arg == "--profile-csv") {
+            settings.profileCsv = argv[++i];
+            settings.profile = true;
+        }
+        else if (arg == "--workgroup") {
+            if (sscanf(argv[++i], "%dx%d", &settings.workgroupWidth, &settings.workgroupHeight) != 2 || settings.workgroupWidth <= 0 || settings.workgroupHeight <= 0) {
+                cout << "Could not parse workgroup: " << argv[i] << endl;
+                return false;
+            }
+        }
+        else if (arg == "--frame-budget") {
+            settings.frameBudgetMs = atof(argv[++i]);
+        }
+        else if (arg == "--render-scale") {
+            settings.renderScale = (float)atof(argv[++i]);
+        }
+        else if (arg == "--moving-scale") {
+            settings.movingScale = (float)atof(argv[++i]);
+        }
+        else if (arg == "--capture") {
+            settings.capturePath = argv[++i];
+        }
+        else if (arg == "--record-camera") {
+            settings.recordCameraPath = argv[++i];
+        }
+        else if (arg == "--replay-camera") {
+            settings.replayCameraPath = argv[++i];
+        }
+        else if (arg == "--replay-step") {
+            settings.replayStep = atof(argv[++i]);
+            if (settings.replayStep <= 0.0) {
+                cout << "Replay step must be positive: " << argv[i] << endl;
+                return false;
+            }
+        }
+        else if (arg == "--benchmark") {
+            settings.benchmarkPath = argv[++i];
+            settings.batch = true;
+        }
+        else if (arg == "--threshold") {
+            settings.convergenceThreshold = (float)atof(argv[++i]);
+        }
+        else {
+            cout << "Unknown argument: " << arg << endl;
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+
+    // strip an image extension so --output foo.png still writes foo.pfm next to it
+    for (const char* ext : { ".png", ".pfm" }) {
+        string& out = settings.outputPath;
+        if (out.size() > 4 && out.compare(out.size() - 4, 4, ext) == 0) {
+            out.erase(out.size() - 4);
+        }
+    }
+
+    // the benchmark's reference should be far more converged than any view of the flight, and
+    // it has no use for a time budget
+    bool benchmark = !settings.benchmarkPath.empty();
+    if (settings.batch && settings.samplesPerPixel <= 0 && (settings.timeBudget <= 0.0 || benchmark)) {
+        settings.samplesPerPixel = settings.rayBenchmark || settings.sortBenchmark || settings.tuneWorkgroup ? 8 : benchmark ? 256 : 64;
+    }
+
+    return true;
+}
+
+
+#endif
@@ -10,14 +10,52 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <iterator>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <cstdio>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// linked programs are kept here by glGetProgramBinary, one file per driver and source
+const char* const SHADER_CACHE_DIRECTORY = "shader_cache";
+
+// vendor, renderer and version of the current context, one per line. programs and tuning
+// results are only valid for the driver that produced them
+inline std::string shaderCacheDriver()
+{
+    std::string driver;
+    for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION }) {
+        const GLubyte* value = glGetString(name);
+        driver += value ? (const char*)value : "";
+        driver += '\n';
+    }
+    return driver;
+}
+
+inline void makeShaderCacheDirectory()
+{
+#ifdef _WIN32
+    _mkdir(SHADER_CACHE_DIRECTORY);
+#else
+    mkdir(SHADER_CACHE_DIRECTORY, 0755);
+#endif
+}
 
 class ComputeShader
 {
 public:
     unsigned int ID;
-    // constructor generates the shader on the fly
+    bool fromCache = false; // loaded from SHADER_CACHE_DIRECTORY instead of compiled
+    // constructor generates the shader on the fly. defines is a preamble of #define lines
+    // inserted after the #version line, so one source can be built in several variants
     // ------------------------------------------------------------------------
-    ComputeShader(const char* computePath)
+    ComputeShader(const char* computePath, const std::string& defines = "")
     {
         // 1. retrieve the vertex/fragment source code from filePath
         std::string computeCode;
@@ -41,8 +79,25 @@ public:
         {
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
         }
+        if (!defines.empty()) {
+            // after the #version line, then #line so compile errors keep the file's line numbers
+            size_t version = computeCode.find("#version");
+            size_t versionEnd = version == std::string::npos ? 0 : computeCode.find('\n', version) + 1;
+            int nextLine = 1 + (int)std::count(computeCode.begin(), computeCode.begin() + versionEnd, '\n');
+            computeCode.insert(versionEnd, defines + "#line " + std::to_string(nextLine) + "\n");
+        }
+
+        // 2. reuse the program linked by an earlier run with the same driver and source
+        std::string cachePath = std::string(SHADER_CACHE_DIRECTORY) + "/" + cacheKey(computeCode) + ".bin";
+        ID = glCreateProgram();
+        if (loadBinary(cachePath)) {
+            fromCache = true;
+            return;
+        }
+        glDeleteProgram(ID);
+
         const char* cShaderCode = computeCode.c_str();
-        // 2. compile shaders
+        // 3. compile shaders
         unsigned int compute;
         // compute shader
         compute = glCreateShader(GL_COMPUTE_SHADER);
@@ -53,8 +108,11 @@ public:
         // shader Program
         ID = glCreateProgram();
         glAttachShader(ID, compute);
+        glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         glLinkProgram(ID);
-        checkCompileErrors(ID, "PROGRAM");
+        if (checkCompileErrors(ID, "PROGRAM")) {
+            saveBinary(cachePath);
+        }
         // delete the shaders as they're linked into our program now and no longer necessary
         glDeleteShader(compute);
     }
@@ -89,6 +147,10 @@ public:
     { 
         glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y); 
     }
+    void setIVec2(const std::string &name, int x, int y) const
+    { 
+        glUniform2i(glGetUniformLocation(ID, name.c_str()), x, y); 
+    }
     // ------------------------------------------------------------------------
     void setVec3(const std::string &name, const glm::vec3 &value) const
     { 
@@ -124,9 +186,55 @@ public:
     }
 
 private:
-    // utility function for checking shader compilation/linking errors.
+    // 64-bit FNV-1a of the driver strings and the full source, preamble included
     // ------------------------------------------------------------------------
-    void checkCompileErrors(GLuint shader, std::string type)
+    static std::string cacheKey(const std::string& source)
+    {
+        std::string key = shaderCacheDriver() + source;
+
+        uint64_t hash = 14695981039346656037ull;
+        for (unsigned char c : key) {
+            hash = (hash ^ c) * 1099511628211ull;
+        }
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+        return hex;
+    }
+    // cache files hold the binary format followed by the binary. false if there is no file
+    // or the driver rejects it, e.g. after an update that kept the version string
+    // ------------------------------------------------------------------------
+    bool loadBinary(const std::string& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        GLenum format = 0;
+        if (!file.read((char*)&format, sizeof(format))) {
+            return false;
+        }
+        std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        glProgramBinary(ID, format, binary.data(), (GLsizei)binary.size());
+        GLint success = 0;
+        glGetProgramiv(ID, GL_LINK_STATUS, &success);
+        return success != 0;
+    }
+    // ------------------------------------------------------------------------
+    void saveBinary(const std::string& path)
+    {
+        GLint length = 0;
+        glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0) {
+            return; // the driver has no binary formats
+        }
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(ID, length, NULL, &format, binary.data());
+        makeShaderCacheDirectory();
+        std::ofstream file(path, std::ios::binary);
+        file.write((const char*)&format, sizeof(format));
+        file.write(binary.data(), binary.size());
+    }
+    // utility function for checking shader compilation/linking errors, true if there were none
+    // ------------------------------------------------------------------------
+    bool checkCompileErrors(GLuint shader, std::string type)
     {
         GLint success;
         GLchar infoLog[1024];
@@ -148,7 +256,36 @@ private:
                 std::cout << "ERROR::PROGRAM_LINKING_ERROR of type: " << type << "\n" << infoLog << "\n -- --------------------------------------------------- -- " << std::endl;
             }
         }
+        return success != 0;
     }
 };
+
+// the variants of one compute shader, keyed by their #define preamble and built on first use
+class ComputeShaderVariants
+{
+public:
+    ComputeShaderVariants(const char* computePath) : path(computePath) {}
+
+    ComputeShader& get(const std::string& defines)
+    {
+        auto found = variants.find(defines);
+        if (found == variants.end()) {
+            found = variants.emplace(defines, ComputeShader(path.c_str(), defines)).first;
+        }
+        return found->second;
+    }
+    // ------------------------------------------------------------------------
+    void deletePrograms()
+    {
+        for (auto& variant : variants) {
+            glDeleteProgram(variant.second.ID);
+        }
+        variants.clear();
+    }
+
+private:
+    std::string path;
+    std::map<std::string, ComputeShader> variants;
+};
 #endif
 
@@ -0,0 +1,302 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+
+using namespace std;
+
+struct Tile
+{
+    int x0, y0; // inclusive
+    int x1, y1; // exclusive
+
+    double lastPassMs; // time spent on this tile during the most recent pass
+    double totalMs;    // time spent on this tile since the last reset
+};
+
+// Hilbert curve index -> (x, y) on an n x n grid, n a power of two
+void hilbert_d2xy(int n, int d, int& x, int& y)
+{
+    x = y = 0;
+    for (int s = 1; s < n; s *= 2) {
+        int rx = 1 & (d / 2);
+        int ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            swap(x, y);
+        }
+        x += s * rx;
+        y += s * ry;
+        d /= 4;
+    }
+}
+
+// Splits a frame into tiles and renders them over a pool of worker threads. Tiles are
+// numbered along a Hilbert curve and each worker is handed a contiguous run of that
+// curve, so consecutive tiles touch neighbouring pixels (and similar parts of the BVH).
+// A worker pops tiles from the front of its own deque; once it runs dry it steals from
+// the back of someone else's, which keeps expensive regions from stalling the pass.
+class TileScheduler
+{
+public:
+    // renderTile(tile, samplesThisPass, firstSampleIndex)
+    typedef function<void(const Tile&, int, int)> TileFunction;
+
+    int width, height, tileSize;
+    int tilesX, tilesY;
+    vector<Tile> tiles; // in Hilbert order
+
+    int pass;         // number of passes since the last reset
+    int samplesDone;  // samples per pixel accumulated since the last reset
+    int maxSamplesPerPass;
+
+    TileScheduler(int width, int height, int tileSize = 32, int numThreads = 0, int maxSamplesPerPass = 8)
+        : width(width), height(height), tileSize(tileSize), pass(0), samplesDone(0),
+          maxSamplesPerPass(maxSamplesPerPass), generation(0), pending(0), busyWorkers(0), shutdown(false)
+    {
+        buildTiles();
+
+        if (numThreads <= 0) {
+            numThreads = max(1, (int)thread::hardware_concurrency());
+        }
+        queues = vector<WorkQueue>(numThreads);
+        for (int t = 0; t < numThreads; t++) {
+            workers.push_back(thread(&TileScheduler::workerLoop, this, t));
+        }
+    }
+
+    ~TileScheduler()
+    {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            shutdown = true;
+        }
+        startCondition.notify_all();
+        for (thread& w : workers) {
+            w.join();
+        }
+    }
+
+    int numThreads() const { return (int)workers.size(); }
+
+    // progressive schedule: 1 spp over the whole frame first, then bigger refinement passes
+    int samplesForPass(int p) const
+    {
+        return min(maxSamplesPerPass, 1 << max(0, p - 1));
+    }
+
+    void reset()
+    {
+        pass = 0;
+        samplesDone = 0;
+        for (Tile& t : tiles) {
+            t.lastPassMs = 0.0;
+            t.totalMs = 0.0;
+        }
+    }
+
+    // new frame size, retiles the frame and starts over. never called during a pass
+    void resize(int newWidth, int newHeight)
+    {
+        width = newWidth;
+        height = newHeight;
+        buildTiles();
+        reset();
+    }
+
+    // renders one progressive pass over every tile, blocking until the pass completes.
+    // sampleLimit > 0 caps the samples of this pass. returns the samples per pixel that were added.
+    int runPass(TileFunction renderTile, int sampleLimit = 0)
+    {
+        int spp = samplesForPass(pass);
+        if (sampleLimit > 0) spp = min(spp, sampleLimit);
+
+        {
+            unique_lock<mutex> lock(stateMutex);
+            // a worker that woke up late for the previous pass may still be scanning the queues
+            doneCondition.wait(lock, [this] { return busyWorkers == 0; });
+
+            currentTask = renderTile;
+            currentSamples = spp;
+            currentFirstSample = samplesDone;
+
+            // hand each worker a contiguous run of the curve
+            int n = (int)queues.size();
+            for (int q = 0; q < n; q++) {
+                lock_guard<mutex> qlock(queues[q].lock);
+                queues[q].tiles.clear();
+                int begin = (int)tiles.size() * q / n;
+                int end = (int)tiles.size() * (q + 1) / n;
+                for (int i = begin; i < end; i++) {
+                    queues[q].tiles.push_back(i);
+                }
+            }
+            pending = (int)tiles.size();
+            generation++;
+        }
+        startCondition.notify_all();
+
+        {
+            unique_lock<mutex> lock(stateMutex);
+            doneCondition.wait(lock, [this] { return pending == 0 && busyWorkers == 0; });
+        }
+
+        pass++;
+        samplesDone += spp;
+        return spp;
+    }
+
+    // per-tile cost of the last pass, row-major over the tile grid, in milliseconds
+    vector<double> tileTimes() const
+    {
+        vector<double> times(tilesX * tilesY, 0.0);
+        for (const Tile& t : tiles) {
+            times[(t.y0 / tileSize) * tilesX + (t.x0 / tileSize)] = t.lastPassMs;
+        }
+        return times;
+    }
+
+    // prints the tile grid shaded by the time each tile took during the last pass (top row first)
+    void printTileHeatmap() const
+    {
+        const char shades[] = " .:-=+*#%@";
+        vector<double> times = tileTimes();
+        double maxMs = *max_element(times.begin(), times.end());
+        double sum = 0.0;
+        for (double ms : times) sum += ms;
+
+        cout << "\nTile cost, pass " << pass << " (max " << setprecision(3) << maxMs << " ms, mean " << sum / times.size() << " ms)" << endl;
+        for (int ty = tilesY - 1; ty >= 0; ty--) {
+            for (int tx = 0; tx < tilesX; tx++) {
+                double r = maxMs > 0.0 ? times[ty * tilesX + tx] / maxMs : 0.0;
+                cout << shades[min(9, int(r * 9.999))];
+            }
+            cout << endl;
+        }
+    }
+
+private:
+    struct WorkQueue
+    {
+        mutex lock;
+        deque<int> tiles;
+    };
+
+    vector<WorkQueue> queues;
+    vector<thread> workers;
+
+    mutex stateMutex;
+    condition_variable startCondition;
+    condition_variable doneCondition;
+    TileFunction currentTask;
+    int currentSamples;
+    int currentFirstSample;
+    int generation;
+    int pending;
+    int busyWorkers;
+    bool shutdown;
+
+    void buildTiles()
+    {
+        tilesX = (width + tileSize - 1) / tileSize;
+        tilesY = (height + tileSize - 1) / tileSize;
+
+        int n = 1;
+        while (n < tilesX || n < tilesY) n *= 2;
+
+        tiles.clear();
+        for (int d = 0; d < n * n; d++) {
+            int tx, ty;
+            hilbert_d2xy(n, d, tx, ty);
+            if (tx >= tilesX || ty >= tilesY) continue;
+
+            Tile t;
+            t.x0 = tx * tileSize;
+            t.y0 = ty * tileSize;
+            t.x1 = min(width, t.x0 + tileSize);
+            t.y1 = min(height, t.y0 + tileSize);
+            t.lastPassMs = 0.0;
+            t.totalMs = 0.0;
+            tiles.push_back(t);
+        }
+    }
+
+    bool popLocal(int id, int& tile)
+    {
+        lock_guard<mutex> lock(queues[id].lock);
+        if (queues[id].tiles.empty()) return false;
+        tile = queues[id].tiles.front();
+        queues[id].tiles.pop_front();
+        return true;
+    }
+
+    bool steal(int id, int& tile)
+    {
+        int n = (int)queues.size();
+        for (int k = 1; k < n; k++) {
+            WorkQueue& victim = queues[(id + k) % n];
+            lock_guard<mutex> lock(victim.lock);
+            if (victim.tiles.empty()) continue;
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(int id)
+    {
+        int seenGeneration = 0;
+        while (true) {
+            TileFunction task;
+            int spp, firstSample;
+            {
+                unique_lock<mutex> lock(stateMutex);
+                startCondition.wait(lock, [&] { return shutdown || generation != seenGeneration; });
+                if (shutdown) return;
+                seenGeneration = generation;
+                task = currentTask;
+                spp = currentSamples;
+                firstSample = currentFirstSample;
+                busyWorkers++;
+            }
+
+            int tileIndex;
+            while (popLocal(id, tileIndex) || steal(id, tileIndex)) {
+                Tile& tile = tiles[tileIndex];
+
+                auto start = chrono::steady_clock::now();
+                task(tile, spp, firstSample);
+                double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+                tile.lastPassMs = ms;
+                tile.totalMs += ms;
+
+                lock_guard<mutex> lock(stateMutex);
+                pending--;
+            }
+
+            {
+                lock_guard<mutex> lock(stateMutex);
+                busyWorkers--;
+            }
+            doneCondition.notify_all();
+        }
+    }
+};
+
+
+#endif
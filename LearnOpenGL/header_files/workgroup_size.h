@@ -0,0 +1,122 @@
+#ifndef WORKGROUP_SIZE_H
+#define WORKGROUP_SIZE_H
+
+
+#include <glad/glad.h>
+
+#include <shader_c.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+using namespace std;
+
+// the local size of the path tracing shader, compiled in as WORKGROUP_WIDTH/HEIGHT
+struct WorkgroupSize
+{
+    int width = 8;
+    int height = 8;
+
+    bool operator==(const WorkgroupSize& other) const { return width == other.width && height == other.height; }
+    string name() const { return to_string(width) + "x" + to_string(height); }
+};
+
+// the shapes --tune-workgroup tries, the default first. 10x10 was the original local size and
+// is kept to compare against; the others are multiples of 32 and 64 invocations so no SIMD
+// lanes sit idle
+const WorkgroupSize WORKGROUP_CANDIDATES[] = {
+    { 8, 8 }, { 10, 10 }, { 16, 4 }, { 16, 8 }, { 8, 16 }, { 32, 2 }, { 32, 4 }, { 64, 1 }, { 16, 16 }, { 32, 8 }
+};
+const WorkgroupSize WORKGROUP_ORIGINAL = { 10, 10 };
+
+// results of --tune-workgroup: one "<width>x<height> <driver>" line per driver with the fastest
+// shape, and a "!<width>x<height> <driver>" line for each shape that rendered a different image
+// with that driver
+const string WORKGROUP_CACHE_FILE = string(SHADER_CACHE_DIRECTORY) + "/workgroup.txt";
+
+// shaderCacheDriver() on one line
+string workgroupDriverKey()
+{
+    string key = shaderCacheDriver();
+    for (char& c : key) {
+        if (c == '\n') c = '|';
+    }
+    return key;
+}
+
+// false if the shape needs more invocations than the device allows in one workgroup
+bool workgroupSupported(const WorkgroupSize& size)
+{
+    GLint maxInvocations = 0, maxWidth = 0, maxHeight = 0;
+    glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+    glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxWidth);
+    glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 1, &maxHeight);
+    return size.width * size.height <= maxInvocations && size.width <= maxWidth && size.height <= maxHeight;
+}
+
+// the shape tuned for the current driver, false if it has not been tuned yet
+bool loadTunedWorkgroupSize(WorkgroupSize& size)
+{
+    ifstream file(WORKGROUP_CACHE_FILE);
+    string key = workgroupDriverKey();
+    string line;
+    while (getline(file, line)) {
+        WorkgroupSize tuned;
+        size_t space = line.find(' ');
+        if (space == string::npos || line.compare(space + 1, string::npos, key) != 0) continue;
+        if (sscanf(line.c_str(), "%dx%d", &tuned.width, &tuned.height) == 2 && workgroupSupported(tuned)) {
+            size = tuned;
+            return true;
+        }
+    }
+    return false;
+}
+
+// true if --tune-workgroup saw the shape render a different image with the current driver
+bool workgroupDiffers(const WorkgroupSize& size)
+{
+    ifstream file(WORKGROUP_CACHE_FILE);
+    string marked = "!" + size.name() + " " + workgroupDriverKey();
+    string line;
+    while (getline(file, line)) {
+        if (line == marked) return true;
+    }
+    return false;
+}
+
+// replaces the current driver's lines and keeps every other driver's
+bool saveTunedWorkgroupSize(const WorkgroupSize& size, const vector<WorkgroupSize>& differing)
+{
+    string key = workgroupDriverKey();
+    vector<string> lines;
+    {
+        ifstream file(WORKGROUP_CACHE_FILE);
+        string line;
+        while (getline(file, line)) {
+            size_t space = line.find(' ');
+            if (space != string::npos && line.compare(space + 1, string::npos, key) == 0) continue;
+            lines.push_back(line);
+        }
+    }
+    lines.push_back(size.name() + " " + key);
+    for (const WorkgroupSize& shape : differing) {
+        lines.push_back("!" + shape.name() + " " + key);
+    }
+
+    makeShaderCacheDirectory();
+    ofstream file(WORKGROUP_CACHE_FILE);
+    for (const string& line : lines) {
+        file << line << "\n";
+    }
+    if (!file) {
+        cout << "Could not write " << WORKGROUP_CACHE_FILE << endl;
+        return false;
+    }
+    return true;
+}
+
+
+#endif
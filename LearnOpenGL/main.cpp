@@ -1,12 +1,20 @@
-
 #include <iostream>
 #include <ogl_path_trace.h>
+#include <batch_render.h>
 
 
 int main(int argc, char* argv[])
 {
-	run();
+	RenderSettings settings;
+	if (!parse_arguments(argc, argv, settings)) {
+		return EXIT_FAILURE;
+	}
+
+	if (settings.batch) {
+		return runBatch(settings);
+	}
+
+	run(settings);
 
 	return 0;
 }
-
@@ -0,0 +1,196 @@
+#version 430 core
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+// Temporal reprojection: when the camera moves, the viewer restarts the accumulation, and
+// this pass carries what the old view had converged to over into the new one instead of
+// showing a single noisy sample. It runs twice per restart:
+//   step 0, before the first dispatch of the new accumulation, saves every pixel's displayed
+//   color, its weight in samples and its first hit into history, at the old view's size;
+//   step 1, after that dispatch, follows each pixel's new first hit back into the old view,
+//   takes the history there (bilinear over the taps whose first hit matches), clamps it to
+//   the range of the new samples around the pixel and stores it in reprojected.
+// The resolve pass and the denoiser blend reprojected in with the weight of that many
+// samples, so it fades out as real samples accumulate and the result converges to the same
+// image as without it. Nothing here traces rays.
+
+// written by computeShader.c, see the layouts there
+struct PixelStats
+{
+    dvec4 sum;
+    vec4 mean;
+    vec4 m2;
+};
+layout(std430, binding = 10) readonly buffer PixelStatsBlock
+{
+    PixelStats pixelStats[];
+};
+
+layout(std430, binding = 12) readonly buffer AovBlock
+{
+    vec4 pixelAovs[];
+};
+
+// HISTORY_ENTRIES per pixel of the old view: color and weight, normal and hit distance
+layout(std430, binding = 20) buffer HistoryBlock
+{
+    vec4 history[];
+};
+
+// per pixel of the new view: the clamped history color and its weight in samples, 0 where
+// nothing could be reused
+layout(std430, binding = 21) buffer ReprojectedBlock
+{
+    vec4 reprojected[];
+};
+
+layout(location = 0) uniform int reprojectStep;
+layout(location = 1) uniform ivec2 imageDims;             // of the new accumulation
+layout(location = 2) uniform ivec2 historyDims;           // of the view the history was saved from
+layout(location = 3) uniform vec4 cameraPosition;
+layout(location = 4) uniform vec4 cameraDirection;
+layout(location = 5) uniform vec4 historyCameraPosition;
+layout(location = 6) uniform vec4 historyCameraDirection;
+
+const int AOV_ENTRIES = 3;
+const int HISTORY_ENTRIES = 2;
+
+const float REPROJECT_MAX_SAMPLES = 16.0; // weight of the history at most, in samples
+const float DEPTH_TOLERANCE = 0.05;       // relative difference of the hit distances
+const float NORMAL_TOLERANCE = 0.9;       // cosine between the normals
+
+// the pixel's mean with the reprojected history blended in, w = weight in samples. keep in
+// sync with resolveShader.c and denoiseShader.c
+vec4 blendedColor(uint pixelIndex)
+{
+    vec4 mean = pixelStats[pixelIndex].mean;
+    vec4 previous = reprojected[pixelIndex];
+    if (previous.w <= 0.0) {
+        return mean;
+    }
+    float weight = mean.w + previous.w;
+    return vec4((mean.rgb * mean.w + previous.rgb * previous.w) / weight, weight);
+}
+
+// the camera of computeShader.c's main(): direction = forward + right * x + up * y, with x
+// and y in [-0.5, 0.5] across the image
+void cameraBasis(vec4 direction, ivec2 dims, out vec3 forward, out vec3 right, out vec3 up)
+{
+    forward = normalize(direction.xyz);
+    right = normalize(cross(forward, vec3(0.0, 0.0, 1.0)));
+    up = normalize(cross(right, forward)) * float(dims.y) / float(dims.x);
+}
+
+// where direction d from the camera lands on its image, in pixels (the centers are at +0.5).
+// false behind the camera
+bool project(vec3 d, vec4 direction, ivec2 dims, out vec2 p)
+{
+    vec3 forward, right, up;
+    cameraBasis(direction, dims, forward, right, up);
+    float depth = dot(d, forward);
+    if (depth <= 0.0) {
+        return false;
+    }
+    d /= depth;
+    p = (vec2(dot(d, right), dot(d, up) / dot(up, up)) + 0.5) * vec2(dims);
+    return true;
+}
+
+void saveHistory(ivec2 p)
+{
+    uint pixelIndex = uint(p.y * historyDims.x + p.x);
+    vec4 color = blendedColor(pixelIndex);
+    history[HISTORY_ENTRIES * pixelIndex] = vec4(color.rgb, min(color.w, REPROJECT_MAX_SAMPLES));
+    history[HISTORY_ENTRIES * pixelIndex + 1] = pixelAovs[AOV_ENTRIES * pixelIndex];
+}
+
+// does the old view's first hit at pixel q match the new one? sky only matches sky
+bool historyMatches(ivec2 q, vec4 normalDepth, float expectedDepth)
+{
+    vec4 previous = history[HISTORY_ENTRIES * (q.y * historyDims.x + q.x) + 1];
+    if (normalDepth.w <= 0.0 || previous.w <= 0.0) {
+        return normalDepth.w <= 0.0 && previous.w <= 0.0;
+    }
+    if (abs(previous.w - expectedDepth) > DEPTH_TOLERANCE * expectedDepth) {
+        return false;
+    }
+    // averaged over the samples, so shorter than 1 along edges
+    float lengths = length(previous.xyz) * length(normalDepth.xyz);
+    return lengths > 0.0 && dot(previous.xyz, normalDepth.xyz) > NORMAL_TOLERANCE * lengths;
+}
+
+void reproject(ivec2 p)
+{
+    uint pixelIndex = uint(p.y * imageDims.x + p.x);
+    vec4 normalDepth = pixelAovs[AOV_ENTRIES * pixelIndex];
+
+    // the pixel's first hit, or only its direction for the sky
+    vec3 forward, right, up;
+    cameraBasis(cameraDirection, imageDims, forward, right, up);
+    vec2 offset = (vec2(p) + 0.5) / vec2(imageDims) - 0.5;
+    vec3 direction = normalize(forward + right * offset.x + up * offset.y);
+    vec3 previousDirection = direction;
+    float expectedDepth = 0.0;
+    if (normalDepth.w > 0.0) {
+        vec3 hit = cameraPosition.xyz + direction * normalDepth.w;
+        previousDirection = hit - historyCameraPosition.xyz;
+        expectedDepth = length(previousDirection);
+    }
+
+    vec2 q;
+    vec4 color = vec4(0.0);
+    float weightSum = 0.0;
+    if (project(previousDirection, historyCameraDirection, historyDims, q)) {
+        q -= 0.5;
+        ivec2 q0 = ivec2(floor(q));
+        vec2 f = q - vec2(q0);
+        for (int y = 0; y <= 1; y++) {
+            for (int x = 0; x <= 1; x++) {
+                ivec2 tap = q0 + ivec2(x, y);
+                if (tap.x < 0 || tap.y < 0 || tap.x >= historyDims.x || tap.y >= historyDims.y) {
+                    continue;
+                }
+                if (!historyMatches(tap, normalDepth, expectedDepth)) {
+                    continue;
+                }
+                float w = (x == 1 ? f.x : 1.0 - f.x) * (y == 1 ? f.y : 1.0 - f.y);
+                color += history[HISTORY_ENTRIES * (tap.y * historyDims.x + tap.x)] * w;
+                weightSum += w;
+            }
+        }
+    }
+    if (weightSum < 0.01) {
+        reprojected[pixelIndex] = vec4(0.0); // disoccluded or off screen before
+        return;
+    }
+    color /= weightSum;
+
+    // neighbourhood clamp: history outside the range of the new samples around the pixel is
+    // most likely a surface that moved or changed shading, not one the samples missed
+    vec3 low = vec3(1e30);
+    vec3 high = vec3(-1e30);
+    for (int y = -1; y <= 1; y++) {
+        for (int x = -1; x <= 1; x++) {
+            ivec2 n = clamp(p + ivec2(x, y), ivec2(0), imageDims - 1);
+            vec3 c = pixelStats[n.y * imageDims.x + n.x].mean.rgb;
+            low = min(low, c);
+            high = max(high, c);
+        }
+    }
+    reprojected[pixelIndex] = vec4(clamp(color.rgb, low, high), color.w);
+}
+
+void main()
+{
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    ivec2 dims = reprojectStep == 0 ? historyDims : imageDims;
+    if (p.x >= dims.x || p.y >= dims.y) {
+        return;
+    }
+    if (reprojectStep == 0) {
+        saveHistory(p);
+    }
+    else {
+        reproject(p);
+    }
+}
@@ -0,0 +1,107 @@
+#version 430 core
+
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+
+// Turns the accumulation buffers of computeShader.c into the display texture the screen quad
+// samples, in the layer displayMode selects. The path tracer never touches the texture, so
+// the display can be rgba16f (DISPLAY_FORMAT) while the accumulation keeps full precision.
+// header_files/aov.h has the CPU twin of displayColor.
+
+#ifndef DISPLAY_FORMAT
+#define DISPLAY_FORMAT rgba32f
+#endif
+
+// written by computeShader.c, see the layouts there
+struct PixelStats
+{
+    dvec4 sum;
+    vec4 mean;
+    vec4 m2;
+};
+layout(std430, binding = 10) readonly buffer PixelStatsBlock
+{
+    PixelStats pixelStats[];
+};
+
+layout(std430, binding = 12) readonly buffer AovBlock
+{
+    vec4 pixelAovs[];
+};
+
+// history carried over from before the last camera move, see reprojectShader.c
+layout(std430, binding = 21) readonly buffer ReprojectedBlock
+{
+    vec4 reprojected[];
+};
+
+// only filled while computeShader.c is built with RAY_STATS, which displayMode 5 implies
+layout(std430, binding = 19) readonly buffer RayStatsBlock
+{
+    uvec4 rayStatTotals;
+    uvec4 pixelRayStats[];
+};
+
+layout(DISPLAY_FORMAT, binding = 0) uniform writeonly image2D displayImage;
+
+layout(location = 0) uniform int displayMode;
+layout(location = 1) uniform ivec2 imageDims; // the rendered corner of displayImage, which is sized for the full resolution
+
+const int AOV_ENTRIES = 3;
+
+// the pixel's mean with the reprojected history blended in, w = weight in samples. keep in
+// sync with reprojectShader.c and denoiseShader.c
+vec4 blendedColor(uint pixelIndex)
+{
+    vec4 mean = pixelStats[pixelIndex].mean;
+    vec4 previous = reprojected[pixelIndex];
+    if (previous.w <= 0.0) {
+        return mean;
+    }
+    float weight = mean.w + previous.w;
+    return vec4((mean.rgb * mean.w + previous.rgb * previous.w) / weight, weight);
+}
+
+const float HEATMAP_MAX_NODES = 256.0; // nodes visited per ray at the top of the color scale
+
+// BVH nodes visited per ray on a square root scale, blue (none) through green and yellow to red
+vec4 traversalHeatmap(uvec4 stats)
+{
+    float nodesPerRay = float(stats.x) / max(float(stats.w), 1.0);
+    float x = sqrt(clamp(nodesPerRay / HEATMAP_MAX_NODES, 0.0, 1.0));
+    const vec3 stops[4] = vec3[4](vec3(0.05, 0.1, 0.6), vec3(0.1, 0.8, 0.3), vec3(1.0, 0.85, 0.1), vec3(0.9, 0.05, 0.05));
+    float f = x * 3.0;
+    int i = min(int(f), 2);
+    return vec4(mix(stops[i], stops[i + 1], f - float(i)), 1.0);
+}
+
+// the layer displayMode selects: 1 color, 2 normals, 3 albedo, 4 distance, 5 BVH nodes
+// visited per ray
+vec4 displayColor(uint pixelIndex)
+{
+    vec4 normalDepth = pixelAovs[AOV_ENTRIES * pixelIndex];
+    if (displayMode == 5) {
+        return traversalHeatmap(pixelRayStats[pixelIndex]);
+    }
+    if (displayMode == 2) {
+        return vec4((normalDepth.xyz + 1.0) * 0.5, 1.0);
+    }
+    if (displayMode == 3) {
+        return vec4(pixelAovs[AOV_ENTRIES * pixelIndex + 1].rgb, 1.0);
+    }
+    if (displayMode == 4) {
+        float s = normalDepth.w;
+        float distance = (1.0 - sqrt(s + 1) / (s + 1.0));
+        return vec4(vec3(distance * distance), 1.0);
+    }
+    return vec4(blendedColor(pixelIndex).rgb, 1.0);
+}
+
+void main()
+{
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    ivec2 dims = imageDims;
+    if (p.x >= dims.x || p.y >= dims.y) {
+        return;
+    }
+    imageStore(displayImage, p, displayColor(uint(p.y * dims.x + p.x)));
+}
@@ -6,6 +6,9 @@ out vec4 FragColor;
 in vec2 TexCoords;
 
 uniform sampler2D tex;
+// the corner of tex that holds this frame's image, all of it unless the render scale or the
+// dynamic resolution of a moving camera shrinks it
+uniform ivec2 imageDims;
 
 //layout(location = 1) uniform int var_name;
 
@@ -25,9 +28,25 @@ vec4 ACESFilmCol(vec3 val)
     return vec4(ACESFilm(val.r), ACESFilm(val.g), ACESFilm(val.b), 1.0);
 }
 
+// bilinear upscale of the imageDims corner of tex to the whole window. filtered here instead
+// of by the sampler so it never blends in the texels past the corner; at the full resolution
+// every fragment lands on a texel center and gets exactly that texel
+vec3 upscale(vec2 uv)
+{
+    vec2 p = uv * vec2(imageDims) - 0.5;
+    ivec2 i = ivec2(floor(p));
+    vec2 f = p - floor(p);
+    ivec2 last = imageDims - 1;
+    vec3 c00 = texelFetch(tex, clamp(i, ivec2(0), last), 0).rgb;
+    vec3 c10 = texelFetch(tex, clamp(i + ivec2(1, 0), ivec2(0), last), 0).rgb;
+    vec3 c01 = texelFetch(tex, clamp(i + ivec2(0, 1), ivec2(0), last), 0).rgb;
+    vec3 c11 = texelFetch(tex, clamp(i + ivec2(1, 1), ivec2(0), last), 0).rgb;
+    return mix(mix(c00, c10, f.x), mix(c01, c11, f.x), f.y);
+}
+
 void main()
 {
-    vec3 texCol = texture(tex, TexCoords).rgb;
+    vec3 texCol = upscale(TexCoords);
     vec4 color_graded = ACESFilmCol(texCol);
     FragColor = color_graded;
 }